@@ -11,43 +11,23 @@
 #include "iroffer_headers.h"
 #include "iroffer_globals.h"
 
+#include "parsing.h"
 #include "autosend.h"
 
-void autosendf(char* line) {
+void autosendf(const ir_line_t* l) {
     char *nick, *hostname, *hostmask;
-    int i, j;
 
     updatecontext();
 
     floodchk();
 
-    nick = mycalloc(maxtextlengthshort);
-    hostname = mycalloc(maxtextlength);
-
-    hostmask = caps(getpart(line, 1));
-    for (i = 1; i <= sstrlen(hostmask); i++) {
-        hostmask[i - 1] = hostmask[i];
-    }
-
-    i = 1;
-    j = 0;
-    while (line[i] != '!' && i < sstrlen(line) && i < maxtextlengthshort - 1) {
-        nick[i - 1] = line[i];
-        i++;
+    if (!l->host.ptr) {
+        return;
     }
-    nick[i - 1] = '\0';
 
-    while (line[i] != '@' && i < sstrlen(line)) {
-        i++;
-    }
-    i++;
-
-    while (line[i] != ' ' && i < sstrlen(line) && j < maxtextlength - 1) {
-        hostname[j] = line[i];
-        i++;
-        j++;
-    }
-    hostname[j] = '\0';
+    nick = ir_slice_dup(&gdata.parsearena, l->nick);
+    hostname = ir_slice_dup(&gdata.parsearena, l->host);
+    hostmask = ir_line_caps(l, 1) + 1;
 
     if (!gdata.ignore) {
         char* tempstr;
@@ -73,7 +53,4 @@ void autosendf(char* line) {
 
         mydelete(tempstr);
     }
-
-    mydelete(nick);
-    mydelete(hostname);
 }
@@ -9,6 +9,6 @@
 #ifndef IROFFER_AUTOSEND_H
 #define IROFFER_AUTOSEND_H
 
-void autosendf(char* line);
+void autosendf(const ir_line_t* l);
 
 #endif // IROFFER_AUTOSEND_H
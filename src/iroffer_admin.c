@@ -354,7 +354,6 @@ static void u_respond(const userinput* const u, const char* format, ...) {
                  args);
         break;
     case method_fd: {
-        ssize_t retval;
         char tempstr[maxtextlength];
         int llen;
 
@@ -372,11 +371,7 @@ static void u_respond(const userinput* const u, const char* format, ...) {
         tempstr[llen++] = '\n';
         tempstr[llen] = '\0';
 
-        retval = write(u->fd, tempstr, strlen(tempstr));
-        if (retval < 0) {
-            outerror(OUTERROR_TYPE_WARN_LOUD, "Write failed: %s",
-                     strerror(errno));
-        }
+        ir_boutput_write(u->bout, tempstr, llen);
     } break;
     case method_msg:
         vprivmsg(u->snick, format, args);
@@ -485,10 +480,170 @@ static void u_help(const userinput* const u) {
               "http://iroffer.org/");
 }
 
+/*
+ * The pack lines of XDL are kept rendered in the packs, only the header
+ * and footer are formatted each time.  A pack renders again when it was
+ * marked with xdcc_dirty(), got another number or the gets column got
+ * wider, and all do when the default speeds or xdcclistfileraw change.
+ * The full and minimal listings share the lines, the summary has none.
+ * The xdcclistjson keeps its pack objects the same way.
+ */
+static int u_xdl_width(void) {
+    int i, gets;
+
+    if ((gdata.xdl.minspeed != gdata.transferminspeed) ||
+        (gdata.xdl.maxspeed != gdata.transfermaxspeed) ||
+        (gdata.xdl.raw != gdata.xdcclistfileraw)) {
+        for (i = 0; i < gdata.packs.count; i++) {
+            xdcc_dirty(gdata.packs.pack[i]);
+        }
+        gdata.xdl.minspeed = gdata.transferminspeed;
+        gdata.xdl.maxspeed = gdata.transfermaxspeed;
+        gdata.xdl.raw = gdata.xdcclistfileraw;
+    }
+
+    if (!gdata.xdl.width) {
+        for (i = 0, gets = 0; i < gdata.packs.count; i++) {
+            gets = max2(gets, gdata.packs.pack[i]->gets);
+        }
+        gdata.xdl.width = 5;
+        if (gets < 10000) {
+            gdata.xdl.width = 4;
+        }
+        if (gets < 1000) {
+            gdata.xdl.width = 3;
+        }
+        if (gets < 100) {
+            gdata.xdl.width = 2;
+        }
+        if (gets < 10) {
+            gdata.xdl.width = 1;
+        }
+    }
+
+    return gdata.xdl.width;
+}
+
+/* str as a quoted JSON string, to be freed by the caller */
+static char* u_json_string(const char* str) {
+    const unsigned char* s;
+    char *json, *j;
+
+    json = j = mymalloc(strlen(str) * 6 + 3);
+
+    *j++ = '"';
+    for (s = (const unsigned char*)str; *s; s++) {
+        if ((*s == '"') || (*s == '\\')) {
+            *j++ = '\\';
+            *j++ = *s;
+        } else if (*s < 0x20) {
+            j += sprintf(j, "\\u%04x", *s);
+        } else {
+            *j++ = *s;
+        }
+    }
+    *j++ = '"';
+    *j = '\0';
+
+    return json;
+}
+
+static const char* u_xdl_json_pack(xdcc* xd) {
+    char *desc, *note;
+    int len;
+
+    desc = u_json_string(xd->desc ? xd->desc : "");
+    note = u_json_string(xd->note ? xd->note : "");
+
+    len = strlen(desc) + strlen(note) + 128;
+    xd->xdl[XDL_STYLE_JSON] = mymalloc(len);
+    snprintf(xd->xdl[XDL_STYLE_JSON], len,
+             "{\"pack\": %i, \"gets\": %i, \"size\": %lld, \"desc\": %s, "
+             "\"note\": %s}",
+             xd->packnum, xd->gets, (long long)xd->st_size, desc, note);
+
+    mydelete(desc);
+    mydelete(note);
+
+    return xd->xdl[XDL_STYLE_JSON];
+}
+
+static const char* u_xdl_line(xdcc* xd, xdl_style_e style, int s) {
+    const char* spaces[] = {"", " ", "  ", "   ", "    ", "     ", "      "};
+    char *line, *note, *sizestrstr;
+    int i, len, nlen;
+
+    if ((xd->xdl_packnum != xd->packnum) || (xd->xdl_width != s)) {
+        for (i = 0; i < NUMBER_XDL_STYLES; i++) {
+            mydelete(xd->xdl[i]);
+        }
+        xd->xdl_packnum = xd->packnum;
+        xd->xdl_width = s;
+    }
+
+    if (xd->xdl[style]) {
+        return xd->xdl[style];
+    }
+
+    if (style == XDL_STYLE_JSON) {
+        return u_xdl_json_pack(xd);
+    }
+
+    line = mycalloc(maxtextlength);
+    note = mycalloc(maxtextlength);
+
+    sizestrstr = sizestr(1, xd->st_size);
+    snprintf(line, maxtextlength - 1, "\2#%-2i\2 %*ix [%s] %s", xd->packnum,
+             s, xd->gets, sizestrstr, xd->desc);
+    len = strlen(line);
+    mydelete(sizestrstr);
+
+    if (xd->minspeed > 0 && xd->minspeed != gdata.transferminspeed) {
+        snprintf(line + len, maxtextlength - 1 - len, " [%1.1fK Min]",
+                 xd->minspeed);
+        len = strlen(line);
+    }
+
+    if (xd->maxspeed > 0 && xd->maxspeed != gdata.transfermaxspeed) {
+        snprintf(line + len, maxtextlength - 1 - len, " [%1.1fK Max]",
+                 xd->maxspeed);
+        len = strlen(line);
+    }
+
+    if (xd->note && strlen(xd->note)) {
+        snprintf(note, maxtextlength - 1, " \2^-\2%s%s", spaces[s], xd->note);
+    }
+
+    if (style == XDL_STYLE_FILE) {
+        if (!gdata.xdcclistfileraw) {
+            removenonprintablectrl(line);
+            removenonprintablectrl(note);
+        }
+        len = strlen(line);
+        nlen = strlen(note);
+        xd->xdl[style] = mymalloc(len + nlen + 3);
+        sprintf(xd->xdl[style], "%s\n", line);
+        if (nlen) {
+            sprintf(xd->xdl[style] + len + 1, "%s\n", note);
+        }
+    } else {
+        nlen = strlen(note);
+        xd->xdl[style] = mymalloc(len + nlen + 2);
+        strcpy(xd->xdl[style], line);
+        strcpy(xd->xdl[style] + len + 1, note);
+    }
+
+    mydelete(line);
+    mydelete(note);
+
+    return xd->xdl[style];
+}
+
 static void u_xdl(const userinput* const u) {
     char* tempstr;
-    const char* spaces[] = {"", " ", "  ", "   ", "    ", "     ", "      "};
+    const char* line;
     int a, i, m, m1, s;
+    xdl_style_e style;
     float toffered;
     int len;
     xdcc* xd;
@@ -577,6 +732,25 @@ static void u_xdl(const userinput* const u) {
 
         u_respond(u, "%s", tempstr);
 
+        if (irlist_size(&gdata.uploads) || gdata.uploadmaxspeed) {
+            for (i = 0, xdccsent = 0; i < XDCC_SENT_SIZE; i++) {
+                xdccsent += (uint64_t)gdata.xdccrecv[i];
+            }
+
+            snprintf(tempstr, maxtextlength - 1,
+                     "\2**\2 Upload Bandwidth \2**\2 Current: %1.1fKB/s",
+                     ((float)xdccsent) / XDCC_SENT_SIZE / 1024.0);
+            len = strlen(tempstr);
+
+            if (gdata.uploadmaxspeed) {
+                snprintf(tempstr + len, maxtextlength - 1 - len,
+                         ", Cap: %i.0KB/s", gdata.uploadmaxspeed / 4);
+                len = strlen(tempstr);
+            }
+
+            u_respond(u, "%s", tempstr);
+        }
+
         u_respond(
             u, "\2**\2 To request a file, type \"/msg %s xdcc send #x\" \2**\2",
             (gdata.user_nick ? gdata.user_nick : "??"));
@@ -601,60 +775,24 @@ static void u_xdl(const userinput* const u) {
         return;
     }
 
-    s = 0;
-    xd = irlist_get_head(&gdata.xdccs);
-    while (xd) {
-        s = max2(s, xd->gets);
-        xd = irlist_get_next(xd);
-    }
-    i = s;
-    s = 5;
-    if (i < 10000) {
-        s = 4;
-    }
-    if (i < 1000) {
-        s = 3;
-    }
-    if (i < 100) {
-        s = 2;
-    }
-    if (i < 10) {
-        s = 1;
-    }
+    s = u_xdl_width();
+    style = (u->method == method_fd) ? XDL_STYLE_FILE : XDL_STYLE_IRC;
 
-    i = 1;
     toffered = 0;
-    xd = irlist_get_head(&gdata.xdccs);
-    while (xd) {
-        char* sizestrstr;
+    for (i = 0; i < gdata.packs.count; i++) {
+        xd = gdata.packs.pack[i];
         toffered += (float)xd->st_size;
 
-        sizestrstr = sizestr(1, xd->st_size);
-        snprintf(tempstr, maxtextlength - 1, "\2#%-2i\2 %*ix [%s] %s", i, s,
-                 xd->gets, sizestrstr, xd->desc);
-        len = strlen(tempstr);
-        mydelete(sizestrstr);
-
-        if (xd->minspeed > 0 && xd->minspeed != gdata.transferminspeed) {
-            snprintf(tempstr + len, maxtextlength - 1 - len, " [%1.1fK Min]",
-                     xd->minspeed);
-            len = strlen(tempstr);
-        }
-
-        if (xd->maxspeed > 0 && xd->maxspeed != gdata.transfermaxspeed) {
-            snprintf(tempstr + len, maxtextlength - 1 - len, " [%1.1fK Max]",
-                     xd->maxspeed);
-            len = strlen(tempstr);
-        }
-
-        u_respond(u, "%s", tempstr);
-
-        if (xd->note && strlen(xd->note)) {
-            u_respond(u, " \2^-\2%s%s", spaces[s], xd->note);
+        line = u_xdl_line(xd, style, s);
+        if (style == XDL_STYLE_FILE) {
+            ir_boutput_write(u->bout, line, strlen(line));
+        } else {
+            u_respond(u, "%s", line);
+            line += strlen(line) + 1;
+            if (*line) {
+                u_respond(u, "%s", line);
+            }
         }
-
-        i++;
-        xd = irlist_get_next(xd);
     }
 
     if (gdata.creditline) {
@@ -678,6 +816,43 @@ static void u_xdl(const userinput* const u) {
     mydelete(tempstr);
 }
 
+void u_xdl_json(ir_boutput_t* bout) {
+    char *tempstr, *nick;
+    const char* pack;
+    int i, s;
+    unsigned long long toffered;
+
+    updatecontext();
+
+    tempstr = mycalloc(maxtextlength);
+
+    nick = u_json_string(gdata.user_nick ? gdata.user_nick : "");
+    snprintf(tempstr, maxtextlength - 1, "{\n  \"nick\": %s,\n  \"packs\": [",
+             nick);
+    ir_boutput_write(bout, tempstr, strlen(tempstr));
+    mydelete(nick);
+
+    s = u_xdl_width();
+    toffered = 0;
+    for (i = 0; i < gdata.packs.count; i++) {
+        toffered += gdata.packs.pack[i]->st_size;
+        pack = u_xdl_line(gdata.packs.pack[i], XDL_STYLE_JSON, s);
+        if (i) {
+            ir_boutput_write(bout, ",", 1);
+        }
+        ir_boutput_write(bout, "\n    ", 5);
+        ir_boutput_write(bout, pack, strlen(pack));
+    }
+
+    snprintf(tempstr, maxtextlength - 1,
+             "\n  ],\n  \"totaloffered\": %llu,\n  \"totaltransferred\": "
+             "%llu\n}\n",
+             toffered, gdata.totalsent);
+    ir_boutput_write(bout, tempstr, strlen(tempstr));
+
+    mydelete(tempstr);
+}
+
 static void u_xds(const userinput* const u) {
     updatecontext();
     write_statefile();
@@ -1150,10 +1325,14 @@ static void u_raw(const userinput* const u) {
 
 static void u_info(const userinput* const u) {
     int num = 0;
+    int num2;
     xdcc* xd;
+    xdcc* xd2;
+    xdcc* head;
     char* sizestrstr;
     char* sendnamestr;
     char tempstr[maxtextlengthshort];
+    char* dups;
 
     updatecontext();
 
@@ -1166,7 +1345,7 @@ static void u_info(const userinput* const u) {
         return;
     }
 
-    xd = irlist_get_nth(&gdata.xdccs, num - 1);
+    xd = xdcc_get(num);
 
     u_respond(u, "Pack Info for Pack #%i:", num);
 
@@ -1204,6 +1383,31 @@ static void u_info(const userinput* const u) {
         u_respond(u, " md5sum         " MD5_PRINT_FMT,
                   MD5_PRINT_DATA(xd->md5sum));
     }
+    if (xd->has_crc32) {
+        u_respond(u, " crc32          %08X", xd->crc32);
+    }
+    if (xd->has_sha256) {
+        char sha[(sizeof(SHA256Digest) * 2) + 1];
+        sha256_print(sha, xd->sha256);
+        u_respond(u, " sha256         %s", sha);
+    }
+
+    head = xd->dupof ? xd->dupof : xd;
+    if (!head->dup_next) {
+        return;
+    }
+
+    dups = mycalloc(maxtextlength);
+    for (xd2 = irlist_get_head(&gdata.xdccs), num2 = 1; xd2;
+         xd2 = irlist_get_next(xd2), num2++) {
+        if ((xd2 != xd) && ((xd2 == head) || (xd2->dupof == head))) {
+            snprintf(dups + strlen(dups), maxtextlength - strlen(dups) - 1,
+                     " #%i", num2);
+        }
+    }
+    u_respond(u, " Duplicates    %s%s", dups,
+              (xd == head) ? "" : " (shares I/O)");
+    mydelete(dups);
 }
 
 static void u_remove(const userinput* const u) {
@@ -1223,7 +1427,7 @@ static void u_remove(const userinput* const u) {
         return;
     }
 
-    xd = irlist_get_nth(&gdata.xdccs, num - 1);
+    xd = xdcc_get(num);
 
     tr = irlist_get_head(&gdata.trans);
     while (tr) {
@@ -1247,14 +1451,11 @@ static void u_remove(const userinput* const u) {
 
     u_respond(u, "Removed Pack %i [%s]", num, xd->desc);
 
-    if (gdata.md5build.xpack == xd) {
-        outerror(OUTERROR_TYPE_WARN, "[MD5]: Canceled (remove)");
+    md5build_cancel(xd, "remove");
 
-        FD_CLR(gdata.md5build.file_fd, &gdata.readset);
-        close(gdata.md5build.file_fd);
-        gdata.md5build.file_fd = FD_UNUSED;
-        gdata.md5build.xpack = NULL;
-    }
+    xdcc_dup_unlink(xd, 1);
+    fdcache_drop(xd);
+    blockcache_drop(xd);
 
     assert(xd->file_fd == FD_UNUSED);
     assert(xd->file_fd_count == 0);
@@ -1262,10 +1463,7 @@ static void u_remove(const userinput* const u) {
     assert(!irlist_size(&xd->mmaps));
 #endif
 
-    mydelete(xd->file);
-    mydelete(xd->desc);
-    mydelete(xd->note);
-    irlist_delete(&gdata.xdccs, xd);
+    xdcc_remove(xd);
 
     write_statefile();
     xdccsavetext();
@@ -1311,11 +1509,12 @@ static void u_removedir(const userinput* const u) {
         return;
     }
 
+    /* the state file and the xdcc list are written once at the end */
+    statefile_hold();
 
     while ((f = readdir(d))) {
         struct stat st;
         int len = strlen(f->d_name);
-        int n;
 
         tempstr = mycalloc(len + thedirlen + 2);
 
@@ -1331,26 +1530,15 @@ static void u_removedir(const userinput* const u) {
             continue;
         }
 
-        n = 0;
-        xd = irlist_get_head(&gdata.xdccs);
-        while (xd) {
-            n++;
-            if ((xd->st_dev == st.st_dev) && (xd->st_ino == st.st_ino)) {
-                userinput u2;
-                char tempstr2[8];
-
-                snprintf(tempstr2, 8, "%d", n);
+        while ((xd = xdcc_find_inode(st.st_dev, st.st_ino, NULL))) {
+            userinput u2;
+            char tempstr2[12];
 
-                u2 = *u;
-                u2.arg1 = tempstr2;
-                u_remove(&u2);
+            snprintf(tempstr2, sizeof(tempstr2), "%d", xd->packnum);
 
-                /* start over, the list has changed */
-                n = 0;
-                xd = irlist_get_head(&gdata.xdccs);
-            } else {
-                xd = irlist_get_next(xd);
-            }
+            u2 = *u;
+            u2.arg1 = tempstr2;
+            u_remove(&u2);
         }
 
         mydelete(tempstr);
@@ -1358,6 +1546,8 @@ static void u_removedir(const userinput* const u) {
 
     closedir(d);
 
+    statefile_release();
+
     mydelete(thedir);
 }
 
@@ -1583,7 +1773,7 @@ static void u_chfile(const userinput* const u) {
         return;
     }
 
-    xd = irlist_get_nth(&gdata.xdccs, num - 1);
+    xd = xdcc_get(num);
 
     tr = irlist_get_head(&gdata.trans);
     while (tr) {
@@ -1596,6 +1786,8 @@ static void u_chfile(const userinput* const u) {
     u_respond(u, "CHFILE: [Pack %i] Old: %s New: %s", num, xd->file,
               tempstr[0] ? tempstr : u->arg2e);
 
+    xdcc_unindex(xd);
+
     mydelete(xd->file);
     xd->file = mycalloc(strlen(tempstr[0] ? tempstr : u->arg2e) + 1);
 
@@ -1605,16 +1797,17 @@ static void u_chfile(const userinput* const u) {
     xd->st_ino = st.st_ino;
     xd->mtime = st.st_mtime;
 
-    if (gdata.md5build.xpack == xd) {
-        outerror(OUTERROR_TYPE_WARN, "[MD5]: Canceled (chfile)");
+    xdcc_index(xd);
+    xdcc_dirty(xd);
 
-        FD_CLR(gdata.md5build.file_fd, &gdata.readset);
-        close(gdata.md5build.file_fd);
-        gdata.md5build.file_fd = FD_UNUSED;
-        gdata.md5build.xpack = NULL;
-    }
-    xd->has_md5sum = 0;
-    memset(xd->md5sum, 0, sizeof(MD5Digest));
+    md5build_cancel(xd, "chfile");
+    xdcc_clear_digest(xd);
+    mydelete(xd->pieces.piece);
+    memset(&xd->pieces, 0, sizeof(xd->pieces));
+
+    xdcc_dup_unlink(xd, 0);
+    fdcache_drop(xd);
+    blockcache_drop(xd);
 
     assert(xd->file_fd == FD_UNUSED);
     assert(xd->file_fd_count == 0);
@@ -1626,202 +1819,112 @@ static void u_chfile(const userinput* const u) {
     xdccsavetext();
 }
 
-static void u_add(const userinput* const u) {
-    int xfiledescriptor;
-    struct stat st;
+/* a new pack for a file that was opened or stat()ed */
+static void u_add_file(const userinput* const u, const char* file,
+                       const struct stat* st) {
     xdcc* xd;
 
-    updatecontext();
+    if (!S_ISREG(st->st_mode)) {
+        u_respond(u, "%s is not a file", file);
+        return;
+    }
 
-    if (!u->arg1e || !strlen(u->arg1e)) {
-        u_respond(u, "Try Specifying a Filename");
+    if (st->st_size == 0) {
+        u_respond(u, "File has size of 0 bytes!");
+        return;
+    }
+
+    if ((st->st_size > gdata.max_file_size) || (st->st_size < 0)) {
+        u_respond(u, "File is too large.");
         return;
     }
 
-    xd = irlist_add(&gdata.xdccs, sizeof(xdcc));
+    xd = xdcc_add();
 
-    xd->file = mymalloc(strlen(u->arg1e) + 1);
-    strcpy(xd->file, u->arg1e);
+    xd->file = mymalloc(strlen(file) + 1);
+    strcpy(xd->file, file);
 
     xd->note = mymalloc(1);
     strcpy(xd->note, "");
 
-    xd->desc = mymalloc(strlen(getfilename(u->arg1e)) + 1);
-    strcpy(xd->desc, getfilename(u->arg1e));
-
-    convert_to_unix_slash(xd->file);
+    xd->desc = mymalloc(strlen(getfilename(file)) + 1);
+    strcpy(xd->desc, getfilename(file));
 
     xd->gets = 0;
     xd->minspeed = gdata.transferminspeed;
     xd->maxspeed = gdata.transfermaxspeed;
 
-    xfiledescriptor = open(xd->file, O_RDONLY);
-
-    if (xfiledescriptor < 0 && (errno == ENOENT) && gdata.filedir) {
-        mydelete(xd->file);
-        xd->file = mymalloc(strlen(gdata.filedir) + 1 + strlen(u->arg1e) + 1);
-        sprintf(xd->file, "%s/%s", gdata.filedir, u->arg1e);
-        convert_to_unix_slash(xd->file);
-        xfiledescriptor = open(xd->file, O_RDONLY);
-    }
-
-    if (xfiledescriptor < 0) {
-        u_respond(u, "Cant Access File: %s", strerror(errno));
-        mydelete(xd->file);
-        mydelete(xd->desc);
-        mydelete(xd->note);
-        irlist_delete(&gdata.xdccs, xd);
-        return;
-    }
-
-    if (fstat(xfiledescriptor, &st) < 0) {
-        u_respond(u, "Cant Access File Details: %s", strerror(errno));
-        mydelete(xd->file);
-        mydelete(xd->desc);
-        mydelete(xd->note);
-        irlist_delete(&gdata.xdccs, xd);
-        close(xfiledescriptor);
-        return;
-    }
-
-    if (!S_ISREG(st.st_mode)) {
-        u_respond(u, "%s is not a file", xd->file);
-        mydelete(xd->file);
-        mydelete(xd->desc);
-        mydelete(xd->note);
-        irlist_delete(&gdata.xdccs, xd);
-        close(xfiledescriptor);
-        return;
-    }
-
-    close(xfiledescriptor);
-
-    xd->st_size = st.st_size;
-    xd->st_dev = st.st_dev;
-    xd->st_ino = st.st_ino;
-    xd->mtime = st.st_mtime;
+    xd->st_size = st->st_size;
+    xd->st_dev = st->st_dev;
+    xd->st_ino = st->st_ino;
+    xd->mtime = st->st_mtime;
 
     xd->file_fd = FD_UNUSED;
     xd->file_fd_count = 0;
     xd->file_fd_location = 0;
 
-    if (xd->st_size == 0) {
-        u_respond(u, "File has size of 0 bytes!");
-        mydelete(xd->file);
-        mydelete(xd->desc);
-        mydelete(xd->note);
-        irlist_delete(&gdata.xdccs, xd);
-        return;
-    }
-
-    if ((xd->st_size > gdata.max_file_size) || (xd->st_size < 0)) {
-        u_respond(u, "File is too large.");
-        mydelete(xd->file);
-        mydelete(xd->desc);
-        mydelete(xd->note);
-        irlist_delete(&gdata.xdccs, xd);
-        return;
-    }
-
+    xdcc_index(xd);
 
     u_respond(
         u, "ADD PACK: [Pack: %i] [File: %s] Use CHDESC to change description",
         irlist_size(&gdata.xdccs), xd->file);
 
+    hashpool_dirty();
+
     write_statefile();
     xdccsavetext();
 }
 
-static void u_adddir(const userinput* const u) {
-    DIR* d;
-    struct dirent* f;
-    char *thefile, *tempstr, *thedir;
-    irlist_t dirlist = {};
-    int thedirlen;
+static void u_add(const userinput* const u) {
+    int xfiledescriptor;
+    struct stat st;
+    char* file;
 
     updatecontext();
 
     if (!u->arg1e || !strlen(u->arg1e)) {
-        u_respond(u, "Try Specifying a Directory");
+        u_respond(u, "Try Specifying a Filename");
         return;
     }
 
-    convert_to_unix_slash(u->arg1e);
-
-    if (u->arg1e[strlen(u->arg1e) - 1] == '/') {
-        u->arg1e[strlen(u->arg1e) - 1] = '\0';
-    }
-
-    thedirlen = strlen(u->arg1e);
-    if (gdata.filedir) {
-        thedirlen += strlen(gdata.filedir) + 1;
-    }
-
-    thedir = mymalloc(thedirlen + 1);
-    strcpy(thedir, u->arg1e);
+    file = mymalloc(strlen(u->arg1e) + 1);
+    strcpy(file, u->arg1e);
+    convert_to_unix_slash(file);
 
-    d = opendir(thedir);
+    xfiledescriptor = open(file, O_RDONLY);
 
-    if (!d && (errno == ENOENT) && gdata.filedir) {
-        snprintf(thedir, thedirlen + 1, "%s/%s", gdata.filedir, u->arg1e);
-        d = opendir(thedir);
+    if (xfiledescriptor < 0 && (errno == ENOENT) && gdata.filedir) {
+        mydelete(file);
+        file = mymalloc(strlen(gdata.filedir) + 1 + strlen(u->arg1e) + 1);
+        sprintf(file, "%s/%s", gdata.filedir, u->arg1e);
+        convert_to_unix_slash(file);
+        xfiledescriptor = open(file, O_RDONLY);
     }
 
-    if (!d) {
-        u_respond(u, "Can't Access Directory: %s", strerror(errno));
+    if (xfiledescriptor < 0) {
+        u_respond(u, "Cant Access File: %s", strerror(errno));
+        mydelete(file);
         return;
     }
 
-
-    while ((f = readdir(d))) {
-        struct stat st;
-        int len = strlen(f->d_name);
-
-        tempstr = mycalloc(len + thedirlen + 2);
-
-        snprintf(tempstr, len + thedirlen + 2, "%s/%s", thedir, f->d_name);
-
-        if (stat(tempstr, &st) < 0) {
-            u_respond(u, "cannot access %s, ignoring: %s", tempstr,
-                      strerror(errno));
-        } else if (strcmp(f->d_name, ".") != 0 &&
-                   strcmp(f->d_name, "..") != 0 && S_ISDIR(st.st_mode)) {
-            u_respond(u, "  Ignoring directory: %s", tempstr);
-        } else if (S_ISREG(st.st_mode)) {
-            thefile = irlist_add(&dirlist, len + thedirlen + 2);
-            strcpy(thefile, tempstr);
-        }
-        mydelete(tempstr);
+    if (fstat(xfiledescriptor, &st) < 0) {
+        u_respond(u, "Cant Access File Details: %s", strerror(errno));
+        close(xfiledescriptor);
+        mydelete(file);
+        return;
     }
 
-    closedir(d);
-
-    irlist_sort(&dirlist, irlist_sort_cmpfunc_string, NULL);
-
-    u_respond(u, "Adding %d files...", irlist_size(&dirlist));
-
-    thefile = irlist_get_head(&dirlist);
-    while (thefile) {
-        userinput u2;
-        u_respond(u, "  Adding %s:", thefile);
-
-        u2 = *u;
-        u2.arg1e = thefile;
-        u_add(&u2);
-
-        thefile = irlist_delete(&dirlist, thefile);
-    }
+    close(xfiledescriptor);
 
-    mydelete(thedir);
+    u_add_file(u, file, &st);
+    mydelete(file);
 }
 
-static void u_addnew(const userinput* const u) {
+/* ADDDIR and ADDNEW, the files are added by u_dirscan_done() */
+static void u_adddir_start(const userinput* const u, int addnew) {
     DIR* d;
-    struct dirent* f;
-    char *thefile, *tempstr, *thedir;
-    irlist_t dirlist = {};
-    int thedirlen, foundit;
-    xdcc* xd;
+    char* thedir;
+    int thedirlen;
 
     updatecontext();
 
@@ -1853,63 +1956,82 @@ static void u_addnew(const userinput* const u) {
 
     if (!d) {
         u_respond(u, "Can't Access Directory: %s", strerror(errno));
+        mydelete(thedir);
         return;
     }
 
+    u_respond(u, "Scanning %s...", thedir);
 
-    while ((f = readdir(d))) {
-        struct stat st;
-        int len = strlen(f->d_name);
+    dirscan_start(u, thedir, d, addnew);
 
-        tempstr = mycalloc(len + thedirlen + 2);
+    mydelete(thedir);
+}
 
-        snprintf(tempstr, len + thedirlen + 2, "%s/%s", thedir, f->d_name);
+static void u_adddir(const userinput* const u) {
+    u_adddir_start(u, 0);
+}
 
-        if (stat(tempstr, &st) < 0) {
-            u_respond(u, "cannot access %s, ignoring: %s", tempstr,
-                      strerror(errno));
-        } else if (strcmp(f->d_name, ".") != 0 &&
-                   strcmp(f->d_name, "..") != 0 && S_ISDIR(st.st_mode)) {
-            u_respond(u, "  Ignoring directory: %s", tempstr);
-        } else if (S_ISREG(st.st_mode)) {
-            foundit = 0;
-            xd = irlist_get_head(&gdata.xdccs);
-            while (xd) {
-                if (!strcmp(tempstr, xd->file)) {
-                    foundit = 1;
-                    break;
-                }
+static void u_addnew(const userinput* const u) {
+    u_adddir_start(u, 1);
+}
 
-                xd = irlist_get_next(xd);
-            }
+static int u_dirscan_cmp_entry(const void* a, const void* b) {
+    return strcmp((*(dirscan_entry_t* const*)a)->name,
+                  (*(dirscan_entry_t* const*)b)->name);
+}
 
-            if (foundit == 0) {
-                thefile = irlist_add(&dirlist, len + thedirlen + 2);
-                strcpy(thefile, tempstr);
-            }
+/* the entries of an ADDDIR or ADDNEW are stat()ed, add the files */
+void u_dirscan_done(dirscan_t* ds) {
+    const userinput* u = &ds->u;
+    dirscan_entry_t** files;
+    dirscan_entry_t* e;
+    char* tempstr;
+    int nfiles = 0, i;
+
+    updatecontext();
+
+    files = mymalloc(sizeof(dirscan_entry_t*) * (ds->count + 1));
+
+    for (i = 0; i < ds->count; i++) {
+        e = &ds->entries[i];
+        tempstr = mymalloc(strlen(ds->dir) + strlen(e->name) + 2);
+        sprintf(tempstr, "%s/%s", ds->dir, e->name);
+
+        if (e->error) {
+            u_respond(u, "cannot access %s, ignoring: %s", tempstr,
+                      strerror(e->error));
+        } else if (strcmp(e->name, ".") != 0 && strcmp(e->name, "..") != 0 &&
+                   S_ISDIR(e->st.st_mode)) {
+            u_respond(u, "  Ignoring directory: %s", tempstr);
+        } else if (S_ISREG(e->st.st_mode) &&
+                   (!ds->addnew || !xdcc_find_file(tempstr, NULL))) {
+            files[nfiles++] = e;
         }
         mydelete(tempstr);
     }
 
-    closedir(d);
-
-    irlist_sort(&dirlist, irlist_sort_cmpfunc_string, NULL);
+    qsort(files, nfiles, sizeof(dirscan_entry_t*), u_dirscan_cmp_entry);
 
-    u_respond(u, "Adding %d new files...", irlist_size(&dirlist));
-
-    thefile = irlist_get_head(&dirlist);
-    while (thefile) {
-        userinput u2;
-        u_respond(u, "  Adding %s:", thefile);
+    if (ds->addnew) {
+        u_respond(u, "Adding %d new files...", nfiles);
+    } else {
+        u_respond(u, "Adding %d files...", nfiles);
+    }
 
-        u2 = *u;
-        u2.arg1e = thefile;
-        u_add(&u2);
+    /* the state file and the xdcc list are written once at the end */
+    statefile_hold();
 
-        thefile = irlist_delete(&dirlist, thefile);
+    for (i = 0; i < nfiles; i++) {
+        tempstr = mymalloc(strlen(ds->dir) + strlen(files[i]->name) + 2);
+        sprintf(tempstr, "%s/%s", ds->dir, files[i]->name);
+        u_respond(u, "  Adding %s:", tempstr);
+        u_add_file(u, tempstr, &files[i]->st);
+        mydelete(tempstr);
     }
 
-    mydelete(thedir);
+    statefile_release();
+
+    mydelete(files);
 }
 
 static void u_chdesc(const userinput* const u) {
@@ -1932,15 +2054,20 @@ static void u_chdesc(const userinput* const u) {
         return;
     }
 
-    xd = irlist_get_nth(&gdata.xdccs, num - 1);
+    xd = xdcc_get(num);
 
     u_respond(u, "CHDESC: [Pack %i] Old: %s New: %s", num, xd->desc, u->arg2e);
 
+    xdcc_unindex(xd);
+
     mydelete(xd->desc);
     xd->desc = mymalloc(strlen(u->arg2e) + 1);
 
     strcpy(xd->desc, u->arg2e);
 
+    xdcc_index(xd);
+    xdcc_dirty(xd);
+
     write_statefile();
     xdccsavetext();
 }
@@ -1960,11 +2087,13 @@ static void u_chnote(const userinput* const u) {
         return;
     }
 
-    xd = irlist_get_nth(&gdata.xdccs, num - 1);
+    xd = xdcc_get(num);
 
     u_respond(u, "CHNOTE: [Pack %i] Old: %s New: %s", num, xd->note,
               u->arg2e ? u->arg2e : "");
 
+    xdcc_unindex(xd);
+
     mydelete(xd->note);
 
     if (!u->arg2e) {
@@ -1975,6 +2104,9 @@ static void u_chnote(const userinput* const u) {
         strcpy(xd->note, u->arg2e);
     }
 
+    xdcc_index(xd);
+    xdcc_dirty(xd);
+
     write_statefile();
     xdccsavetext();
 }
@@ -1999,7 +2131,7 @@ static void u_chmins(const userinput* const u) {
         return;
     }
 
-    xd = irlist_get_nth(&gdata.xdccs, num - 1);
+    xd = xdcc_get(num);
 
     u_respond(u, "CHMINS: [Pack %i] Old: %1.1f New: %1.1f", num, xd->minspeed,
               atof(u->arg2));
@@ -2008,6 +2140,7 @@ static void u_chmins(const userinput* const u) {
     if (atof(u->arg2) != gdata.transferminspeed) {
         xd->minspeed = atof(u->arg2);
     }
+    xdcc_dirty(xd);
 
     write_statefile();
     xdccsavetext();
@@ -2033,7 +2166,7 @@ static void u_chmaxs(const userinput* const u) {
         return;
     }
 
-    xd = irlist_get_nth(&gdata.xdccs, num - 1);
+    xd = xdcc_get(num);
 
     u_respond(u, "CHMAXS: [Pack %i] Old: %1.1f New: %1.1f", num, xd->maxspeed,
               atof(u->arg2));
@@ -2042,6 +2175,7 @@ static void u_chmaxs(const userinput* const u) {
     if (atof(u->arg2) != gdata.transfermaxspeed) {
         xd->maxspeed = atof(u->arg2);
     }
+    xdcc_dirty(xd);
 
     write_statefile();
     xdccsavetext();
@@ -2067,12 +2201,13 @@ static void u_chgets(const userinput* const u) {
         return;
     }
 
-    xd = irlist_get_nth(&gdata.xdccs, num - 1);
+    xd = xdcc_get(num);
 
     u_respond(u, "CHGETS: [Pack %i] Old: %d New: %d", num, xd->gets,
               atoi(u->arg2));
 
     xd->gets = atoi(u->arg2);
+    xdcc_dirty(xd);
 
     write_statefile();
     xdccsavetext();
@@ -2839,8 +2974,6 @@ static void u_nolist(const userinput* const u) {
 
 static void u_renumber(const userinput* const u) {
     int oldp = 0, newp = 0;
-    xdcc *xdo, *xdn;
-
     updatecontext();
 
     if (u->arg1) {
@@ -2858,16 +2991,7 @@ static void u_renumber(const userinput* const u) {
 
     u_respond(u, "** Moved pack %i to %i", oldp, newp);
 
-    /* get pack we are renumbering */
-    xdo = irlist_get_nth(&gdata.xdccs, oldp - 1);
-    irlist_remove(&gdata.xdccs, xdo);
-
-    if (newp == 1) {
-        irlist_insert_head(&gdata.xdccs, xdo);
-    } else {
-        xdn = irlist_get_nth(&gdata.xdccs, newp - 2);
-        irlist_insert_after(&gdata.xdccs, xdo, xdn);
-    }
+    xdcc_move(xdcc_get(oldp), newp);
 
     write_statefile();
     xdccsavetext();
@@ -2916,12 +3040,24 @@ static void u_msgdel(const userinput* const u) {
 }
 
 
+/* most live bytes first */
+static int u_memstat_site_cmp(const void* a, const void* b) {
+    const memsite_t* sa = *(const memsite_t* const*)a;
+    const memsite_t* sb = *(const memsite_t* const*)b;
+
+    if (sa->size != sb->size) {
+        return (sa->size < sb->size) - (sa->size > sb->size);
+    }
+    return (sa->total < sb->total) - (sa->total > sb->total);
+}
+
 static void u_memstat(const userinput* const u) {
     int i;
     long numcountrecent, sizecount;
     struct rusage r;
-#ifdef HAVE_MMAP
     xdcc* xd;
+    int fdcache_count;
+#ifdef HAVE_MMAP
     int mmap_count;
 #endif
 
@@ -2943,22 +3079,29 @@ static void u_memstat(const userinput* const u) {
               r.ru_nsignals, r.ru_nvcsw, r.ru_nivcsw);
 
     u_respond(u, "gdata:  %zu bytes", sizeof(gdata_t));
-
-    numcountrecent = sizecount = 0;
-    for (i = 0; i < (MEMINFOHASHSIZE * gdata.meminfo_depth); i++) {
-        if (gdata.meminfo[i].ptr != NULL) {
-            sizecount += gdata.meminfo[i].size;
-            if (gdata.meminfo[i].alloctime > gdata.curtime - 600) {
-                numcountrecent++;
+    u_respond(u, "parse arena: %d bytes in %d chunks", gdata.parsearena.size,
+              irlist_size(&gdata.parsearena.chunks));
+
+    u_respond(u, "heap:   %li bytes, %i allocations from %d places",
+              gdata.mem_size, gdata.mem_count, gdata.memsites_used);
+
+    if (gdata.meminfo_depth) {
+        numcountrecent = sizecount = 0;
+        for (i = 0; i < (MEMINFOHASHSIZE * gdata.meminfo_depth); i++) {
+            if (gdata.meminfo[i].ptr != NULL) {
+                sizecount += gdata.meminfo[i].size;
+                if (gdata.meminfo[i].alloctime > gdata.curtime - 600) {
+                    numcountrecent++;
+                }
             }
         }
-    }
 
-    u_respond(u,
-              "heap:   %li bytes, %i allocations (%li created in past 10 min) "
-              "(depth %d)",
-              sizecount, gdata.meminfo_count, numcountrecent,
-              gdata.meminfo_depth);
+        u_respond(u,
+                  "memdebug: %li bytes, %i allocations (%li created in past "
+                  "10 min) (depth %d)",
+                  sizecount, gdata.meminfo_count, numcountrecent,
+                  gdata.meminfo_depth);
+    }
 
 #ifdef HAVE_MMAP
     mmap_count = 0;
@@ -2970,7 +3113,82 @@ static void u_memstat(const userinput* const u) {
               mmap_count * IR_MMAP_SIZE / 1024, mmap_count);
 #endif
 
-    if (u->arg1 && !strcmp(u->arg1, "list")) {
+    fdcache_count = irlist_size(&gdata.fdcache_lru);
+
+    u_respond(u, "fdcache: %d idle of %d, %lu hits, %lu misses", fdcache_count,
+              gdata.fdcache, gdata.fdcache_hits, gdata.fdcache_misses);
+
+    u_respond(u,
+              "blockcache: %i kbytes, %d of %d blocks (p=%d), %lu hits, "
+              "%lu misses, %lu evictions",
+              (irlist_size(&gdata.blockcache.t1) +
+               irlist_size(&gdata.blockcache.t2)) *
+                  (IR_BLOCKCACHE_BLOCKSIZE / 1024),
+              irlist_size(&gdata.blockcache.t1) +
+                  irlist_size(&gdata.blockcache.t2),
+              gdata.blockcache_mb * ((1024 * 1024) / IR_BLOCKCACHE_BLOCKSIZE),
+              gdata.blockcache.p, gdata.blockcache.hits,
+              gdata.blockcache.misses, gdata.blockcache.evictions);
+
+#ifdef HAVE_PTHREAD
+    for (i = 0; i < gdata.hashpool.count; i++) {
+        hashworker_t* w = &gdata.hashpool.workers[i];
+        hashworker_state_e state;
+        off_t bytes;
+        int j;
+        for (j = 0; j < w->lanes; j++) {
+            /* no output while the workers wait for the lock */
+            pthread_mutex_lock(&gdata.hashpool.lock);
+            state = w->job[j].state;
+            bytes = w->job[j].bytes;
+            pthread_mutex_unlock(&gdata.hashpool.lock);
+            if (state != HASHWORKER_IDLE) {
+                u_respond(u,
+                          "hashpool: worker %d lane %d hashing %s, %" PRId64
+                          "d kbytes read",
+                          i, j, w->job[j].file, (int64_t)(bytes / 1024));
+            }
+        }
+    }
+    if (gdata.hashpool.count) {
+        u_respond(u, "hashpool: %d packs queued",
+                  irlist_size(&gdata.hashpool.queue));
+    }
+#endif
+
+    if (u->arg1 && !strcmp(u->arg1, "sites")) {
+        memsite_t** sites;
+        int count = 0;
+
+        sites = mycalloc(sizeof(memsite_t*) * (MEMSITES + 1));
+        for (i = 0; i < MEMSITES; i++) {
+            if (gdata.memsites[i].src_file) {
+                sites[count++] = &gdata.memsites[i];
+            }
+        }
+        if (gdata.memsite_other.total) {
+            sites[count++] = &gdata.memsite_other;
+        }
+        qsort(sites, count, sizeof(memsite_t*), u_memstat_site_cmp);
+
+        u_respond(u, "iroffer heap by place:");
+        u_respond(u, "    bytes |  allocs |    total | where");
+
+        for (i = 0; i < count; i++) {
+            if (sites[i]->src_file) {
+                u_respond(u, "%9li | %7i | %8lu | %s:%d %s()", sites[i]->size,
+                          sites[i]->count, sites[i]->total,
+                          sites[i]->src_file, sites[i]->src_line,
+                          sites[i]->src_func);
+            } else {
+                u_respond(u, "%9li | %7i | %8lu | (other places)",
+                          sites[i]->size, sites[i]->count, sites[i]->total);
+            }
+        }
+        mydelete(sites);
+    }
+
+    if (u->arg1 && !strcmp(u->arg1, "list") && gdata.meminfo_depth) {
         meminfo_t* meminfo;
         meminfo_t* meminfo2 = NULL;
         int meminfo_depth;
@@ -3033,8 +3251,11 @@ static void u_memstat(const userinput* const u) {
     }
 #endif
 
-    if (!u->arg1 || strcmp(u->arg1, "list") != 0) {
-        u_respond(u, "for a detailed listing use \"memstat list\"");
+    if (!u->arg1 || (strcmp(u->arg1, "list") && strcmp(u->arg1, "sites"))) {
+        u_respond(u, "for heap usage by place use \"memstat sites\"");
+        if (gdata.meminfo_depth) {
+            u_respond(u, "for a detailed listing use \"memstat list\"");
+        }
     }
 }
 
@@ -3253,7 +3474,7 @@ static void u_trinfo(const userinput* const u) {
     u_respond(u, "Sockets: Listen %i, Transfer %i, File %i",
               (tr->listensocket == FD_UNUSED) ? 0 : tr->listensocket,
               (tr->clientsocket == FD_UNUSED) ? 0 : tr->clientsocket,
-              (tr->xpack->file_fd == FD_UNUSED) ? 0 : tr->xpack->file_fd);
+              (tr->iopack->file_fd == FD_UNUSED) ? 0 : tr->iopack->file_fd);
 
 #ifdef HAVE_MMAP
     if (tr->mmap_info) {
@@ -0,0 +1,282 @@
+/*
+iroffer - An IRC file server using the DCC protocol
+Copyright (C) see CONTRIBUTORS
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* include the headers */
+#include "iroffer_config.h"
+#include "iroffer_defines.h"
+#include "iroffer_headers.h"
+#include "iroffer_globals.h"
+
+/*
+ * Userspace block cache for pack files
+ *
+ * Packs are read in large aligned blocks which are kept in memory using
+ * adaptive replacement (ARC, Megiddo & Modha).  t1 holds blocks seen
+ * once recently, t2 blocks seen at least twice; b1 and b2 remember the
+ * keys of blocks recently evicted from t1 and t2 and steer the target
+ * size of t1 (p).  All lists have their most recently used entry at the
+ * tail.
+ */
+
+static unsigned int blockcache_hash(const xdcc* xpack, off_t block) {
+    unsigned long h;
+
+    h = ((unsigned long)xpack) >> 4;
+    h ^= (unsigned long)block * 2654435761UL;
+
+    return h % BLOCKCACHE_HASHSIZE;
+}
+
+static int blockcache_capacity(void) {
+    return gdata.blockcache_mb * ((1024 * 1024) / IR_BLOCKCACHE_BLOCKSIZE);
+}
+
+static blockcache_entry_t* blockcache_lookup(const xdcc* xpack, off_t block) {
+    blockcache_entry_t* bc;
+
+    if (!gdata.blockcache.hash) {
+        return NULL;
+    }
+
+    for (bc = gdata.blockcache.hash[blockcache_hash(xpack, block)]; bc;
+         bc = bc->hash_next) {
+        if ((bc->xpack == xpack) && (bc->block == block)) {
+            return bc;
+        }
+    }
+
+    return NULL;
+}
+
+static irlist_t* blockcache_list(blockcache_list_e list) {
+    switch (list) {
+    case BLOCKCACHE_T1:
+        return &gdata.blockcache.t1;
+    case BLOCKCACHE_T2:
+        return &gdata.blockcache.t2;
+    case BLOCKCACHE_B1:
+        return &gdata.blockcache.b1;
+    case BLOCKCACHE_B2:
+    default:
+        return &gdata.blockcache.b2;
+    }
+}
+
+static void blockcache_move(blockcache_entry_t* bc, blockcache_list_e list) {
+    irlist_remove(blockcache_list(bc->list), bc);
+    bc->list = list;
+    irlist_insert_tail(blockcache_list(list), bc);
+}
+
+/* free the data of a resident entry and make it a ghost on list */
+static void blockcache_demote(blockcache_entry_t* bc, blockcache_list_e list) {
+    mydelete(bc->data);
+    bc->len = 0;
+    gdata.blockcache.evictions++;
+    blockcache_move(bc, list);
+}
+
+/* forget an entry completely */
+static void blockcache_remove(blockcache_entry_t* bc) {
+    blockcache_entry_t** pbc;
+
+    pbc = &gdata.blockcache.hash[blockcache_hash(bc->xpack, bc->block)];
+    while (*pbc != bc) {
+        pbc = &(*pbc)->hash_next;
+    }
+    *pbc = bc->hash_next;
+
+    if (bc->data) {
+        mydelete(bc->data);
+        gdata.blockcache.evictions++;
+    }
+
+    irlist_delete(blockcache_list(bc->list), bc);
+}
+
+/* make room for one block, evicting from t1 or t2 depending on p */
+static void blockcache_replace(int in_b2) {
+    irlist_t* t1 = &gdata.blockcache.t1;
+    blockcache_entry_t* bc;
+
+    if (irlist_size(t1) &&
+        ((irlist_size(t1) > gdata.blockcache.p) ||
+         (in_b2 && (irlist_size(t1) == gdata.blockcache.p)))) {
+        bc = irlist_get_head(t1);
+        blockcache_demote(bc, BLOCKCACHE_B1);
+    } else if ((bc = irlist_get_head(&gdata.blockcache.t2))) {
+        blockcache_demote(bc, BLOCKCACHE_B2);
+    }
+}
+
+void blockcache_trim(void) {
+    blockcache_entry_t* bc;
+    int c;
+
+    updatecontext();
+
+    c = blockcache_capacity();
+
+    if (gdata.blockcache.p > c) {
+        gdata.blockcache.p = c;
+    }
+
+    while ((irlist_size(&gdata.blockcache.t1) +
+            irlist_size(&gdata.blockcache.t2)) > c) {
+        blockcache_replace(0);
+    }
+
+    while ((irlist_size(&gdata.blockcache.t1) +
+            irlist_size(&gdata.blockcache.b1)) > c) {
+        if ((bc = irlist_get_head(&gdata.blockcache.b1))) {
+            blockcache_remove(bc);
+        } else {
+            blockcache_remove(irlist_get_head(&gdata.blockcache.t1));
+        }
+    }
+
+    while ((irlist_size(&gdata.blockcache.t1) +
+            irlist_size(&gdata.blockcache.t2) +
+            irlist_size(&gdata.blockcache.b1) +
+            irlist_size(&gdata.blockcache.b2)) > (2 * c)) {
+        blockcache_remove(irlist_get_head(&gdata.blockcache.b2));
+    }
+
+    if (!c && gdata.blockcache.hash) {
+        mydelete(gdata.blockcache.hash);
+    }
+}
+
+void blockcache_drop(const xdcc* xpack) {
+    blockcache_entry_t* bc;
+    blockcache_list_e list;
+
+    updatecontext();
+
+    for (list = BLOCKCACHE_T1; list <= BLOCKCACHE_B2; list++) {
+        bc = irlist_get_head(blockcache_list(list));
+        while (bc) {
+            blockcache_entry_t* next = irlist_get_next(bc);
+            if (bc->xpack == xpack) {
+                blockcache_remove(bc);
+            }
+            bc = next;
+        }
+    }
+}
+
+ssize_t blockcache_read(xdcc* const xpack, off_t offset, size_t len,
+                        unsigned char** dataptr) {
+    blockcache_entry_t* bc;
+    blockcache_entry_t** pbc;
+    off_t block;
+    size_t skip;
+    ssize_t howmuch;
+    int c, l1, l2;
+
+    updatecontext();
+
+    c = blockcache_capacity();
+    block = offset / IR_BLOCKCACHE_BLOCKSIZE;
+    skip = offset % IR_BLOCKCACHE_BLOCKSIZE;
+
+    if (!gdata.blockcache.hash) {
+        gdata.blockcache.hash =
+            mycalloc(sizeof(blockcache_entry_t*) * BLOCKCACHE_HASHSIZE);
+    }
+
+    /* the budget may have shrunk on rehash */
+    blockcache_trim();
+
+    bc = blockcache_lookup(xpack, block);
+
+    if (bc && bc->data) {
+        /* hit, t1 or t2 */
+        gdata.blockcache.hits++;
+        blockcache_move(bc, BLOCKCACHE_T2);
+        goto found;
+    }
+
+    gdata.blockcache.misses++;
+
+    l1 = irlist_size(&gdata.blockcache.b1);
+    l2 = irlist_size(&gdata.blockcache.b2);
+
+    if (bc && (bc->list == BLOCKCACHE_B1)) {
+        gdata.blockcache.p = min2(c, gdata.blockcache.p + max2(l2 / l1, 1));
+        blockcache_replace(0);
+        blockcache_move(bc, BLOCKCACHE_T2);
+    } else if (bc) {
+        gdata.blockcache.p = max2(0, gdata.blockcache.p - max2(l1 / l2, 1));
+        blockcache_replace(1);
+        blockcache_move(bc, BLOCKCACHE_T2);
+    } else {
+        l1 += irlist_size(&gdata.blockcache.t1);
+        l2 += irlist_size(&gdata.blockcache.t2);
+
+        if (l1 >= c) {
+            if (irlist_size(&gdata.blockcache.t1) < c) {
+                blockcache_remove(irlist_get_head(&gdata.blockcache.b1));
+                blockcache_replace(0);
+            } else {
+                blockcache_remove(irlist_get_head(&gdata.blockcache.t1));
+            }
+        } else if ((l1 + l2) >= c) {
+            if ((l1 + l2) >= (2 * c)) {
+                blockcache_remove(irlist_get_head(&gdata.blockcache.b2));
+            }
+            blockcache_replace(0);
+        }
+
+        bc = irlist_add(&gdata.blockcache.t1, sizeof(blockcache_entry_t));
+        bc->xpack = xpack;
+        bc->block = block;
+        bc->list = BLOCKCACHE_T1;
+        pbc = &gdata.blockcache.hash[blockcache_hash(xpack, block)];
+        bc->hash_next = *pbc;
+        *pbc = bc;
+    }
+
+    bc->data = mymalloc(IR_BLOCKCACHE_BLOCKSIZE);
+    howmuch = pread(xpack->file_fd, bc->data, IR_BLOCKCACHE_BLOCKSIZE,
+                    block * IR_BLOCKCACHE_BLOCKSIZE);
+
+    if (howmuch < 0) {
+        int save_errno = errno;
+        blockcache_remove(bc);
+        errno = save_errno;
+        return -1;
+    }
+
+    bc->len = howmuch;
+
+    if (gdata.debug > 4) {
+        ioutput(CALLTYPE_NORMAL, OUT_S, COLOR_BLUE,
+                "blockcache: read '%s' block %" PRId64 " (%zd bytes)",
+                xpack->file, (int64_t)block, howmuch);
+    }
+
+found:
+    if (skip >= bc->len) {
+        return 0; /* EOF */
+    }
+
+    *dataptr = bc->data + skip;
+
+    return min2(len, bc->len - skip);
+}
@@ -54,8 +54,9 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #define MAXUPLDS ((ACTUAL_MAXSETSIZE < 256) ? 3 : 8)
 
+/* uploads use a socket, the file and possibly a splice and a hash pipe */
 #define MAXTRANS                                                               \
-    (((ACTUAL_MAXSETSIZE)-RESERVED_FDS - (MAXUPLDS * 2) - MAXCHATS) / 2)
+    (((ACTUAL_MAXSETSIZE)-RESERVED_FDS - (MAXUPLDS * 6) - MAXCHATS) / 2)
 
 
 /*       max size for xdcc list queue */
@@ -64,6 +65,13 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define MAXCONFIG 10
 /*       meminfo hash size */
 #define MEMINFOHASHSIZE 256
+/*       mymalloc() call sites tracked, a power of 2 */
+#define MEMSITES 2048
+/*       size of the memhdr_t in front of allocations, keeps them aligned */
+#define MEMHDR_SIZE ((sizeof(memhdr_t) + 15) & ~15)
+#define MEMHDR_MAGIC 0x6D656D68
+/*       the allocation is also in the meminfo table */
+#define MEMHDR_MAGIC_DEBUG 0x6D656D64
 /*       Max context log */
 #define MAXCONTEXTS 300
 /*       Server Connection Timeout In Seconds */
@@ -101,12 +109,43 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define BUFFERSIZE (TXSIZE * 3)
 /*       max TXSIZE blocks to write per cycle */
 #define MAXTXPERLOOP 30
+/*       per upload buffer, and write-behind granularity */
+#define UPLOAD_BUFFERSIZE (1024 * 1024)
 
 #ifdef HAVE_MMAP
 /* how large of a mmap to do at a time, MUST BE POWER OF 2! */
 #define IR_MMAP_SIZE (512 * 1024)
 #endif
 
+/* block size of the userspace block cache, MUST DIVIDE 1MB! */
+#define IR_BLOCKCACHE_BLOCKSIZE (1024 * 1024)
+#define BLOCKCACHE_HASHSIZE 1024
+
+/* smallest size of the duplicate pack hash, a power of 2 */
+#define DUPHASH_SIZE 256
+
+/* how much to read ahead while an offer is listening, MUST BE POWER OF 2! */
+#define IR_PREFETCH_SIZE (512 * 1024)
+
+/* read size of the background md5sum workers, split between their lanes */
+#define HASHPOOL_READSIZE (4 * 1024 * 1024)
+/* drop a pack's stream hash after this many seconds without progress */
+#define STREAMHASH_TIMEOUT 60
+/* a pack that could not be read is not hashed again for this many seconds */
+#define HASH_RETRY 600
+/* the slow stat() sweep gets through all packs in this many seconds */
+#define FILEWATCH_SWEEP 600
+/* smallest size of the search trigram hash, a power of 2 */
+#define SEARCH_HASHSIZE 4096
+/* smallest size of the pack file and inode hashes, a power of 2 */
+#define XDCC_HASHSIZE 1024
+/* directory entries a scan thread stat()s per turn */
+#define DIRSCAN_BATCH 64
+/* piece size of the pack piece tables, MUST BE A MULTIPLE OF 64! */
+#define PIECE_SIZE (4 * 1024 * 1024)
+/* widest multi-buffer md5 kernel */
+#define MD5MB_MAXLANES 16
+
 /*       notify level for server queue */
 #define srvqnotify 60
 
@@ -128,8 +167,20 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
         mydelete2(x);                                                          \
         x = NULL;                                                              \
     }
-#define mymalloc(x) mymalloc2(x, 0, __FUNCTION__, __FILE__, __LINE__)
-#define mycalloc(x) mymalloc2(x, 1, __FUNCTION__, __FILE__, __LINE__)
+/* each call site remembers its memsite_t, only its first call looks it up */
+#ifdef __GNUC__
+#define MEMSITE_CACHE                                                          \
+    __extension__({                                                            \
+        static memsite_t* memsite_cache;                                       \
+        &memsite_cache;                                                        \
+    })
+#else
+#define MEMSITE_CACHE NULL
+#endif
+#define mymalloc(x)                                                            \
+    mymalloc2(x, 0, MEMSITE_CACHE, __FUNCTION__, __FILE__, __LINE__)
+#define mycalloc(x)                                                            \
+    mymalloc2(x, 1, MEMSITE_CACHE, __FUNCTION__, __FILE__, __LINE__)
 
 #define maxtextlengthshort 60
 #define maxtextlength 512
@@ -156,9 +207,20 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #define OUT_L 2
 #define OUT_D 4
 
+/* irlist items up to this size with their header come from slabs */
+#define IRLIST_SLAB_MAXITEM (512)
+#define IRLIST_SLAB_ROUND (16)
+#define IRLIST_SLAB_CHUNK (64 * 1024)
+
 /* Buffer Output options */
 #define IR_BOUTPUT_SEGMENT_SIZE (1024)
 #define IR_BOUTPUT_MAX_SEGMENTS (64)
+/* segments written by one writev() */
+#define IR_BOUTPUT_IOVECS (256)
+
+/* Arena options, a server line needs about 4 times its length */
+#define IR_ARENA_CHUNK (4 * 1024)
+#define IR_ARENA_ALIGN (sizeof(void*))
 
 /* color options */
 #define COLOR_NO_COLOR 0
@@ -181,6 +243,11 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 
 #define FD_UNUSED 0
 
+/* digest_t flags */
+#define DIGEST_MD5 1
+#define DIGEST_CRC32 2
+#define DIGEST_SHA256 4
+
 #define MD5_PRINT_FMT                                                          \
     "%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x%.2x"
 
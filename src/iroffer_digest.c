@@ -0,0 +1,818 @@
+/*
+iroffer - An IRC file server using the DCC protocol
+Copyright (C) see CONTRIBUTORS
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* include the headers */
+#include "iroffer_config.h"
+#include "iroffer_defines.h"
+#include "iroffer_headers.h"
+#include "iroffer_globals.h"
+
+/*
+ * Pack digests
+ *
+ * Next to the md5sum a pack can carry a CRC32 (zlib polynomial, the usual
+ * "[ABCD1234]" in release names) and a SHA-256.  All of them are fed from
+ * the same buffers, so a file is read once no matter how many digests are
+ * wanted.  On x86 the CRC32 is folded with carry-less multiplies (PCLMUL)
+ * and SHA-256 uses the SHA extensions when the CPU has them, the portable
+ * code is slice-by-8 CRC32 and plain SHA-256.
+ */
+
+#if defined(HAVE_DIGEST_X86)
+#include <immintrin.h>
+#endif
+
+/* CRC32 */
+
+static uint32_t crc32_table[8][256];
+
+void crc32_init(void) {
+    uint32_t c;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        c = i;
+        for (j = 0; j < 8; j++) {
+            c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+        }
+        crc32_table[0][i] = c;
+    }
+
+    for (i = 0; i < 256; i++) {
+        c = crc32_table[0][i];
+        for (j = 1; j < 8; j++) {
+            c = crc32_table[0][c & 0xFF] ^ (c >> 8);
+            crc32_table[j][i] = c;
+        }
+    }
+}
+
+/* slice-by-8 on the inverted crc */
+static uint32_t crc32_slice8(uint32_t c, const unsigned char* p, size_t len) {
+    uint32_t lo, hi;
+
+    while (len >= 8) {
+        lo = c ^ ((uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+                  ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24));
+        hi = (uint32_t)p[4] | ((uint32_t)p[5] << 8) | ((uint32_t)p[6] << 16) |
+             ((uint32_t)p[7] << 24);
+        c = crc32_table[7][lo & 0xFF] ^ crc32_table[6][(lo >> 8) & 0xFF] ^
+            crc32_table[5][(lo >> 16) & 0xFF] ^ crc32_table[4][lo >> 24] ^
+            crc32_table[3][hi & 0xFF] ^ crc32_table[2][(hi >> 8) & 0xFF] ^
+            crc32_table[1][(hi >> 16) & 0xFF] ^ crc32_table[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+
+    while (len--) {
+        c = crc32_table[0][(c ^ *p++) & 0xFF] ^ (c >> 8);
+    }
+
+    return c;
+}
+
+#if defined(HAVE_DIGEST_X86)
+/*
+ * fold 64 bytes per round with carry-less multiplies, then reduce to 32
+ * bits (Intel, "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ
+ * Instruction"); len must be a multiple of 16 and at least 64
+ */
+__attribute__((target("pclmul,sse4.1"))) static uint32_t
+crc32_pclmul(uint32_t c, const unsigned char* p, size_t len) {
+    static const uint64_t k1k2[2] __attribute__((aligned(16))) = {
+        0x0154442bd4, 0x01c6e41596};
+    static const uint64_t k3k4[2] __attribute__((aligned(16))) = {
+        0x01751997d0, 0x00ccaa009e};
+    static const uint64_t k5k0[2] __attribute__((aligned(16))) = {
+        0x0163cd6124, 0x0000000000};
+    static const uint64_t poly[2] __attribute__((aligned(16))) = {
+        0x01db710641, 0x01f7011641};
+    __m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+    x1 = _mm_loadu_si128((const __m128i*)(p + 0x00));
+    x2 = _mm_loadu_si128((const __m128i*)(p + 0x10));
+    x3 = _mm_loadu_si128((const __m128i*)(p + 0x20));
+    x4 = _mm_loadu_si128((const __m128i*)(p + 0x30));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)c));
+    x0 = _mm_load_si128((const __m128i*)k1k2);
+    p += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+        x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+        x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i*)(p + 0x00)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+                           _mm_loadu_si128((const __m128i*)(p + 0x10)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+                           _mm_loadu_si128((const __m128i*)(p + 0x20)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+                           _mm_loadu_si128((const __m128i*)(p + 0x30)));
+        p += 64;
+        len -= 64;
+    }
+
+    /* fold the four lanes into one */
+    x0 = _mm_load_si128((const __m128i*)k3k4);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+    x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+    x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+    x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+    while (len >= 16) {
+        x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+                           _mm_loadu_si128((const __m128i*)p));
+        p += 16;
+        len -= 16;
+    }
+
+    /* 128 -> 64 bits */
+    x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+    x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x0 = _mm_loadl_epi64((const __m128i*)k5k0);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    /* Barrett reduction to 32 bits */
+    x0 = _mm_load_si128((const __m128i*)poly);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, x3), x0, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, x3), x0, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    return (uint32_t)_mm_extract_epi32(x1, 1);
+}
+#endif
+
+/* zlib compatible: start with crc 0, feed the result back in */
+uint32_t crc32_update(uint32_t crc, const unsigned char* data, size_t len) {
+    uint32_t c = ~crc;
+
+#if defined(HAVE_DIGEST_X86)
+    if ((len >= 64) && __builtin_cpu_supports("pclmul") &&
+        __builtin_cpu_supports("sse4.1")) {
+        c = crc32_pclmul(c, data, len & ~(size_t)15);
+        data += len & ~(size_t)15;
+        len &= 15;
+    }
+#endif
+
+    return ~crc32_slice8(c, data, len);
+}
+
+/* SHA-256 */
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define SHA256_CH(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define SHA256_MAJ(x, y, z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define SHA256_S0(x) (SHA256_ROR(x, 2) ^ SHA256_ROR(x, 13) ^ SHA256_ROR(x, 22))
+#define SHA256_S1(x) (SHA256_ROR(x, 6) ^ SHA256_ROR(x, 11) ^ SHA256_ROR(x, 25))
+#define SHA256_G0(x) (SHA256_ROR(x, 7) ^ SHA256_ROR(x, 18) ^ ((x) >> 3))
+#define SHA256_G1(x) (SHA256_ROR(x, 17) ^ SHA256_ROR(x, 19) ^ ((x) >> 10))
+
+static void sha256_blocks_c(uint32_t* state, const unsigned char* p,
+                            size_t nblocks) {
+    uint32_t w[64];
+    uint32_t a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    while (nblocks--) {
+        for (i = 0; i < 16; i++) {
+            w[i] = ((uint32_t)p[i * 4] << 24) | ((uint32_t)p[i * 4 + 1] << 16) |
+                   ((uint32_t)p[i * 4 + 2] << 8) | (uint32_t)p[i * 4 + 3];
+        }
+        for (; i < 64; i++) {
+            w[i] = SHA256_G1(w[i - 2]) + w[i - 7] + SHA256_G0(w[i - 15]) +
+                   w[i - 16];
+        }
+
+        a = state[0];
+        b = state[1];
+        c = state[2];
+        d = state[3];
+        e = state[4];
+        f = state[5];
+        g = state[6];
+        h = state[7];
+
+        for (i = 0; i < 64; i++) {
+            t1 = h + SHA256_S1(e) + SHA256_CH(e, f, g) + sha256_k[i] + w[i];
+            t2 = SHA256_S0(a) + SHA256_MAJ(a, b, c);
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+
+        state[0] += a;
+        state[1] += b;
+        state[2] += c;
+        state[3] += d;
+        state[4] += e;
+        state[5] += f;
+        state[6] += g;
+        state[7] += h;
+        p += 64;
+    }
+}
+
+#if defined(HAVE_DIGEST_X86)
+/*
+ * four rounds with the SHA extensions, scheduling the message words for
+ * the rounds 12 ahead: m0 holds the words of these rounds, m3 the ones
+ * before, m1 gets its next words finished and m3 the first half of them
+ */
+#define SHA256NI_ROUNDS(r, m0, m1, m3, sched1, sched2)                         \
+    msg = _mm_add_epi32(m0, _mm_loadu_si128((const __m128i*)&sha256_k[r]));    \
+    state1 = _mm_sha256rnds2_epu32(state1, state0, msg);                       \
+    if (sched2) {                                                              \
+        m1 = _mm_add_epi32(m1, _mm_alignr_epi8(m0, m3, 4));                    \
+        m1 = _mm_sha256msg2_epu32(m1, m0);                                     \
+    }                                                                          \
+    msg = _mm_shuffle_epi32(msg, 0x0E);                                        \
+    state0 = _mm_sha256rnds2_epu32(state0, state1, msg);                       \
+    if (sched1) {                                                              \
+        m3 = _mm_sha256msg1_epu32(m3, m0);                                     \
+    }
+
+__attribute__((target("sha,sse4.1"))) static void
+sha256_blocks_shani(uint32_t* state, const unsigned char* p, size_t nblocks) {
+    const __m128i mask =
+        _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    __m128i state0, state1, msg, tmp, m0, m1, m2, m3, save0, save1;
+
+    /* abcd efgh -> abef cdgh */
+    tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[0]), 0xB1);
+    state1 =
+        _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&state[4]), 0x1B);
+    state0 = _mm_alignr_epi8(tmp, state1, 8);
+    state1 = _mm_blend_epi16(state1, tmp, 0xF0);
+
+    while (nblocks--) {
+        save0 = state0;
+        save1 = state1;
+
+        m0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 0)), mask);
+        m1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 16)), mask);
+        m2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 32)), mask);
+        m3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 48)), mask);
+
+        SHA256NI_ROUNDS(0, m0, m1, m3, 0, 0);
+        SHA256NI_ROUNDS(4, m1, m2, m0, 1, 0);
+        SHA256NI_ROUNDS(8, m2, m3, m1, 1, 0);
+        SHA256NI_ROUNDS(12, m3, m0, m2, 1, 1);
+        SHA256NI_ROUNDS(16, m0, m1, m3, 1, 1);
+        SHA256NI_ROUNDS(20, m1, m2, m0, 1, 1);
+        SHA256NI_ROUNDS(24, m2, m3, m1, 1, 1);
+        SHA256NI_ROUNDS(28, m3, m0, m2, 1, 1);
+        SHA256NI_ROUNDS(32, m0, m1, m3, 1, 1);
+        SHA256NI_ROUNDS(36, m1, m2, m0, 1, 1);
+        SHA256NI_ROUNDS(40, m2, m3, m1, 1, 1);
+        SHA256NI_ROUNDS(44, m3, m0, m2, 1, 1);
+        SHA256NI_ROUNDS(48, m0, m1, m3, 1, 1);
+        SHA256NI_ROUNDS(52, m1, m2, m0, 0, 1);
+        SHA256NI_ROUNDS(56, m2, m3, m1, 0, 1);
+        SHA256NI_ROUNDS(60, m3, m0, m2, 0, 0);
+
+        state0 = _mm_add_epi32(state0, save0);
+        state1 = _mm_add_epi32(state1, save1);
+        p += 64;
+    }
+
+    /* abef cdgh -> abcd efgh */
+    tmp = _mm_shuffle_epi32(state0, 0x1B);
+    state1 = _mm_shuffle_epi32(state1, 0xB1);
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(tmp, state1, 0xF0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(state1, tmp, 8));
+}
+#endif
+
+static void sha256_blocks(uint32_t* state, const unsigned char* p,
+                          size_t nblocks) {
+#if defined(HAVE_DIGEST_X86)
+    if (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1")) {
+        sha256_blocks_shani(state, p, nblocks);
+        return;
+    }
+#endif
+    sha256_blocks_c(state, p, nblocks);
+}
+
+void sha256_init(sha256_ctx* ctx) {
+    static const uint32_t iv[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372,
+                                   0xa54ff53a, 0x510e527f, 0x9b05688c,
+                                   0x1f83d9ab, 0x5be0cd19};
+
+    memcpy(ctx->state, iv, sizeof(iv));
+    ctx->len = 0;
+}
+
+void sha256_update(sha256_ctx* ctx, const unsigned char* data, size_t len) {
+    size_t used = ctx->len % 64;
+    size_t n;
+
+    ctx->len += len;
+
+    if (used) {
+        n = min2(len, 64 - used);
+        memcpy(ctx->buffer + used, data, n);
+        data += n;
+        len -= n;
+        if ((used + n) < 64) {
+            return;
+        }
+        sha256_blocks(ctx->state, ctx->buffer, 1);
+    }
+
+    if (len >= 64) {
+        sha256_blocks(ctx->state, data, len / 64);
+        data += len & ~(size_t)63;
+        len &= 63;
+    }
+
+    memcpy(ctx->buffer, data, len);
+}
+
+void sha256_final(sha256_ctx* ctx, SHA256Digest digest) {
+    unsigned char pad[72];
+    uint64_t bits = ctx->len * 8;
+    size_t padlen;
+    int i;
+
+    padlen = ((ctx->len % 64) < 56) ? (56 - (ctx->len % 64))
+                                    : (120 - (ctx->len % 64));
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for (i = 0; i < 8; i++) {
+        pad[padlen + i] = (unsigned char)(bits >> (56 - (i * 8)));
+    }
+    sha256_update(ctx, pad, padlen + 8);
+
+    for (i = 0; i < 8; i++) {
+        digest[i * 4] = (unsigned char)(ctx->state[i] >> 24);
+        digest[i * 4 + 1] = (unsigned char)(ctx->state[i] >> 16);
+        digest[i * 4 + 2] = (unsigned char)(ctx->state[i] >> 8);
+        digest[i * 4 + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+/* all digests of one pass */
+
+int digest_wanted(void) {
+    int flags = DIGEST_MD5;
+
+    if (!gdata.nocrc32) {
+        flags |= DIGEST_CRC32;
+    }
+    if (!gdata.nosha256) {
+        flags |= DIGEST_SHA256;
+    }
+
+    return flags;
+}
+
+/*
+ * non-zero if the pack has to be read for its digests, that is it has no
+ * md5sum yet.  Packs from before crc32 and sha256 only get those when a
+ * transfer sends them whole, rereading the catalog for them is not worth it
+ */
+int digest_missing(const xdcc* xd) {
+    return !xd->has_md5sum;
+}
+
+/* non-zero if the pack lacks a digest that is wanted */
+int digest_incomplete(const xdcc* xd) {
+    digest_t d;
+
+    digest_from_xdcc(&d, xd);
+
+    return digest_wanted() & ~d.flags;
+}
+
+void digest_init(digest_ctx* ctx, int flags) {
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->flags = flags;
+    ctx->pieces.flags = flags;
+    md5mb_init(&ctx->md5);
+    sha256_init(&ctx->sha256);
+}
+
+/* releases the tables, needed after digest_final() too */
+void digest_free(digest_ctx* ctx) {
+    mydelete(ctx->pieces.piece);
+    mydelete(ctx->verify.piece);
+    memset(&ctx->pieces, 0, sizeof(ctx->pieces));
+    memset(&ctx->verify, 0, sizeof(ctx->verify));
+    ctx->spots = 0;
+}
+
+/*
+ * Piece tables
+ *
+ * Every pass records the crc32 of each whole PIECE_SIZE piece, and at the
+ * end the state of all digests at the last whole 64 byte block.  When a
+ * file only grew, the next pass spot checks its first and last old piece
+ * and one at random against the table, and if they match goes on from the
+ * saved state, reading just the spot checked pieces and the new data.
+ * Anything else, a file that shrank, kept its size or failed a spot
+ * check, is hashed again from the start.
+ *
+ * The hashpool workers must not allocate: the main thread sizes their
+ * table up front with digest_prealloc(), a file that outgrows it simply
+ * gets no table.
+ */
+
+void piecetable_copy(piecetable_t* to, const piecetable_t* from) {
+    *to = *from;
+    to->alloc = from->count;
+    to->piece = NULL;
+    if (from->count) {
+        to->piece = mymalloc(sizeof(piece_t) * from->count);
+        memcpy(to->piece, from->piece, sizeof(piece_t) * from->count);
+    }
+}
+
+static void piecetable_add(digest_ctx* ctx) {
+    piecetable_t* pt = &ctx->pieces;
+    piece_t* grown;
+
+    if (!pt->flags) {
+        /* given up */
+        return;
+    }
+
+    if ((pt->count == pt->alloc) && ctx->prealloc) {
+        pt->flags = 0;
+        pt->count = 0;
+        return;
+    }
+
+    if (pt->count == pt->alloc) {
+        pt->alloc = pt->alloc ? (pt->alloc * 2) : 16;
+        grown = mymalloc(sizeof(piece_t) * pt->alloc);
+        if (pt->count) {
+            memcpy(grown, pt->piece, sizeof(piece_t) * pt->count);
+        }
+        mydelete(pt->piece);
+        pt->piece = grown;
+    }
+
+    pt->piece[pt->count].crc32 = ctx->piece_crc32;
+    pt->piece[pt->count].crc32_run = ctx->crc32;
+    pt->count++;
+}
+
+/* room for a file of size and some growth, the table never grows after */
+void digest_prealloc(digest_ctx* ctx, off_t size) {
+    mydelete(ctx->pieces.piece);
+    ctx->pieces.count = 0;
+    ctx->pieces.alloc = (size / PIECE_SIZE) + 16;
+    ctx->pieces.piece = mymalloc(sizeof(piece_t) * ctx->pieces.alloc);
+    ctx->prealloc = 1;
+}
+
+/* the end of old data in spot checked piece n, and its crc32 there */
+static off_t digest_spot_end(const digest_ctx* ctx, int n, uint32_t* crc32) {
+    off_t end = ctx->verify.size & ~(off_t)63;
+
+    if (n < ctx->verify.count) {
+        *crc32 = ctx->verify.piece[n].crc32;
+        return (off_t)(n + 1) * PIECE_SIZE;
+    }
+
+    *crc32 = ctx->verify.piece_crc32;
+    return end;
+}
+
+/* a file of size that was old when hashed: spot check it, takes a copy */
+void digest_set_verify(digest_ctx* ctx, const piecetable_t* old, off_t size) {
+    off_t end;
+    int last;
+
+    mydelete(ctx->verify.piece);
+    memset(&ctx->verify, 0, sizeof(ctx->verify));
+    ctx->spots = 0;
+
+    end = old->size & ~(off_t)63;
+
+    if (ctx->pos || !ctx->pieces.flags || !end || (size <= old->size) ||
+        ((old->flags & ctx->flags) != ctx->flags) ||
+        (old->count != (int)(end / PIECE_SIZE))) {
+        return;
+    }
+
+    if (ctx->pieces.alloc < old->count) {
+        /* the old pieces must fit without growing */
+        mydelete(ctx->pieces.piece);
+        ctx->pieces.alloc = old->count + 16;
+        ctx->pieces.piece = mymalloc(sizeof(piece_t) * ctx->pieces.alloc);
+    }
+
+    piecetable_copy(&ctx->verify, old);
+
+    last = (int)((end - 1) / PIECE_SIZE);
+    ctx->spot[ctx->spots++] = last;
+    if (last > 1) {
+        ctx->spot[ctx->spots++] =
+            1 + (int)((float)(last - 1) * rand() / (RAND_MAX + 1.0));
+    }
+    if (last) {
+        ctx->spot[ctx->spots++] = 0;
+    }
+
+    ctx->pos = (off_t)ctx->spot[ctx->spots - 1] * PIECE_SIZE;
+    ctx->piece_crc32 = 0;
+}
+
+/* give up on the old table, hash everything */
+static void digest_restart(digest_ctx* ctx) {
+    ctx->spots = 0;
+    ctx->pos = 0;
+    md5mb_init(&ctx->md5);
+    sha256_init(&ctx->sha256);
+    ctx->crc32 = 0;
+    ctx->piece_crc32 = 0;
+    ctx->pieces.count = 0;
+}
+
+/* all spot checks passed, go on from the state of the old table */
+static void digest_resume(digest_ctx* ctx) {
+    const piecetable_t* old = &ctx->verify;
+
+    ctx->pos = old->size & ~(off_t)63;
+    ctx->md5.a = old->md5[0];
+    ctx->md5.b = old->md5[1];
+    ctx->md5.c = old->md5[2];
+    ctx->md5.d = old->md5[3];
+    ctx->md5.len = ctx->pos;
+    memcpy(ctx->sha256.state, old->sha256, sizeof(old->sha256));
+    ctx->sha256.len = ctx->pos;
+    ctx->crc32 = old->crc32;
+    ctx->piece_crc32 = old->piece_crc32;
+
+    ctx->pieces.count = 0;
+    if (old->count) {
+        memcpy(ctx->pieces.piece, old->piece, sizeof(piece_t) * old->count);
+        ctx->pieces.count = old->count;
+    }
+}
+
+/* a piece passed its spot check, on to the next or the new data */
+static void digest_spot_next(digest_ctx* ctx) {
+    ctx->spots--;
+    ctx->piece_crc32 = 0;
+    if (ctx->spots) {
+        ctx->pos = (off_t)ctx->spot[ctx->spots - 1] * PIECE_SIZE;
+    } else {
+        digest_resume(ctx);
+    }
+}
+
+/*
+ * crc32, sha256 and piece bookkeeping for data whose md5 blocks were
+ * already taken, must not cross a piece boundary
+ */
+void digest_update_nomd5(digest_ctx* ctx, const unsigned char* data,
+                         size_t len) {
+    if (!(ctx->pos % 64)) {
+        ctx->block_crc32 = ctx->crc32;
+        ctx->block_piece_crc32 = ctx->piece_crc32;
+    }
+
+    ctx->crc32 = crc32_update(ctx->crc32, data, len);
+    if (ctx->flags & DIGEST_SHA256) {
+        sha256_update(&ctx->sha256, data, len);
+    }
+    ctx->piece_crc32 = crc32_update(ctx->piece_crc32, data, len);
+    ctx->pos += len;
+
+    if (len && !(ctx->pos % PIECE_SIZE)) {
+        piecetable_add(ctx);
+        ctx->piece_crc32 = 0;
+    }
+}
+
+/* non-zero if the caller must drop the rest and go on reading at pos */
+int digest_update(digest_ctx* ctx, const unsigned char* data, size_t len) {
+    md5mb_t* md5[1];
+    const unsigned char* blocks[1];
+    uint32_t crc32;
+    off_t end;
+    size_t n, used, take;
+
+    md5[0] = &ctx->md5;
+
+    while (len) {
+        if (ctx->spots) {
+            end = digest_spot_end(ctx, ctx->spot[ctx->spots - 1], &crc32);
+            n = min2(len, (size_t)(end - ctx->pos));
+            ctx->piece_crc32 = crc32_update(ctx->piece_crc32, data, n);
+            ctx->pos += n;
+            data += n;
+            len -= n;
+
+            if (ctx->pos < end) {
+                continue;
+            }
+            if (crc32 == ctx->piece_crc32) {
+                digest_spot_next(ctx);
+            } else {
+                digest_restart(ctx);
+            }
+            return 1;
+        }
+
+        n = min2(len, PIECE_SIZE - (size_t)(ctx->pos % PIECE_SIZE));
+
+        /* md5 takes whole blocks, the rest waits in md5buf */
+        used = ctx->pos % 64;
+        take = n;
+        blocks[0] = data;
+        if (used) {
+            take = min2(n, 64 - used);
+            memcpy(ctx->md5buf + used, data, take);
+            if ((used + take) == 64) {
+                blocks[0] = ctx->md5buf;
+                md5mb_blocks(md5, blocks, 1, 1);
+            }
+        } else if (n >= 64) {
+            take = n & ~(size_t)63;
+            md5mb_blocks(md5, blocks, 1, take / 64);
+        } else {
+            memcpy(ctx->md5buf, data, take);
+        }
+
+        digest_update_nomd5(ctx, data, take);
+        data += take;
+        len -= take;
+    }
+
+    return 0;
+}
+
+/* at end of file, non-zero if it ended inside a spot check */
+int digest_eof(digest_ctx* ctx) {
+    if (!ctx->spots) {
+        return 0;
+    }
+
+    digest_restart(ctx);
+    return 1;
+}
+
+void digest_final(digest_ctx* ctx, digest_t* d) {
+    piecetable_t* pt = &ctx->pieces;
+
+    memset(d, 0, sizeof(*d));
+    d->flags = ctx->flags;
+
+    /* the state at the last whole block, before the tail goes in */
+    if (pt->flags) {
+        pt->size = ctx->pos;
+        pt->md5[0] = ctx->md5.a;
+        pt->md5[1] = ctx->md5.b;
+        pt->md5[2] = ctx->md5.c;
+        pt->md5[3] = ctx->md5.d;
+        memcpy(pt->sha256, ctx->sha256.state, sizeof(pt->sha256));
+        pt->crc32 = (ctx->pos % 64) ? ctx->block_crc32 : ctx->crc32;
+        pt->piece_crc32 =
+            (ctx->pos % 64) ? ctx->block_piece_crc32 : ctx->piece_crc32;
+    }
+
+    md5mb_final(&ctx->md5, ctx->md5buf, ctx->pos % 64, d->md5sum);
+    d->crc32 = ctx->crc32;
+    if (ctx->flags & DIGEST_SHA256) {
+        sha256_final(&ctx->sha256, d->sha256);
+    }
+
+    /* the table moves on to the result */
+    if (pt->flags) {
+        d->pieces = *pt;
+        memset(pt, 0, sizeof(*pt));
+    }
+}
+
+void digest_from_xdcc(digest_t* d, const xdcc* xd) {
+    memset(d, 0, sizeof(*d));
+    if (xd->has_md5sum) {
+        d->flags |= DIGEST_MD5;
+        memcpy(d->md5sum, xd->md5sum, sizeof(MD5Digest));
+    }
+    if (xd->has_crc32) {
+        d->flags |= DIGEST_CRC32;
+        d->crc32 = xd->crc32;
+    }
+    if (xd->has_sha256) {
+        d->flags |= DIGEST_SHA256;
+        memcpy(d->sha256, xd->sha256, sizeof(SHA256Digest));
+    }
+}
+
+/* also hands the piece table of d over to the pack */
+void digest_to_xdcc(digest_t* d, xdcc* xd) {
+    if (d->flags & DIGEST_MD5) {
+        xd->has_md5sum = 1;
+        memcpy(xd->md5sum, d->md5sum, sizeof(MD5Digest));
+    }
+    if (d->flags & DIGEST_CRC32) {
+        xd->has_crc32 = 1;
+        xd->crc32 = d->crc32;
+    }
+    if (d->flags & DIGEST_SHA256) {
+        xd->has_sha256 = 1;
+        memcpy(xd->sha256, d->sha256, sizeof(SHA256Digest));
+    }
+    if (d->flags & DIGEST_MD5) {
+        mydelete(xd->pieces.piece);
+        xd->pieces = d->pieces;
+        memset(&d->pieces, 0, sizeof(d->pieces));
+    }
+}
+
+/* the piece table stays, the next pass checks it against the file */
+void xdcc_clear_digest(xdcc* xd) {
+    xd->has_md5sum = 0;
+    memset(xd->md5sum, 0, sizeof(MD5Digest));
+    xd->has_crc32 = 0;
+    xd->crc32 = 0;
+    xd->has_sha256 = 0;
+    memset(xd->sha256, 0, sizeof(SHA256Digest));
+    xd->hash_retry = 0;
+    hashpool_dirty();
+}
+
+void sha256_print(char* str, const SHA256Digest digest) {
+    int i;
+
+    for (i = 0; i < (int)sizeof(SHA256Digest); i++) {
+        sprintf(str + (i * 2), "%02x", digest[i]);
+    }
+}
+
+/* "md5sum: ..., crc32: ..., sha256: ..." for the digests that are set */
+void digest_print(char* str, size_t len, const digest_t* d) {
+    char sha[(sizeof(SHA256Digest) * 2) + 1];
+
+    str[0] = '\0';
+
+    if (d->flags & DIGEST_MD5) {
+        snprintf(str + strlen(str), len - strlen(str),
+                 "md5sum: " MD5_PRINT_FMT, MD5_PRINT_DATA(d->md5sum));
+    }
+    if (d->flags & DIGEST_CRC32) {
+        snprintf(str + strlen(str), len - strlen(str), "%scrc32: %08X",
+                 str[0] ? ", " : "", d->crc32);
+    }
+    if (d->flags & DIGEST_SHA256) {
+        sha256_print(sha, d->sha256);
+        snprintf(str + strlen(str), len - strlen(str), "%ssha256: %s",
+                 str[0] ? ", " : "", sha);
+    }
+}
@@ -0,0 +1,266 @@
+/*
+iroffer - An IRC file server using the DCC protocol
+Copyright (C) see CONTRIBUTORS
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* include the headers */
+#include "iroffer_config.h"
+#include "iroffer_defines.h"
+#include "iroffer_headers.h"
+#include "iroffer_globals.h"
+
+/*
+ * Directory scans for ADDDIR and ADDNEW
+ *
+ * The names are read on the main loop, which is cheap.  The stat() and
+ * access() of every entry is what takes long on large or remote
+ * directories, so it is split between scanthreads threads while the main
+ * loop goes on serving.  Once every entry is done u_dirscan_done() adds
+ * the files in one batch.  Without threads the entries are done right
+ * away as before.
+ */
+
+static void dirscan_stat(dirscan_t* ds, int first, int last) {
+    dirscan_entry_t* e;
+    int fd = dirfd(ds->d);
+    int i;
+
+    for (i = first; i < last; i++) {
+        e = &ds->entries[i];
+        if (fstatat(fd, e->name, &e->st, 0) < 0) {
+            e->error = errno;
+        } else if (S_ISREG(e->st.st_mode) &&
+                   (faccessat(fd, e->name, R_OK, AT_EACCESS) < 0)) {
+            e->error = errno;
+        }
+    }
+}
+
+#ifdef HAVE_PTHREAD
+
+static void* dirscan_worker(void* arg) {
+    dirscan_t* ds = arg;
+    sigset_t ss;
+    int first, last;
+
+    /* signals are for the main thread */
+    sigfillset(&ss);
+    pthread_sigmask(SIG_BLOCK, &ss, NULL);
+
+    pthread_mutex_lock(&ds->lock);
+
+    while (!ds->exiting && (ds->next < ds->count)) {
+        first = ds->next;
+        last = min2(first + DIRSCAN_BATCH, ds->count);
+        ds->next = last;
+        pthread_mutex_unlock(&ds->lock);
+
+        dirscan_stat(ds, first, last);
+
+        pthread_mutex_lock(&ds->lock);
+    }
+
+    ds->running--;
+    pthread_mutex_unlock(&ds->lock);
+
+    return NULL;
+}
+
+/* how many threads took the scan, 0 to do it on the main loop */
+static int dirscan_threads(dirscan_t* ds) {
+    int want, i, retval;
+
+    want = min2(gdata.scanthreads,
+                (ds->count + DIRSCAN_BATCH - 1) / DIRSCAN_BATCH);
+    if (want < 1) {
+        return 0;
+    }
+
+    pthread_mutex_init(&ds->lock, NULL);
+    ds->threads = mycalloc(sizeof(pthread_t) * want);
+    ds->next = 0;
+    ds->running = want;
+    ds->exiting = 0;
+
+    for (i = 0; i < want; i++) {
+        retval = pthread_create(&ds->threads[i], NULL, dirscan_worker, ds);
+        if (retval) {
+            outerror(OUTERROR_TYPE_WARN, "Couldn't start scan thread: %s",
+                     strerror(retval));
+            break;
+        }
+    }
+
+    pthread_mutex_lock(&ds->lock);
+    ds->running -= want - i;
+    pthread_mutex_unlock(&ds->lock);
+
+    ds->nthreads = i;
+    if (!ds->nthreads) {
+        mydelete(ds->threads);
+        pthread_mutex_destroy(&ds->lock);
+    }
+
+    return ds->nthreads;
+}
+
+static int dirscan_running(dirscan_t* ds) {
+    int running;
+
+    pthread_mutex_lock(&ds->lock);
+    running = ds->running;
+    pthread_mutex_unlock(&ds->lock);
+
+    return running;
+}
+
+static void dirscan_join(dirscan_t* ds) {
+    int i;
+
+    for (i = 0; i < ds->nthreads; i++) {
+        pthread_join(ds->threads[i], NULL);
+    }
+    mydelete(ds->threads);
+    ds->nthreads = 0;
+    pthread_mutex_destroy(&ds->lock);
+}
+
+#endif
+
+static dirscan_t* dirscan_free(dirscan_t* ds) {
+    int i;
+
+    for (i = 0; i < ds->count; i++) {
+        mydelete(ds->entries[i].name);
+    }
+    mydelete(ds->entries);
+    mydelete(ds->u.snick);
+    mydelete(ds->dir);
+    closedir(ds->d);
+
+    return irlist_delete(&gdata.dirscans, ds);
+}
+
+static dirscan_t* dirscan_done(dirscan_t* ds) {
+    dccchat_t* chat;
+
+    updatecontext();
+
+    if (ds->u.method == method_dcc) {
+        /* the chat may have closed while the threads were busy */
+        for (chat = irlist_get_head(&gdata.dccchats); chat;
+             chat = irlist_get_next(chat)) {
+            if ((chat == ds->u.chat) && (chat->status == DCCCHAT_CONNECTED) &&
+                (chat->connecttime == ds->chattime)) {
+                break;
+            }
+        }
+        if (!chat) {
+            ds->u.method = method_console;
+            ds->u.chat = NULL;
+        }
+    }
+
+    u_dirscan_done(ds);
+
+    return dirscan_free(ds);
+}
+
+void dirscan_start(const userinput* u, const char* dir, DIR* d, int addnew) {
+    dirscan_t* ds;
+    struct dirent* f;
+    int alloc = 0;
+
+    updatecontext();
+
+    ds = irlist_add(&gdata.dirscans, sizeof(dirscan_t));
+    ds->u.method = u->method;
+    ds->u.bout = u->bout;
+    ds->u.chat = u->chat;
+    if (u->chat) {
+        ds->chattime = u->chat->connecttime;
+    }
+    if (u->snick) {
+        ds->u.snick = mymalloc(strlen(u->snick) + 1);
+        strcpy(ds->u.snick, u->snick);
+    }
+    ds->addnew = addnew;
+    ds->dir = mymalloc(strlen(dir) + 1);
+    strcpy(ds->dir, dir);
+    ds->d = d;
+
+    while ((f = readdir(d))) {
+        if (ds->count == alloc) {
+            dirscan_entry_t* grow;
+            alloc = alloc ? alloc * 2 : 256;
+            grow = mycalloc(sizeof(dirscan_entry_t) * alloc);
+            if (ds->count) {
+                memcpy(grow, ds->entries, sizeof(dirscan_entry_t) * ds->count);
+            }
+            mydelete(ds->entries);
+            ds->entries = grow;
+        }
+        ds->entries[ds->count].name = mymalloc(strlen(f->d_name) + 1);
+        strcpy(ds->entries[ds->count].name, f->d_name);
+        ds->count++;
+    }
+
+#ifdef HAVE_PTHREAD
+    if (dirscan_threads(ds)) {
+        return;
+    }
+#endif
+
+    dirscan_stat(ds, 0, ds->count);
+    dirscan_done(ds);
+}
+
+/* every second from the main loop */
+void dirscan_tick(void) {
+#ifdef HAVE_PTHREAD
+    dirscan_t* ds;
+
+    updatecontext();
+
+    ds = irlist_get_head(&gdata.dirscans);
+    while (ds) {
+        if (dirscan_running(ds)) {
+            ds = irlist_get_next(ds);
+        } else {
+            dirscan_join(ds);
+            ds = dirscan_done(ds);
+        }
+    }
+#endif
+}
+
+/* on shutdown, unfinished scans add nothing */
+void dirscan_stop(void) {
+    dirscan_t* ds;
+
+    updatecontext();
+
+    ds = irlist_get_head(&gdata.dirscans);
+    while (ds) {
+#ifdef HAVE_PTHREAD
+        pthread_mutex_lock(&ds->lock);
+        ds->exiting = 1;
+        pthread_mutex_unlock(&ds->lock);
+        dirscan_join(ds);
+#endif
+        ds = dirscan_free(ds);
+    }
+}
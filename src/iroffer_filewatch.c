@@ -0,0 +1,735 @@
+/*
+iroffer - An IRC file server using the DCC protocol
+Copyright (C) see CONTRIBUTORS
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* include the headers */
+#include "iroffer_config.h"
+#include "iroffer_defines.h"
+#include "iroffer_headers.h"
+#include "iroffer_globals.h"
+
+/*
+ * Pack file change detection
+ *
+ * The directories holding pack files are watched with inotify.  An event
+ * names a file in one of them and only the packs with that path are
+ * checked again with look_for_file_changes().  The stat() sweep over all
+ * packs stays as a safety net for changes inotify does not see (network
+ * filesystems): while every directory is watched it checks a slice of the
+ * packs every 20 seconds and gets through all of them in FILEWATCH_SWEEP
+ * seconds.  Without watches, or after the kernel dropped events, every
+ * pack is checked every 20 seconds as before.
+ *
+ * The configured watchdirs are watched the same way.  Regular files that
+ * show up in one are added as packs and packs whose file left it are
+ * removed, with the ADD and REMOVE admin commands, but not while the
+ * watchdir looks unmounted.  Names starting with a dot are left alone, most
+ * programs write there before renaming the file into place.  A watchdir is
+ * scanned once when its watch is set up and then follows the events.
+ * Without a watch it is scanned every 20 seconds, files modified during
+ * the last 20 seconds wait for the next scan.  A batch of changes writes
+ * the state file once.
+ */
+
+/* check every pack */
+static void filewatch_sweep_all(void) {
+    xdcc* xd;
+
+    for (xd = irlist_get_head(&gdata.xdccs); xd; xd = irlist_get_next(xd)) {
+        look_for_file_changes(xd);
+    }
+    gdata.filewatch.cursor = 0;
+    gdata.filewatch.sweep = 0;
+}
+
+static int filewatch_cmp_str(const void* a, const void* b) {
+    return strcmp(*(const char* const*)a, *(const char* const*)b);
+}
+
+typedef struct {
+    xdcc** packs; /* sorted by file, taken by the first scan of the batch */
+    int npacks;
+    xdcc** gone; /* removed when the batch is done */
+    int ngone;
+    int agone;
+} watchdir_batch_t;
+
+static int watchdir_cmp_file(const void* a, const void* b) {
+    return strcmp((*(xdcc* const*)a)->file, (*(xdcc* const*)b)->file);
+}
+
+static int watchdir_cmp_packnum(const void* a, const void* b) {
+    return (*(xdcc* const*)a)->packnum - (*(xdcc* const*)b)->packnum;
+}
+
+static void watchdir_start(watchdir_batch_t* b) {
+    statefile_hold();
+
+    b->packs = NULL;
+    b->npacks = 0;
+    b->gone = NULL;
+    b->ngone = b->agone = 0;
+}
+
+/* scans look for the packs of a directory, not of one file */
+static void watchdir_snapshot(watchdir_batch_t* b) {
+    xdcc* xd;
+
+    if (b->packs) {
+        return;
+    }
+
+    b->packs = mymalloc(sizeof(xdcc*) * (irlist_size(&gdata.xdccs) + 1));
+    for (xd = irlist_get_head(&gdata.xdccs); xd; xd = irlist_get_next(xd)) {
+        b->packs[b->npacks++] = xd;
+    }
+    qsort(b->packs, b->npacks, sizeof(xdcc*), watchdir_cmp_file);
+}
+
+/* run an admin command as if typed on the console */
+static void watchdir_command(const char* cmd, const char* arg) {
+    userinput* u;
+    char* tempstr;
+
+    tempstr = mymalloc(strlen(cmd) + strlen(arg) + 12);
+    sprintf(tempstr, "A A A A A %s %s", cmd, arg);
+
+    u = mycalloc(sizeof(userinput));
+    u_fillwith_msg(u, NULL, tempstr);
+    u->method = method_out_all; /* just OUT_S|OUT_L|OUT_D it */
+    u_parseit(u);
+    mydelete(u);
+    mydelete(tempstr);
+}
+
+/* a file that can be added now */
+static int watchdir_ready(const char* file, int settle) {
+    struct stat st;
+
+    if (*getfilename(file) == '.') {
+        return 0;
+    }
+    if ((stat(file, &st) < 0) || !S_ISREG(st.st_mode) || (st.st_size <= 0) ||
+        (st.st_size > gdata.max_file_size)) {
+        return 0;
+    }
+    if (settle && ((gdata.curtime - st.st_mtime) < 20)) {
+        return 0;
+    }
+    return 1;
+}
+
+static void watchdir_gone(watchdir_batch_t* b, xdcc* xd) {
+    if (b->ngone == b->agone) {
+        xdcc** grow;
+        b->agone = b->agone ? b->agone * 2 : 16;
+        grow = mycalloc(sizeof(xdcc*) * b->agone);
+        if (b->ngone) {
+            memcpy(grow, b->gone, sizeof(xdcc*) * b->ngone);
+        }
+        mydelete(b->gone);
+        b->gone = grow;
+    }
+    b->gone[b->ngone++] = xd;
+}
+
+static void watchdir_finish(watchdir_batch_t* b) {
+    char tempstr[16];
+    int n;
+
+    /* from the back, the numbers in front stay valid */
+    if (b->ngone) {
+        qsort(b->gone, b->ngone, sizeof(xdcc*), watchdir_cmp_packnum);
+    }
+    for (n = b->ngone - 1; n >= 0; n--) {
+        if (n && (b->gone[n - 1] == b->gone[n])) {
+            continue;
+        }
+        snprintf(tempstr, sizeof(tempstr), "%d", b->gone[n]->packnum);
+        watchdir_command("remove", tempstr);
+    }
+
+    mydelete(b->gone);
+    mydelete(b->packs);
+
+    statefile_release();
+}
+
+/* add the new files of a watchdir, drop the packs that left it */
+static void watchdir_scan(watchdir_batch_t* b, const char* dir, int settle) {
+    DIR* d;
+    struct dirent* f;
+    char** names = NULL;
+    char* file;
+    const char* name;
+    struct stat st;
+    int nnames = 0, anames = 0, entries = 0, kept = 0, dirlen, lo, hi, i;
+
+    updatecontext();
+
+    d = opendir(dir);
+    if (!d) {
+        /* tried again with the next scan */
+        return;
+    }
+    if (fstat(dirfd(d), &st) < 0) {
+        closedir(d);
+        return;
+    }
+
+    while ((f = readdir(d))) {
+        if (nnames == anames) {
+            char** grow;
+            anames = anames ? anames * 2 : 64;
+            grow = mycalloc(sizeof(char*) * anames);
+            if (nnames) {
+                memcpy(grow, names, sizeof(char*) * nnames);
+            }
+            mydelete(names);
+            names = grow;
+        }
+        names[nnames] = mymalloc(strlen(f->d_name) + 1);
+        strcpy(names[nnames], f->d_name);
+        nnames++;
+        if (strcmp(f->d_name, ".") && strcmp(f->d_name, "..")) {
+            entries++;
+        }
+    }
+    closedir(d);
+
+    qsort(names, nnames, sizeof(char*), filewatch_cmp_str);
+
+    dirlen = strlen(dir);
+    for (i = 0; i < nnames; i++) {
+        file = mymalloc(dirlen + strlen(names[i]) + 1);
+        strcpy(file, dir);
+        strcat(file, names[i]);
+        if (!xdcc_find_file(file, NULL) && watchdir_ready(file, settle)) {
+            watchdir_command("add", file);
+        }
+        mydelete(file);
+    }
+
+    /* the packs of the directory follow its path in file order */
+    watchdir_snapshot(b);
+    lo = 0;
+    hi = b->npacks;
+    while (lo < hi) {
+        i = (lo + hi) / 2;
+        if (strcmp(b->packs[i]->file, dir) < 0) {
+            lo = i + 1;
+        } else {
+            hi = i;
+        }
+    }
+
+    /*
+     * an empty directory, or one on another device than the pack was, is
+     * most likely a mount that went away: keep the packs with their
+     * descriptions, notes and gets until it is back
+     */
+    for (i = lo;
+         (i < b->npacks) && !strncmp(b->packs[i]->file, dir, dirlen); i++) {
+        name = b->packs[i]->file + dirlen;
+        if (strchr(name, '/') || bsearch(&name, names, nnames, sizeof(char*),
+                                         filewatch_cmp_str)) {
+            continue;
+        }
+        if (!entries || (b->packs[i]->st_dev != st.st_dev)) {
+            kept++;
+        } else {
+            watchdir_gone(b, b->packs[i]);
+        }
+    }
+
+    if (kept) {
+        outerror(OUTERROR_TYPE_WARN,
+                 "Watchdir %s looks unmounted, not removing %d packs", dir,
+                 kept);
+    }
+
+    for (i = 0; i < nnames; i++) {
+        mydelete(names[i]);
+    }
+    mydelete(names);
+}
+
+static void watchdir_scan_all(int settle) {
+    watchdir_batch_t b;
+    char* dir;
+
+    if (!irlist_size(&gdata.watchdirs)) {
+        return;
+    }
+
+    watchdir_start(&b);
+    for (dir = irlist_get_head(&gdata.watchdirs); dir;
+         dir = irlist_get_next(dir)) {
+        watchdir_scan(&b, dir, settle);
+    }
+    watchdir_finish(&b);
+}
+
+#ifdef HAVE_INOTIFY
+
+/* the next slice of the slow sweep */
+static void filewatch_sweep_slice(void) {
+    xdcc* xd;
+    int count, slice, i;
+
+    count = irlist_size(&gdata.xdccs);
+    if (!count) {
+        return;
+    }
+
+    slice = ((count * 20) + FILEWATCH_SWEEP - 1) / FILEWATCH_SWEEP;
+    if (gdata.filewatch.cursor >= count) {
+        gdata.filewatch.cursor = 0;
+    }
+
+    xd = xdcc_get(gdata.filewatch.cursor + 1);
+    for (i = 0; xd && (i < slice); i++) {
+        look_for_file_changes(xd);
+        xd = irlist_get_next(xd);
+    }
+    gdata.filewatch.cursor += i;
+}
+
+#define FILEWATCH_MASK                                                         \
+    (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MODIFY |          \
+     IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF)
+
+/* directory part of a pack file, points into the name */
+typedef struct {
+    const char* path;
+    int len;
+    int watchdir;
+} filewatch_name_t;
+
+/* a file named by events, with all of their masks */
+typedef struct {
+    char* path;
+    unsigned int mask;
+    int watchdir;
+} filewatch_event_t;
+
+static void filewatch_dirname(const char* file, filewatch_name_t* n) {
+    const char* slash = strrchr(file, '/');
+
+    n->path = file;
+    n->len = slash ? (int)(slash - file) + 1 : 0;
+    n->watchdir = 0;
+}
+
+static int filewatch_cmp_name(const void* a, const void* b) {
+    const filewatch_name_t* na = a;
+    const filewatch_name_t* nb = b;
+    int r;
+
+    r = memcmp(na->path, nb->path, min2(na->len, nb->len));
+    return r ? r : (na->len - nb->len);
+}
+
+static int filewatch_cmp_wd(const void* a, const void* b) {
+    const filewatch_dir_t* da = *(const filewatch_dir_t* const*)a;
+    const filewatch_dir_t* db = *(const filewatch_dir_t* const*)b;
+
+    return (da->wd > db->wd) - (da->wd < db->wd);
+}
+
+static int filewatch_cmp_event(const void* a, const void* b) {
+    return strcmp(((const filewatch_event_t*)a)->path,
+                  ((const filewatch_event_t*)b)->path);
+}
+
+/* only new directories complain, the others are retried quietly */
+static void filewatch_add(filewatch_dir_t* dir, int quiet) {
+    dir->wd = inotify_add_watch(gdata.filewatch.fd,
+                                dir->path[0] ? dir->path : ".", FILEWATCH_MASK);
+    if (dir->wd < 0) {
+        if (!quiet) {
+            outerror(OUTERROR_TYPE_WARN, "Can't watch directory '%s': %s",
+                     dir->path[0] ? dir->path : ".", strerror(errno));
+        }
+        gdata.filewatch.incomplete = 1;
+    }
+}
+
+static void filewatch_remove(filewatch_dir_t* dir, const filewatch_dir_t* keep,
+                             int keepcount) {
+    int i;
+
+    if (dir->wd >= 0) {
+        /* two paths to the same directory share one watch */
+        for (i = 0; i < keepcount; i++) {
+            if (keep[i].wd == dir->wd) {
+                break;
+            }
+        }
+        if (i == keepcount) {
+            inotify_rm_watch(gdata.filewatch.fd, dir->wd);
+        }
+    }
+    mydelete(dir->path);
+}
+
+void filewatch_stop(void) {
+    int i;
+
+    for (i = 0; i < gdata.filewatch.count; i++) {
+        mydelete(gdata.filewatch.dirs[i].path);
+    }
+    mydelete(gdata.filewatch.dirs);
+    mydelete(gdata.filewatch.bywd);
+    gdata.filewatch.count = 0;
+
+    if (gdata.filewatch.fd != FD_UNUSED) {
+        close(gdata.filewatch.fd);
+        gdata.filewatch.fd = FD_UNUSED;
+    }
+}
+
+/* watch the directories of all packs and the watchdirs, nothing else */
+static void filewatch_sync(void) {
+    filewatch_name_t* names;
+    filewatch_dir_t* dirs;
+    filewatch_dir_t* old;
+    watchdir_batch_t b;
+    xdcc* xd;
+    char* dir;
+    int count, oldcount, scan, i, j, k, r;
+
+    updatecontext();
+
+    if (gdata.filewatch.fd == FD_UNUSED) {
+        gdata.filewatch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (gdata.filewatch.fd < 0) {
+            outerror(OUTERROR_TYPE_WARN, "Can't watch pack files: %s",
+                     strerror(errno));
+            gdata.filewatch.fd = FD_UNUSED;
+            gdata.filewatch.failed = 1;
+            return;
+        }
+    }
+
+    names = mymalloc(sizeof(filewatch_name_t) *
+                     (irlist_size(&gdata.xdccs) +
+                      irlist_size(&gdata.watchdirs) + 1));
+
+    /* packs of one directory are usually next to each other */
+    count = 0;
+    for (xd = irlist_get_head(&gdata.xdccs); xd; xd = irlist_get_next(xd)) {
+        filewatch_dirname(xd->file, &names[count]);
+        if (!count || filewatch_cmp_name(&names[count - 1], &names[count])) {
+            count++;
+        }
+    }
+
+    for (dir = irlist_get_head(&gdata.watchdirs); dir;
+         dir = irlist_get_next(dir)) {
+        names[count].path = dir;
+        names[count].len = strlen(dir);
+        names[count].watchdir = 1;
+        count++;
+    }
+
+    qsort(names, count, sizeof(filewatch_name_t), filewatch_cmp_name);
+    for (i = j = 0; i < count; i++) {
+        if (!j || filewatch_cmp_name(&names[j - 1], &names[i])) {
+            names[j++] = names[i];
+        } else {
+            names[j - 1].watchdir |= names[i].watchdir;
+        }
+    }
+    count = j;
+
+    /* merge with the watched directories, both sorted by path */
+    old = gdata.filewatch.dirs;
+    oldcount = gdata.filewatch.count;
+    dirs = mycalloc(sizeof(filewatch_dir_t) * (count + 1));
+
+    gdata.filewatch.incomplete = 0;
+    scan = 0;
+    i = j = k = 0;
+    while ((i < count) || (j < oldcount)) {
+        if ((i < count) && (j < oldcount)) {
+            filewatch_name_t n;
+            n.path = old[j].path;
+            n.len = strlen(old[j].path);
+            r = filewatch_cmp_name(&names[i], &n);
+        } else {
+            r = (i < count) ? -1 : 1;
+        }
+
+        if (r < 0) {
+            dirs[k].path = mymalloc(names[i].len + 1);
+            memcpy(dirs[k].path, names[i].path, names[i].len);
+            dirs[k].path[names[i].len] = '\0';
+            dirs[k].watchdir = names[i].watchdir;
+            dirs[k].scan = names[i].watchdir;
+            filewatch_add(&dirs[k], 0);
+            scan |= dirs[k].scan;
+            k++;
+            i++;
+        } else if (r > 0) {
+            /* no packs left in it, dropped after the merge */
+            j++;
+        } else {
+            dirs[k] = old[j];
+            old[j].path = NULL;
+            /* events may have been missed while it was not watched */
+            dirs[k].scan = names[i].watchdir &&
+                           (!dirs[k].watchdir || (dirs[k].wd < 0));
+            dirs[k].watchdir = names[i].watchdir;
+            if (dirs[k].wd < 0) {
+                filewatch_add(&dirs[k], 1);
+            }
+            scan |= dirs[k].scan;
+            k++;
+            i++;
+            j++;
+        }
+    }
+
+    for (j = 0; j < oldcount; j++) {
+        if (old[j].path) {
+            filewatch_remove(&old[j], dirs, k);
+        }
+    }
+
+    mydelete(old);
+    mydelete(names);
+    mydelete(gdata.filewatch.bywd);
+
+    gdata.filewatch.dirs = dirs;
+    gdata.filewatch.count = k;
+    gdata.filewatch.bywd = mymalloc(sizeof(filewatch_dir_t*) * (k + 1));
+    for (i = 0; i < k; i++) {
+        gdata.filewatch.bywd[i] = &dirs[i];
+    }
+    qsort(gdata.filewatch.bywd, k, sizeof(filewatch_dir_t*), filewatch_cmp_wd);
+
+    /* after the watch is set up, nothing falls in between */
+    if (scan) {
+        watchdir_start(&b);
+        for (i = 0; i < k; i++) {
+            if (dirs[i].scan) {
+                watchdir_scan(&b, dirs[i].path, dirs[i].wd < 0);
+                dirs[i].scan = 0;
+            }
+        }
+        watchdir_finish(&b);
+    }
+}
+
+/* check the packs named by the events that are waiting */
+void filewatch_read(void) {
+    union {
+        struct inotify_event ev;
+        char data[64 * 1024];
+    } buffer;
+    const struct inotify_event* ev;
+    filewatch_dir_t key;
+    filewatch_dir_t* keyp = &key;
+    filewatch_dir_t** found;
+    filewatch_dir_t** end;
+    filewatch_event_t* changed = NULL;
+    watchdir_batch_t b;
+    xdcc** packs = NULL;
+    int nchanged = 0, achanged = 0, watchdir = 0, npacks = 0, apacks = 0;
+    ssize_t howmuch;
+    char* p;
+    xdcc* xd;
+    int i, j;
+
+    updatecontext();
+
+    while ((howmuch = read(gdata.filewatch.fd, buffer.data,
+                           sizeof(buffer.data))) > 0) {
+        for (p = buffer.data; p < buffer.data + howmuch;
+             p += sizeof(struct inotify_event) + ev->len) {
+            ev = (const struct inotify_event*)p;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                gdata.filewatch.sweep = 1;
+                continue;
+            }
+
+            key.wd = ev->wd;
+            found = bsearch(&keyp, gdata.filewatch.bywd, gdata.filewatch.count,
+                            sizeof(filewatch_dir_t*), filewatch_cmp_wd);
+            if (!found) {
+                continue;
+            }
+
+            if (ev->mask & (IN_IGNORED | IN_DELETE_SELF | IN_MOVE_SELF)) {
+                /* the directory itself went away, watched again on sync */
+                for (i = 0; i < gdata.filewatch.count; i++) {
+                    if (gdata.filewatch.dirs[i].wd == ev->wd) {
+                        gdata.filewatch.dirs[i].wd = -1;
+                    }
+                }
+                gdata.filewatch.sweep = 1;
+                continue;
+            }
+
+            if (!ev->len) {
+                continue;
+            }
+
+            /* every path the directory is known by */
+            while ((found > gdata.filewatch.bywd) &&
+                   (found[-1]->wd == ev->wd)) {
+                found--;
+            }
+            end = gdata.filewatch.bywd + gdata.filewatch.count;
+            for (; (found < end) && ((*found)->wd == ev->wd); found++) {
+                if (nchanged == achanged) {
+                    filewatch_event_t* grow;
+                    achanged = achanged ? achanged * 2 : 16;
+                    grow = mycalloc(sizeof(filewatch_event_t) * achanged);
+                    if (nchanged) {
+                        memcpy(grow, changed,
+                               sizeof(filewatch_event_t) * nchanged);
+                    }
+                    mydelete(changed);
+                    changed = grow;
+                }
+
+                changed[nchanged].path =
+                    mymalloc(strlen((*found)->path) + strlen(ev->name) + 1);
+                strcpy(changed[nchanged].path, (*found)->path);
+                strcat(changed[nchanged].path, ev->name);
+                changed[nchanged].mask = ev->mask;
+                changed[nchanged].watchdir = (*found)->watchdir;
+                watchdir |= (*found)->watchdir;
+                nchanged++;
+            }
+        }
+    }
+
+    if ((howmuch < 0) && (errno != EAGAIN) && (errno != EINTR)) {
+        outerror(OUTERROR_TYPE_WARN, "Can't read file events: %s",
+                 strerror(errno));
+        filewatch_stop();
+        gdata.filewatch.failed = 1;
+        gdata.filewatch.sweep = 1;
+    }
+
+    if (!nchanged) {
+        return;
+    }
+
+    qsort(changed, nchanged, sizeof(filewatch_event_t), filewatch_cmp_event);
+    for (i = j = 0; i < nchanged; i++) {
+        if (!j || filewatch_cmp_event(&changed[j - 1], &changed[i])) {
+            changed[j++] = changed[i];
+        } else {
+            changed[j - 1].mask |= changed[i].mask;
+            changed[j - 1].watchdir |= changed[i].watchdir;
+            mydelete(changed[i].path);
+        }
+    }
+    nchanged = j;
+
+    statefile_hold();
+
+    if (watchdir) {
+        watchdir_start(&b);
+        for (i = 0; i < nchanged; i++) {
+            if (!changed[i].watchdir) {
+                continue;
+            }
+            xd = xdcc_find_file(changed[i].path, NULL);
+            if (xd && (changed[i].mask & (IN_DELETE | IN_MOVED_FROM)) &&
+                (access(changed[i].path, F_OK) < 0) && (errno == ENOENT)) {
+                for (; xd; xd = xdcc_find_file(changed[i].path, xd)) {
+                    watchdir_gone(&b, xd);
+                }
+            } else if (!xd &&
+                       (changed[i].mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) &&
+                       watchdir_ready(changed[i].path, 0)) {
+                watchdir_command("add", changed[i].path);
+            }
+        }
+        watchdir_finish(&b);
+    }
+
+    /* collected first, look_for_file_changes() may move them in the hash */
+    for (i = 0; i < nchanged; i++) {
+        for (xd = xdcc_find_file(changed[i].path, NULL); xd;
+             xd = xdcc_find_file(changed[i].path, xd)) {
+            if (npacks == apacks) {
+                xdcc** grow;
+                apacks = apacks ? apacks * 2 : 16;
+                grow = mycalloc(sizeof(xdcc*) * apacks);
+                if (npacks) {
+                    memcpy(grow, packs, sizeof(xdcc*) * npacks);
+                }
+                mydelete(packs);
+                packs = grow;
+            }
+            packs[npacks++] = xd;
+        }
+        mydelete(changed[i].path);
+    }
+    mydelete(changed);
+
+    for (i = 0; i < npacks; i++) {
+        look_for_file_changes(packs[i]);
+    }
+    mydelete(packs);
+
+    statefile_release();
+}
+
+#endif
+
+/* every 20 seconds from the main loop */
+void filewatch_tick(void) {
+    int watched = 0;
+
+    updatecontext();
+
+    statefile_hold();
+
+#ifdef HAVE_INOTIFY
+    if (gdata.nofilewatch || gdata.filewatch.failed) {
+        filewatch_stop();
+    } else {
+        filewatch_sync();
+    }
+    watched = (gdata.filewatch.fd != FD_UNUSED);
+#endif
+
+    /* no events to follow, or some of them were lost */
+    if (!watched || gdata.filewatch.sweep) {
+        watchdir_scan_all(!watched);
+    }
+
+#ifdef HAVE_INOTIFY
+    if (watched && !gdata.filewatch.incomplete && !gdata.filewatch.sweep) {
+        filewatch_sweep_slice();
+    } else {
+        filewatch_sweep_all();
+    }
+#else
+    filewatch_sweep_all();
+#endif
+
+    statefile_release();
+}
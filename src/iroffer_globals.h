@@ -91,9 +91,11 @@ typedef struct {
     char* adminpass;
     irlist_t adminhost;
     char* filedir;
+    irlist_t watchdirs; /* with a trailing slash */
     char* statefile;
     char* xdcclistfile;
     int xdcclistfileraw;
+    char* xdcclistjson;
     char *periodicmsg_nick, *periodicmsg_msg;
     int periodicmsg_time;
     char* uploaddir;
@@ -106,12 +108,28 @@ typedef struct {
     char* restrictprivlistmsg;
     int punishslowusers;
     int nomd5sum;
+    int nocrc32;
+    int nosha256;
+    int nofilewatch;
+    int memdebug;
     char* nickserv_pass;
     int notifytime;
     int respondtochannelxdcc;
     int respondtochannellist;
     int quietmode;
     int smallfilebypass;
+    int fdcache;
+    int blockcache_mb;
+    int uploadmaxspeed;
+    int uploadack;
+    int uploadsplice;
+    int uploadautoadd;
+    int hashthreads;
+    int hashlanes;
+    int hashmaxspeed;
+    int hashcoldtimestart, hashcoldtimeend;
+    int scanthreads;
+    int searchmaxresults;
     irlist_t autoignore_exclude;
     int autoignore_threshold;
 
@@ -168,6 +186,9 @@ typedef struct {
     int stdout_buffer_init;
     ir_boutput_t stdout_buffer;
 
+    /* transient allocations while parsing a server line */
+    ir_arena_t parsearena;
+
     /* channel */
     irlist_t channels;
 
@@ -188,6 +209,7 @@ typedef struct {
     int crashing;
 
     unsigned long xdccsent[XDCC_SENT_SIZE];
+    unsigned long xdccrecv[XDCC_SENT_SIZE];
 
     int inamnt[INAMNT_SIZE];
     int ignore;
@@ -227,6 +249,30 @@ typedef struct {
     irlist_t ignorelist;
 
     irlist_t xdccs;
+    struct {
+        xdcc** pack; /* pack n at [n - 1], same order as xdccs */
+        int count;
+        int alloc;
+        xdcc** byfile;  /* hash chains on xdcc.file_next */
+        xdcc** byinode; /* hash chains on xdcc.inode_next */
+        unsigned int hashsize;
+    } packs;
+    struct {
+        irlist_item_t* free[IRLIST_SLAB_MAXITEM / IRLIST_SLAB_ROUND];
+        char* chunk;
+        int chunk_left;
+        int chunks;
+    } irlist_slab;
+    struct {
+        int width; /* of the gets column, 0 when it has to be found again */
+        float minspeed, maxspeed;
+        int raw;
+    } xdl;
+    struct {
+        search_trigram_t** hash;
+        unsigned int hashsize;
+        int trigrams;
+    } search;
     irlist_t mainqueue;
     irlist_t trans;
     irlist_t uploads;
@@ -234,6 +280,11 @@ typedef struct {
     meminfo_t* meminfo;
     int meminfo_count;
     int meminfo_depth;
+    memsite_t memsites[MEMSITES];
+    memsite_t memsite_other; /* once memsites is 3/4 full */
+    int memsites_used;
+    int mem_count;
+    long mem_size;
 
 #if !defined(NO_CHROOT)
     char* chrootdir;
@@ -247,11 +298,83 @@ typedef struct {
     struct {
         xdcc* xpack;
         int file_fd;
-        MD5_CTX md5sum;
+        digest_ctx digest;
     } md5build;
 
+#ifdef HAVE_PTHREAD
+    struct {
+        hashworker_t* workers;
+        int count;
+        irlist_t queue; /* xdcc* to hash, most demanded first */
+        int refill;     /* packs added or lost md5sums, scan them again */
+        int retry;      /* a pack failed or streams, scan on the next minute */
+        int offpeak;    /* hashcoldtime window was open at the last scan */
+        pthread_mutex_t lock;
+        pthread_cond_t cond;
+        /* protected by lock */
+        int exiting;
+        long budget; /* bytes per second, 0 for no limit */
+        time_t budget_time;
+        long budget_used;
+    } hashpool;
+#endif
+
     transfermethod_e transfermethod;
 
+    unsigned long fdcache_hits;
+    unsigned long fdcache_misses;
+    irlist_t fdcache_lru; /* idle packs with an open fd, oldest first */
+
+    struct {
+        irlist_t t1, t2, b1, b2;
+        int p;
+        blockcache_entry_t** hash;
+        unsigned long hits;
+        unsigned long misses;
+        unsigned long evictions;
+    } blockcache;
+
+    irlist_t dirscans; /* dirscan_t */
+
+    int statefile_hold; /* statefile_hold() depth, writes wait */
+    int statefile_pending;
+    int xdcclist_pending;
+    /* what was last saved to xdcclistfile and xdcclistjson */
+    int xdcclistfile_saved, xdcclistjson_saved;
+    MD5Digest xdcclistfile_md5, xdcclistjson_md5;
+
+    struct {
+        xdcc** head; /* group heads by size and md5sum */
+        unsigned int size;
+        unsigned int count;
+    } duphash;
+
+#ifdef HAVE_PTHREAD
+    struct {
+        pthread_t thread;
+        int running;
+        int wake[2]; /* the writer writes a byte after each buffer */
+        pthread_mutex_t lock;
+        pthread_cond_t work;
+        pthread_cond_t done;
+        /* protected by lock */
+        upload* head; /* queued buffers, chained on upload.wnext */
+        upload* tail;
+        int exiting;
+    } upwriter;
+#endif
+
+    struct {
+        int fd;
+        filewatch_dir_t* dirs;  /* sorted by path */
+        filewatch_dir_t** bywd; /* sorted by wd */
+        int count;
+        int cursor;     /* next pack of the slow sweep */
+        int sweep;      /* events were lost, check every pack */
+        int incomplete; /* some directories are not watched */
+        int failed;     /* inotify does not work here */
+    } filewatch;
+
 } gdata_t;
 
 
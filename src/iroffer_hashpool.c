@@ -0,0 +1,921 @@
+/*
+iroffer - An IRC file server using the DCC protocol
+Copyright (C) see CONTRIBUTORS
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* include the headers */
+#include "iroffer_config.h"
+#include "iroffer_defines.h"
+#include "iroffer_headers.h"
+#include "iroffer_globals.h"
+
+/*
+ * Background md5sum workers
+ *
+ * Each worker thread hashes up to one pack per SIMD lane of the multi-buffer
+ * MD5 at a time, with large sequential reads.  CRC32 and SHA-256 are taken
+ * from the same buffers, lane by lane.  The main thread owns everything
+ * else: it keeps the queue of packs ordered by demand, hands a pack to an
+ * idle worker and picks up the result once the worker marks itself done.
+ * Workers only use the file name, digest context and buffer they were
+ * given, never the xdcc itself, and never call into the rest of iroffer.
+ */
+
+static int streamhash_busy(const xdcc* xpack);
+
+/*
+ * Hashing order
+ *
+ * Packs missing a digest are hashed in order of demand: packs being sent
+ * first, then the ones with the most queue entries and recent XDCC SEND or
+ * INFO requests, then by gets.  Packs nobody is asking for are cold and
+ * wait for the hashcoldtime window when one is set.
+ */
+
+typedef struct {
+    xdcc* xd;
+    int order; /* pack number, or position in the hash queue */
+    int sending;
+    int queued;
+    int requests;
+} hashdemand_t;
+
+/* recent requests, halved for every hour since the last one */
+static int hashdemand_requests(xdcc* xd) {
+    time_t hours = (gdata.curtime - xd->requests_time) / 3600;
+
+    if (hours > 0) {
+        xd->requests = (hours < 31) ? (xd->requests >> hours) : 0;
+        xd->requests_time += hours * 3600;
+    }
+    return xd->requests;
+}
+
+void hashpool_request(xdcc* xpack) {
+    hashdemand_requests(xpack);
+    if (!xpack->requests++) {
+        xpack->requests_time = gdata.curtime;
+    }
+#ifdef HAVE_PTHREAD
+    if ((xpack->requests == 1) && digest_missing(xpack)) {
+        /* may no longer be cold, do not wait for the next minute */
+        gdata.hashpool.refill = 1;
+    }
+#endif
+}
+
+static int hashdemand_offpeak(void) {
+    struct tm* localt;
+
+    if (gdata.hashcoldtimestart == gdata.hashcoldtimeend) {
+        return 1;
+    }
+
+    localt = localtime(&gdata.curtime);
+    if (gdata.hashcoldtimestart < gdata.hashcoldtimeend) {
+        return (localt->tm_hour >= gdata.hashcoldtimestart) &&
+               (localt->tm_hour < gdata.hashcoldtimeend);
+    }
+    return (localt->tm_hour >= gdata.hashcoldtimestart) ||
+           (localt->tm_hour < gdata.hashcoldtimeend);
+}
+
+static int hashdemand_cmp_xd(const void* a, const void* b) {
+    const hashdemand_t* da = a;
+    const hashdemand_t* db = b;
+
+    return (da->xd > db->xd) - (da->xd < db->xd);
+}
+
+static int hashdemand_cmp(const void* a, const void* b) {
+    const hashdemand_t* da = a;
+    const hashdemand_t* db = b;
+
+    if (da->sending != db->sending) {
+        return db->sending - da->sending;
+    }
+    if ((da->queued + da->requests) != (db->queued + db->requests)) {
+        return (db->queued + db->requests) - (da->queued + da->requests);
+    }
+    if (da->xd->gets != db->xd->gets) {
+        return (db->xd->gets > da->xd->gets) - (db->xd->gets < da->xd->gets);
+    }
+    return da->order - db->order;
+}
+
+static hashdemand_t* hashdemand_find(hashdemand_t* list, int count,
+                                     xdcc* xd) {
+    hashdemand_t key;
+
+    key.xd = xd;
+    return bsearch(&key, list, count, sizeof(hashdemand_t), hashdemand_cmp_xd);
+}
+
+/* count the queue entries and transfers of each pack in the list */
+static void hashdemand_count(hashdemand_t* list, int count) {
+    hashdemand_t* hd;
+    pqueue* pq;
+    transfer* tr;
+
+    qsort(list, count, sizeof(hashdemand_t), hashdemand_cmp_xd);
+
+    for (pq = irlist_get_head(&gdata.mainqueue); pq;
+         pq = irlist_get_next(pq)) {
+        if ((hd = hashdemand_find(list, count, pq->xpack))) {
+            hd->queued++;
+        }
+    }
+
+    for (tr = irlist_get_head(&gdata.trans); tr; tr = irlist_get_next(tr)) {
+        if ((tr->tr_status != TRANSFER_STATUS_DONE) &&
+            (hd = hashdemand_find(list, count, tr->xpack))) {
+            hd->sending++;
+        }
+    }
+}
+
+/* the packs to hash now, most demanded first, returns how many */
+static int hashdemand_collect(hashdemand_t** out) {
+    hashdemand_t* list;
+    xdcc* xd;
+    int count, packnum, i, j, offpeak;
+
+    updatecontext();
+
+    list = mycalloc(sizeof(hashdemand_t) * (irlist_size(&gdata.xdccs) + 1));
+
+    count = 0;
+    packnum = 1;
+    for (xd = irlist_get_head(&gdata.xdccs); xd;
+         xd = irlist_get_next(xd), packnum++) {
+        if (!digest_missing(xd) || streamhash_busy(xd)) {
+            continue;
+        }
+        if ((xd->hash_retry > gdata.curtime) || streamhash_active(xd)) {
+            /* picked up once the stream finishes or the retry is due */
+#ifdef HAVE_PTHREAD
+            gdata.hashpool.retry = 1;
+#endif
+            continue;
+        }
+        list[count].xd = xd;
+        list[count].order = packnum;
+        list[count].requests = hashdemand_requests(xd);
+        count++;
+    }
+
+    offpeak = hashdemand_offpeak();
+#ifdef HAVE_PTHREAD
+    gdata.hashpool.offpeak = offpeak;
+#endif
+
+    if (count) {
+        hashdemand_count(list, count);
+
+        for (i = j = 0; i < count; i++) {
+            if (offpeak || list[i].sending || list[i].queued ||
+                list[i].requests) {
+                list[j++] = list[i];
+            }
+        }
+        count = j;
+
+        qsort(list, count, sizeof(hashdemand_t), hashdemand_cmp);
+    }
+
+    *out = list;
+    return count;
+}
+
+/* the most demanded pack to hash in the main loop, NULL for none */
+xdcc* md5build_next(int* packnum) {
+    hashdemand_t* list;
+    xdcc* xd = NULL;
+
+    if (hashdemand_collect(&list)) {
+        xd = list[0].xd;
+        *packnum = list[0].order;
+    }
+    mydelete(list);
+
+    return xd;
+}
+
+#ifdef HAVE_PTHREAD
+
+/* wait for room in the I/O budget, non-zero if the job is canceled */
+static int hashpool_throttle(hashjob_t* job, size_t len) {
+    struct timespec ts = {0, 100 * 1000 * 1000};
+    time_t now;
+    int canceled;
+
+    pthread_mutex_lock(&gdata.hashpool.lock);
+
+    while (!job->cancel && !gdata.hashpool.exiting && gdata.hashpool.budget) {
+        now = time(NULL);
+        if (now != gdata.hashpool.budget_time) {
+            /* carry over what a large read overdrew */
+            gdata.hashpool.budget_used = max2(
+                0, gdata.hashpool.budget_used -
+                       gdata.hashpool.budget *
+                           (long)(now - gdata.hashpool.budget_time));
+            gdata.hashpool.budget_time = now;
+        }
+        if (gdata.hashpool.budget_used < gdata.hashpool.budget) {
+            break;
+        }
+        pthread_mutex_unlock(&gdata.hashpool.lock);
+        nanosleep(&ts, NULL);
+        pthread_mutex_lock(&gdata.hashpool.lock);
+    }
+
+    gdata.hashpool.budget_used += len;
+    job->bytes += len;
+    canceled = job->cancel || gdata.hashpool.exiting;
+
+    pthread_mutex_unlock(&gdata.hashpool.lock);
+
+    return canceled;
+}
+
+/* worker side state of one lane, the digests go to job->hash */
+typedef struct {
+    int active;
+    int finished;
+    int error;
+    int fd;
+    int eof;
+    unsigned char* buffer;
+    size_t pos, len;
+} hashlane_t;
+
+/* make sure the lane has a whole block buffered, 0 or an errno */
+static int hashpool_refill(hashjob_t* job, hashlane_t* l, size_t size) {
+    ssize_t howmuch;
+
+    if (l->fd < 0) {
+        l->fd = open(job->file, O_RDONLY);
+        if (l->fd < 0) {
+            return errno;
+        }
+#if defined(HAVE_POSIX_FADVISE)
+        posix_fadvise(l->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        if (lseek(l->fd, job->hash.pos, SEEK_SET) < 0) {
+            return errno;
+        }
+    }
+
+    while (!l->eof && ((l->len - l->pos) < 64)) {
+        memmove(l->buffer, l->buffer + l->pos, l->len - l->pos);
+        l->len -= l->pos;
+        l->pos = 0;
+
+        if (hashpool_throttle(job, size - l->len)) {
+            return ECANCELED;
+        }
+
+        howmuch = read(l->fd, l->buffer + l->len, size - l->len);
+        if ((howmuch < 0) && (errno == EINTR)) {
+            continue;
+        } else if (howmuch < 0) {
+            return errno;
+        } else if (howmuch == 0) {
+            l->eof = 1;
+        }
+        l->len += howmuch;
+    }
+
+    return 0;
+}
+
+/* continue reading where the digests want the data next */
+static int hashpool_seek(hashjob_t* job, hashlane_t* l) {
+    if (lseek(l->fd, job->hash.pos, SEEK_SET) < 0) {
+        return errno;
+    }
+    l->pos = l->len = 0;
+    l->eof = 0;
+    return 0;
+}
+
+/* spot check buffered data against the old piece table, 0 or an errno */
+static int hashpool_verify(hashjob_t* job, hashlane_t* l) {
+    size_t n = l->len - l->pos;
+
+    if (!n) {
+        return digest_eof(&job->hash) ? hashpool_seek(job, l) : 0;
+    }
+
+    if (digest_update(&job->hash, l->buffer + l->pos, n)) {
+        return hashpool_seek(job, l);
+    }
+    l->pos += n;
+
+    return 0;
+}
+
+static void hashpool_finishlane(hashjob_t* job, hashlane_t* l, int error) {
+    if (!error) {
+        digest_update(&job->hash, l->buffer + l->pos, l->len - l->pos);
+        digest_final(&job->hash, &job->digest);
+    }
+    if (l->fd >= 0) {
+        close(l->fd);
+    }
+    l->error = error;
+    l->finished = 1;
+}
+
+static void* hashpool_worker(void* arg) {
+    hashworker_t* w = arg;
+    hashlane_t lane[MD5MB_MAXLANES];
+    md5mb_t* ctx[MD5MB_MAXLANES];
+    const unsigned char* data[MD5MB_MAXLANES];
+    int idx[MD5MB_MAXLANES];
+    size_t lanesize, nblocks;
+    sigset_t ss;
+    int i, n, error;
+
+    /* signals are for the main thread */
+    sigfillset(&ss);
+    pthread_sigmask(SIG_BLOCK, &ss, NULL);
+
+    lanesize = HASHPOOL_READSIZE / w->lanes;
+    memset(lane, 0, sizeof(lane));
+
+    pthread_mutex_lock(&gdata.hashpool.lock);
+
+    while (1) {
+        /* hand back finished packs and pick up new ones */
+        n = 0;
+        for (i = 0; i < w->lanes; i++) {
+            hashjob_t* job = &w->job[i];
+            if (lane[i].finished) {
+                job->error = lane[i].error;
+                job->state = HASHWORKER_DONE;
+                lane[i].active = lane[i].finished = 0;
+            }
+            if (!lane[i].active && (job->state == HASHWORKER_ASSIGNED)) {
+                lane[i].active = 1;
+                lane[i].fd = -1;
+                lane[i].eof = 0;
+                lane[i].pos = lane[i].len = 0;
+                lane[i].buffer = w->buffer + (i * lanesize);
+            }
+            n += lane[i].active;
+        }
+
+        if (gdata.hashpool.exiting) {
+            break;
+        }
+
+        if (!n) {
+            pthread_cond_wait(&gdata.hashpool.cond, &gdata.hashpool.lock);
+            continue;
+        }
+
+        pthread_mutex_unlock(&gdata.hashpool.lock);
+
+        /* lanes spot checking an old piece table only crc32 their data */
+        n = 0;
+        nblocks = HASHPOOL_READSIZE / 64;
+        for (i = 0; i < w->lanes; i++) {
+            hashjob_t* job = &w->job[i];
+            hashlane_t* l = &lane[i];
+            if (!l->active) {
+                continue;
+            }
+            error = hashpool_refill(job, l, lanesize);
+            if (!error && job->hash.spots) {
+                error = hashpool_verify(job, l);
+                if (!error) {
+                    continue;
+                }
+            }
+            if (error || (l->eof && ((l->len - l->pos) < 64))) {
+                hashpool_finishlane(job, l, error);
+                continue;
+            }
+            /* stop at the end of a piece to record it */
+            nblocks = min2(nblocks, (l->len - l->pos) / 64);
+            nblocks = min2(nblocks,
+                           (PIECE_SIZE - (size_t)(job->hash.pos % PIECE_SIZE)) /
+                               64);
+            ctx[n] = &job->hash.md5;
+            data[n] = l->buffer + l->pos;
+            idx[n] = i;
+            n++;
+        }
+
+        if (n) {
+            md5mb_blocks(ctx, data, n, nblocks);
+        }
+
+        for (i = 0; i < n; i++) {
+            hashlane_t* l = &lane[idx[i]];
+            digest_update_nomd5(&w->job[idx[i]].hash, l->buffer + l->pos,
+                                nblocks * 64);
+            l->pos += nblocks * 64;
+        }
+
+        pthread_mutex_lock(&gdata.hashpool.lock);
+    }
+
+    for (i = 0; i < w->lanes; i++) {
+        if (lane[i].active && !lane[i].finished && (lane[i].fd >= 0)) {
+            close(lane[i].fd);
+        }
+    }
+
+    pthread_mutex_unlock(&gdata.hashpool.lock);
+
+    return NULL;
+}
+
+static void hashpool_start(void) {
+    hashworker_t* w;
+    int i, retval;
+
+    updatecontext();
+
+    pthread_mutex_init(&gdata.hashpool.lock, NULL);
+    pthread_cond_init(&gdata.hashpool.cond, NULL);
+    gdata.hashpool.exiting = 0;
+    gdata.hashpool.refill = 1;
+
+    gdata.hashpool.workers = mycalloc(sizeof(hashworker_t) * gdata.hashthreads);
+
+    for (i = 0; i < gdata.hashthreads; i++) {
+        w = &gdata.hashpool.workers[i];
+        w->lanes = gdata.hashlanes ? gdata.hashlanes : md5mb_maxlanes();
+        w->buffer = mymalloc(HASHPOOL_READSIZE);
+
+        retval = pthread_create(&w->thread, NULL, hashpool_worker, w);
+        if (retval) {
+            outerror(OUTERROR_TYPE_WARN, "[MD5]: Couldn't start worker: %s",
+                     strerror(retval));
+            mydelete(w->buffer);
+            break;
+        }
+    }
+
+    gdata.hashpool.count = i;
+
+    if (gdata.debug > 0) {
+        ioutput(CALLTYPE_NORMAL, OUT_S, COLOR_YELLOW,
+                "[MD5]: started %d workers with %d lanes",
+                gdata.hashpool.count,
+                gdata.hashlanes ? gdata.hashlanes : md5mb_maxlanes());
+    }
+
+    if (!gdata.hashpool.count) {
+        mydelete(gdata.hashpool.workers);
+        pthread_cond_destroy(&gdata.hashpool.cond);
+        pthread_mutex_destroy(&gdata.hashpool.lock);
+    }
+}
+
+void hashpool_stop(void) {
+    hashworker_t* w;
+    int i, j;
+
+    updatecontext();
+
+    if (!gdata.hashpool.count) {
+        return;
+    }
+
+    pthread_mutex_lock(&gdata.hashpool.lock);
+    gdata.hashpool.exiting = 1;
+    pthread_cond_broadcast(&gdata.hashpool.cond);
+    pthread_mutex_unlock(&gdata.hashpool.lock);
+
+    for (i = 0; i < gdata.hashpool.count; i++) {
+        w = &gdata.hashpool.workers[i];
+        pthread_join(w->thread, NULL);
+        for (j = 0; j < w->lanes; j++) {
+            mydelete(w->job[j].file);
+            digest_free(&w->job[j].hash);
+            mydelete(w->job[j].digest.pieces.piece);
+        }
+        mydelete(w->buffer);
+    }
+
+    mydelete(gdata.hashpool.workers);
+    gdata.hashpool.count = 0;
+
+    while (irlist_size(&gdata.hashpool.queue)) {
+        irlist_delete(&gdata.hashpool.queue,
+                      irlist_get_head(&gdata.hashpool.queue));
+    }
+
+    pthread_cond_destroy(&gdata.hashpool.cond);
+    pthread_mutex_destroy(&gdata.hashpool.lock);
+}
+
+static int hashpool_busy(const xdcc* xpack) {
+    int i, j;
+
+    for (i = 0; i < gdata.hashpool.count; i++) {
+        for (j = 0; j < gdata.hashpool.workers[i].lanes; j++) {
+            if (gdata.hashpool.workers[i].job[j].xpack == xpack) {
+                return 1;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* order the queue by demand again, it changes as packs are requested */
+static void hashpool_sort(void) {
+    hashdemand_t* list;
+    xdcc** qxd;
+    int count, i;
+
+    count = irlist_size(&gdata.hashpool.queue);
+    if (count < 2) {
+        return;
+    }
+
+    list = mycalloc(sizeof(hashdemand_t) * count);
+    for (i = 0, qxd = irlist_get_head(&gdata.hashpool.queue); qxd;
+         qxd = irlist_get_next(qxd), i++) {
+        list[i].xd = *qxd;
+        list[i].order = i;
+        list[i].requests = hashdemand_requests(*qxd);
+    }
+
+    hashdemand_count(list, count);
+    qsort(list, count, sizeof(hashdemand_t), hashdemand_cmp);
+
+    for (i = 0, qxd = irlist_get_head(&gdata.hashpool.queue); qxd;
+         qxd = irlist_get_next(qxd)) {
+        *qxd = list[i++].xd;
+    }
+
+    mydelete(list);
+}
+
+/* queue the packs to hash, most demanded first */
+static void hashpool_fill(void) {
+    hashdemand_t* list;
+    xdcc** qxd;
+    int count, i;
+
+    updatecontext();
+
+    while (irlist_size(&gdata.hashpool.queue)) {
+        irlist_delete(&gdata.hashpool.queue,
+                      irlist_get_head(&gdata.hashpool.queue));
+    }
+
+    count = hashdemand_collect(&list);
+
+    for (i = 0; i < count; i++) {
+        qxd = irlist_add(&gdata.hashpool.queue, sizeof(xdcc*));
+        *qxd = list[i].xd;
+    }
+
+    mydelete(list);
+
+    gdata.hashpool.refill = 0;
+}
+
+static hashworker_state_e hashpool_state(const hashjob_t* job) {
+    hashworker_state_e state;
+
+    pthread_mutex_lock(&gdata.hashpool.lock);
+    state = job->state;
+    pthread_mutex_unlock(&gdata.hashpool.lock);
+
+    return state;
+}
+
+static void hashpool_done(hashjob_t* job) {
+    xdcc* xd = job->xpack;
+    char* tempstr;
+
+    updatecontext();
+
+    if (!xd) {
+        /* canceled while running */
+    } else if (job->error) {
+        outerror(OUTERROR_TYPE_WARN,
+                 "[MD5]: Can't read data from file '%s': %s", xd->file,
+                 strerror(job->error));
+        xd->hash_retry = gdata.curtime + HASH_RETRY;
+        gdata.hashpool.retry = 1;
+    } else {
+        digest_to_xdcc(&job->digest, xd);
+        xdcc_dup_link(xd);
+
+        if (!gdata.attop) {
+            gototop();
+        }
+
+        tempstr = mycalloc(maxtextlength);
+        digest_print(tempstr, maxtextlength, &job->digest);
+        ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L | OUT_D, COLOR_NO_COLOR,
+                "[MD5]: Pack %d %s", xd->packnum, tempstr);
+        mydelete(tempstr);
+    }
+
+    job->xpack = NULL;
+    mydelete(job->file);
+    digest_free(&job->hash);
+    mydelete(job->digest.pieces.piece);
+
+    pthread_mutex_lock(&gdata.hashpool.lock);
+    job->state = HASHWORKER_IDLE;
+    pthread_mutex_unlock(&gdata.hashpool.lock);
+}
+
+static void hashpool_assign(hashjob_t* job) {
+    xdcc** qxd;
+    xdcc* xd;
+
+    updatecontext();
+
+    while ((qxd = irlist_get_head(&gdata.hashpool.queue))) {
+        xd = *qxd;
+        irlist_delete(&gdata.hashpool.queue, qxd);
+
+        if (!digest_missing(xd) || hashpool_busy(xd)) {
+            continue;
+        }
+        if (streamhash_active(xd)) {
+            gdata.hashpool.retry = 1;
+            continue;
+        }
+
+        if (!gdata.attop) {
+            gototop();
+        }
+
+        ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L | OUT_D, COLOR_NO_COLOR,
+                "[MD5]: Calculating pack %d", xd->packnum);
+
+        job->xpack = xd;
+        job->file = mymalloc(strlen(xd->file) + 1);
+        strcpy(job->file, xd->file);
+        memset(&job->digest, 0, sizeof(digest_t));
+        digest_init(&job->hash, digest_wanted());
+        digest_prealloc(&job->hash, xd->st_size);
+        digest_set_verify(&job->hash, &xd->pieces, xd->st_size);
+
+        pthread_mutex_lock(&gdata.hashpool.lock);
+        job->cancel = 0;
+        job->error = 0;
+        job->bytes = 0;
+        job->state = HASHWORKER_ASSIGNED;
+        pthread_cond_broadcast(&gdata.hashpool.cond);
+        pthread_mutex_unlock(&gdata.hashpool.lock);
+        return;
+    }
+}
+#endif
+
+/* a pack was added or lost its md5sum, queue again on the next tick */
+void hashpool_dirty(void) {
+#ifdef HAVE_PTHREAD
+    gdata.hashpool.refill = 1;
+#endif
+}
+
+static void streamhash_drop(xdcc* xpack) {
+    digest_free(xpack->streamhash);
+    mydelete(xpack->streamhash);
+    xpack->streamhash_done = 0;
+}
+
+void md5build_cancel(xdcc* xpack, const char* why) {
+#ifdef HAVE_PTHREAD
+    xdcc** qxd;
+    int i, j;
+#endif
+
+    updatecontext();
+
+    if (xpack->streamhash) {
+        streamhash_drop(xpack);
+    }
+
+    if (gdata.md5build.xpack == xpack) {
+        outerror(OUTERROR_TYPE_WARN, "[MD5]: Canceled (%s)", why);
+
+        FD_CLR(gdata.md5build.file_fd, &gdata.readset);
+        close(gdata.md5build.file_fd);
+        gdata.md5build.file_fd = FD_UNUSED;
+        gdata.md5build.xpack = NULL;
+        digest_free(&gdata.md5build.digest);
+    }
+
+#ifdef HAVE_PTHREAD
+    qxd = irlist_get_head(&gdata.hashpool.queue);
+    while (qxd) {
+        if (*qxd == xpack) {
+            qxd = irlist_delete(&gdata.hashpool.queue, qxd);
+        } else {
+            qxd = irlist_get_next(qxd);
+        }
+    }
+
+    for (i = 0; i < gdata.hashpool.count; i++) {
+        for (j = 0; j < gdata.hashpool.workers[i].lanes; j++) {
+            hashjob_t* job = &gdata.hashpool.workers[i].job[j];
+            if (job->xpack == xpack) {
+                outerror(OUTERROR_TYPE_WARN, "[MD5]: Canceled (%s)", why);
+                pthread_mutex_lock(&gdata.hashpool.lock);
+                job->cancel = 1;
+                pthread_mutex_unlock(&gdata.hashpool.lock);
+                job->xpack = NULL;
+            }
+        }
+    }
+#endif
+}
+
+void hashpool_tick(int changesec, int changemin) {
+#ifdef HAVE_PTHREAD
+    hashworker_t* w;
+    int i, j;
+
+    updatecontext();
+
+    if (gdata.hashpool.count &&
+        ((gdata.hashpool.count != gdata.hashthreads) ||
+         (gdata.hashpool.workers[0].lanes !=
+          (gdata.hashlanes ? gdata.hashlanes : md5mb_maxlanes())) ||
+         gdata.nomd5sum)) {
+        /* changed on rehash, unfinished packs are queued again */
+        hashpool_stop();
+    }
+
+    if (!gdata.hashthreads || gdata.nomd5sum) {
+        return;
+    }
+
+    if (!gdata.hashpool.count) {
+        hashpool_start();
+        if (!gdata.hashpool.count) {
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&gdata.hashpool.lock);
+    gdata.hashpool.budget = gdata.hashmaxspeed;
+    pthread_mutex_unlock(&gdata.hashpool.lock);
+
+    /*
+     * a job that is not ASSIGNED belongs to the main thread, so the lock is
+     * only held to read and set the state: workers take it after every
+     * read and must not wait for logging or the heap
+     */
+    for (i = 0; i < gdata.hashpool.count; i++) {
+        w = &gdata.hashpool.workers[i];
+        for (j = 0; j < w->lanes; j++) {
+            if (hashpool_state(&w->job[j]) == HASHWORKER_DONE) {
+                hashpool_done(&w->job[j]);
+            }
+        }
+    }
+
+    /*
+     * packs that failed or were skipped are tried again once a minute, cold
+     * packs when the hashcoldtime window opens or closes
+     */
+    if (changemin && (gdata.hashpool.retry ||
+                      (hashdemand_offpeak() != gdata.hashpool.offpeak))) {
+        gdata.hashpool.retry = 0;
+        gdata.hashpool.refill = 1;
+    }
+
+    /* the pack list is only scanned again when it may have changed */
+    if (changesec && gdata.hashpool.refill) {
+        hashpool_fill();
+    } else if (changemin) {
+        hashpool_sort();
+    }
+
+    for (i = 0; i < gdata.hashpool.count; i++) {
+        w = &gdata.hashpool.workers[i];
+        for (j = 0; j < w->lanes; j++) {
+            if (hashpool_state(&w->job[j]) == HASHWORKER_IDLE) {
+                hashpool_assign(&w->job[j]);
+            }
+        }
+    }
+#endif
+}
+
+/*
+ * Stream hashing
+ *
+ * A transfer that starts at byte 0 on a path that has the data in memory
+ * (read/write, block cache, mmap) feeds what it sends into a context kept
+ * with the pack.  Whichever transfer is at the hashed frontier moves it on,
+ * so a pack that is downloaded in full gets its digests without a read of
+ * its own.  The readers leave such packs alone while the stream moves.
+ */
+
+static int streamhash_busy(const xdcc* xpack) {
+    if (gdata.md5build.xpack == xpack) {
+        return 1;
+    }
+#ifdef HAVE_PTHREAD
+    if (hashpool_busy(xpack)) {
+        return 1;
+    }
+#endif
+    return 0;
+}
+
+/* non-zero if the pack is being hashed from a transfer, drops stalled ones */
+int streamhash_active(xdcc* xpack) {
+    if (xpack->streamhash &&
+        ((gdata.curtime - xpack->streamhash_time) > STREAMHASH_TIMEOUT)) {
+        if (gdata.debug > 0) {
+            ioutput(CALLTYPE_NORMAL, OUT_S, COLOR_YELLOW,
+                    "[MD5]: Stream of pack %d stalled at %" PRId64 "d",
+                    xpack->packnum, (int64_t)xpack->streamhash_done);
+        }
+        streamhash_drop(xpack);
+    }
+
+    return xpack->streamhash != NULL;
+}
+
+/* len bytes at offset of the pack were just sent from data */
+void streamhash_feed(xdcc* xpack, off_t offset, const unsigned char* data,
+                     size_t len) {
+    digest_t digest;
+    char* tempstr;
+    size_t skip;
+
+    if (!xpack->streamhash) {
+        if (offset || !len || gdata.nomd5sum || !digest_incomplete(xpack) ||
+            streamhash_busy(xpack)) {
+            return;
+        }
+        xpack->streamhash = mycalloc(sizeof(digest_ctx));
+        digest_init(xpack->streamhash, digest_wanted());
+        xpack->streamhash_done = 0;
+    }
+
+    if ((offset > xpack->streamhash_done) ||
+        ((offset + (off_t)len) <= xpack->streamhash_done)) {
+        return;
+    }
+
+    skip = xpack->streamhash_done - offset;
+    digest_update(xpack->streamhash, data + skip, len - skip);
+    xpack->streamhash_done += len - skip;
+    xpack->streamhash_time = gdata.curtime;
+
+    if (xpack->streamhash_done < xpack->st_size) {
+        return;
+    }
+
+    updatecontext();
+
+    digest_final(xpack->streamhash, &digest);
+    streamhash_drop(xpack);
+
+    if (xpack->has_md5sum &&
+        memcmp(xpack->md5sum, digest.md5sum, sizeof(MD5Digest))) {
+        outerror(OUTERROR_TYPE_WARN,
+                 "[MD5]: Pack %d sent with a different md5sum, not used",
+                 xpack->packnum);
+        mydelete(digest.pieces.piece);
+        return;
+    }
+
+    digest_to_xdcc(&digest, xpack);
+    xdcc_dup_link(xpack);
+
+    if (!gdata.attop) {
+        gototop();
+    }
+
+    tempstr = mycalloc(maxtextlength);
+    digest_print(tempstr, maxtextlength, &digest);
+    ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L | OUT_D, COLOR_NO_COLOR,
+            "[MD5]: Pack %d %s (from transfer)", xpack->packnum,
+            tempstr);
+    mydelete(tempstr);
+}
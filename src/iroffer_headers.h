@@ -45,6 +45,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <sys/time.h>
 #include <sys/times.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/utsname.h>
 #include <sys/wait.h>
 #include <termios.h>
@@ -83,19 +84,92 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <sys/statvfs.h>
 #endif
 
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#ifdef HAVE_INOTIFY
+#include <sys/inotify.h>
+#endif
+
 #include "iroffer_md5.h"
 
 /*------------ structures ------------- */
 
+typedef uint8_t SHA256Digest[32];
+
+typedef struct {
+    uint32_t state[8];
+    uint64_t len;
+    unsigned char buffer[64];
+} sha256_ctx;
+
+typedef struct {
+    uint32_t a, b, c, d;
+    uint64_t len;
+} md5mb_t;
+
+typedef struct {
+    uint32_t crc32;     /* of the piece alone */
+    uint32_t crc32_run; /* of the file up to the end of the piece */
+} piece_t;
+
+/*
+ * crc32 of the whole PIECE_SIZE pieces of a file, and the state of its
+ * digests at the last whole 64 byte block, so appended data can be
+ * hashed on from there.  flags: digests with a state, 0 for no table
+ */
+typedef struct {
+    int flags;
+    int count;
+    int alloc;
+    piece_t* piece;
+    off_t size;           /* of the file, the state is at size & ~63 */
+    uint32_t md5[4];
+    uint32_t sha256[8];
+    uint32_t crc32;       /* of the file up to the state */
+    uint32_t piece_crc32; /* of the last piece up to the state */
+} piecetable_t;
+
+/* the digests of a pack, flags tells which are set */
+typedef struct {
+    int flags;
+    MD5Digest md5sum;
+    uint32_t crc32;
+    SHA256Digest sha256;
+    piecetable_t pieces;
+} digest_t;
+
+/* md5sum, crc32 and sha256 of one pass over the data */
+typedef struct {
+    int flags;
+    off_t pos; /* where the pass wants the next data */
+    md5mb_t md5;
+    unsigned char md5buf[64]; /* pos % 64 bytes waiting for a whole block */
+    uint32_t crc32;
+    sha256_ctx sha256;
+    uint32_t piece_crc32;
+    uint32_t block_crc32; /* crc32 and piece_crc32 at pos & ~63 */
+    uint32_t block_piece_crc32;
+    piecetable_t pieces; /* built as the data goes */
+    piecetable_t verify; /* old table while its pieces are spot checked */
+    int spot[3];         /* pieces left to check, the next one last */
+    int spots;
+    int prealloc; /* pieces must not grow */
+} digest_ctx;
+
 typedef struct irlist_item_t2 {
     struct irlist_item_t2* next;
     struct irlist_item_t2* prev;
+    int slab; /* size class + 1 when from a slab, 0 when malloced */
 } irlist_item_t;
 
 typedef struct {
     int size;
     irlist_item_t* head;
     irlist_item_t* tail;
+    irlist_item_t* nth_item; /* last found by irlist_get_nth() */
+    int nth;
 } irlist_t;
 
 typedef struct {
@@ -114,6 +188,38 @@ typedef struct {
     unsigned int count_dropped;
 } ir_boutput_t;
 
+typedef struct {
+    int size;
+    int used;
+    char buffer[];
+} ir_arena_chunk_t;
+
+/* allocations that are all freed at once by ir_arena_reset() */
+typedef struct {
+    irlist_t chunks;
+    int size; /* of all chunks */
+} ir_arena_t;
+
+typedef struct {
+    const char* ptr;
+    int len;
+} ir_slice_t;
+
+/* a server line split by ir_line_parse() */
+typedef struct {
+    char* line;        /* as received */
+    int count;         /* words */
+    ir_slice_t* word;  /* word[i] is getpart(line, i + 1), in line */
+    char* split;       /* copy of line with a '\0' after every word */
+    char* folded;      /* the same, folded to upper case like caps() */
+    ir_slice_t prefix; /* without the ':' */
+    ir_slice_t nick;
+    ir_slice_t host;      /* ptr is NULL unless the prefix has a '!' */
+    int command;          /* word index, -1 if none */
+    int params;           /* word index of the first parameter */
+    const char* trailing; /* in line after the " :", NULL if none */
+} ir_line_t;
+
 #ifdef HAVE_MMAP
 typedef struct {
     off_t mmap_offset; /* leave first */
@@ -123,7 +229,14 @@ typedef struct {
 } mmap_info_t;
 #endif
 
-typedef struct {
+typedef enum {
+    XDL_STYLE_IRC,  /* the line and the note line, each 0 terminated */
+    XDL_STYLE_FILE, /* the lines as written to the xdcclistfile */
+    XDL_STYLE_JSON, /* the pack object of the xdcclistjson */
+    NUMBER_XDL_STYLES
+} xdl_style_e;
+
+typedef struct xdcc_t2 {
     char *file, *desc, *note;
     int gets;
     float minspeed, maxspeed;
@@ -133,14 +246,90 @@ typedef struct {
     time_t mtime;
     int has_md5sum;
     MD5Digest md5sum;
+    int has_crc32;
+    uint32_t crc32;
+    int has_sha256;
+    SHA256Digest sha256;
+    piecetable_t pieces; /* kept over a change, the next pass checks it */
+    digest_ctx* streamhash; /* fed by transfers, see streamhash_feed() */
+    off_t streamhash_done;
+    time_t streamhash_time;
+    int requests; /* recent XDCC SEND/INFO, halved every hour */
+    time_t requests_time;
+    time_t hash_retry; /* not hashed before this, its last pass failed */
     int file_fd;
     int file_fd_count;
     off_t file_fd_location;
+    unsigned long long file_fd_lastused;
+    struct xdcc_t2** fdcache_idle; /* its entry in gdata.fdcache_lru */
 #ifdef HAVE_MMAP
     irlist_t mmaps;
 #endif
+    struct xdcc_t2* dupof;     /* same content, use its fd/mmaps/cache */
+    struct xdcc_t2* dup_next;  /* next member of the group */
+    struct xdcc_t2* dup_hnext; /* chain in gdata.duphash */
+    unsigned int dup_key;      /* hash of size and md5sum when linked */
+    int dup_hashed;            /* heads a group, in gdata.duphash */
+    int packnum;               /* its number, kept by xdcc_add/remove/move */
+    int indexed;               /* in the file and inode hashes */
+    struct xdcc_t2* file_next;
+    struct xdcc_t2* inode_next;
+    char* xdl[NUMBER_XDL_STYLES]; /* rendered list lines, see xdcc_dirty() */
+    int xdl_packnum;
+    int xdl_width;
 } xdcc;
 
+typedef enum {
+    BLOCKCACHE_T1,
+    BLOCKCACHE_T2,
+    BLOCKCACHE_B1,
+    BLOCKCACHE_B2
+} blockcache_list_e;
+
+typedef struct blockcache_entry_t2 {
+    struct blockcache_entry_t2* hash_next;
+    const xdcc* xpack;
+    off_t block;
+    unsigned char* data; /* NULL while on b1/b2 */
+    size_t len;
+    blockcache_list_e list;
+} blockcache_entry_t;
+
+#ifdef HAVE_PTHREAD
+typedef enum {
+    HASHWORKER_IDLE,
+    HASHWORKER_ASSIGNED,
+    HASHWORKER_DONE
+} hashworker_state_e;
+
+typedef struct {
+    /* protected by gdata.hashpool.lock */
+    hashworker_state_e state;
+    int cancel;
+    int error;
+    off_t bytes;
+    /* only touched by the main thread while not ASSIGNED */
+    xdcc* xpack;
+    char* file;
+    digest_ctx hash; /* set up by the main thread, workers do not allocate */
+    digest_t digest;
+} hashjob_t;
+
+typedef struct {
+    pthread_t thread;
+    int lanes;
+    hashjob_t job[MD5MB_MAXLANES];
+    unsigned char* buffer;
+} hashworker_t;
+#endif
+
+typedef struct {
+    int wd; /* -1 while not watched */
+    char* path; /* with the trailing slash, empty for the current dir */
+    int watchdir; /* a configured watchdir */
+    int scan; /* watchdir to be scanned after the sync */
+} filewatch_dir_t;
+
 typedef struct {
     xdcc* xpack;
     char* nick;
@@ -203,6 +392,7 @@ typedef struct {
     unsigned long localip;
     float lastspeed;
     xdcc* xpack;
+    xdcc* iopack; /* pack whose fd/mmaps are read, see xdcc_dup_link() */
     struct sockaddr_in serveraddress;
     char* nick;
     char* caps_nick;
@@ -223,7 +413,7 @@ typedef enum {
     UPLOAD_STATUS_DONE
 } upload_status_e;
 
-typedef struct {
+typedef struct upload_t2 {
     int clientsocket;
     int filedescriptor;
     off_t bytesgot;
@@ -242,6 +432,28 @@ typedef struct {
     char* file;
     upload_status_e ul_status;
     int resumed;
+    unsigned char* buffer;  /* UPLOAD_BUFFERSIZE, handed on when full */
+    unsigned char* wbuffer; /* the previous one, being written out */
+    size_t buffer_len;
+    off_t flushed;   /* written to the file */
+    off_t writeback; /* spliced data queued for writeback */
+    off_t synced;    /* written back to disk, only the writer moves it */
+    size_t wlen;     /* of wbuffer, not 0 while the writer has it */
+    off_t lastack;
+    time_t lastacktime;
+    unsigned char ack[4]; /* ack being sent, its last ack_len bytes unsent */
+    size_t ack_len;
+    off_t ack_pos;
+    int splice_pipe[2]; /* socket -> pipe -> file, bypasses buffer */
+    int hash_pipe[2];   /* tee() of splice_pipe, read for hashing */
+    digest_ctx hash;    /* covers the first md5_done bytes, -1 if off */
+    off_t md5_done;
+    digest_t digest;
+    int completed; /* all in the file, digests final, autoadd done */
+    /* protected by gdata.upwriter.lock */
+    int wdone;
+    int werrno;
+    struct upload_t2* wnext;
 } upload;
 
 typedef enum {
@@ -309,10 +521,45 @@ typedef struct {
     char *snick, *cmd;
     char *arg1, *arg2, *arg3;
     char *arg1e, *arg2e;
-    int fd;
+    ir_boutput_t* bout; /* method_fd */
     dccchat_t* chat;
 } userinput;
 
+/* the packs with one case folded trigram in their file, desc or note */
+typedef struct search_trigram_t2 {
+    struct search_trigram_t2* next;
+    unsigned int trigram;
+    xdcc** packs; /* sorted by address */
+    int count;
+    int alloc;
+} search_trigram_t;
+
+typedef struct {
+    char* name;
+    struct stat st;
+    int error; /* errno of stat() or access(), 0 when it is readable */
+} dirscan_entry_t;
+
+/* an ADDDIR or ADDNEW whose files are stat()ed off the main loop */
+typedef struct {
+    userinput u; /* who to answer, snick is a copy */
+    time_t chattime; /* connecttime of u.chat */
+    int addnew;
+    char* dir;
+    DIR* d;
+    dirscan_entry_t* entries;
+    int count;
+#ifdef HAVE_PTHREAD
+    pthread_t* threads;
+    int nthreads;
+    pthread_mutex_t lock;
+    /* protected by lock */
+    int next;
+    int running;
+    int exiting;
+#endif
+} dirscan_t;
+
 typedef struct {
     void* ptr;
     const char* src_func;
@@ -322,6 +569,23 @@ typedef struct {
     int size;
 } meminfo_t;
 
+/* what is allocated from one mymalloc() call site */
+typedef struct {
+    const char* src_func;
+    const char* src_file;
+    int src_line;
+    int count; /* live allocations */
+    long size; /* live bytes */
+    unsigned long total; /* allocations ever */
+} memsite_t;
+
+/* in front of every mymalloc() allocation */
+typedef struct {
+    memsite_t* site;
+    int size;
+    unsigned int magic;
+} memhdr_t;
+
 typedef struct {
     char p_mode;
     char p_symbol;
@@ -405,9 +669,13 @@ void tostdout_disable_buffering(void);
 
 /* utilities.c */
 const char* strstrnocase(const char* str1, const char* match1);
-#define getpart(x, y) getpart2(x, y, __FUNCTION__, __FILE__, __LINE__)
-char* getpart2(const char* line, int howmany, const char* src_function,
-               const char* src_file, int src_line);
+#define getpart(x, y)                                                          \
+    getpart2(x, y, MEMSITE_CACHE, __FUNCTION__, __FILE__, __LINE__)
+char* getpart2(const char* line, int howmany, memsite_t** site,
+               const char* src_function, const char* src_file, int src_line);
+void* ir_arena_alloc(ir_arena_t* arena, int len);
+char* ir_arena_getpart(ir_arena_t* arena, const char* line, int howmany);
+void ir_arena_reset(ir_arena_t* arena);
 char* caps(char* text);
 char* sizestr(int spaces, off_t num);
 void getos(void);
@@ -517,8 +785,8 @@ void set_loginname(void);
 int is_fd_readable(int fd);
 char* convert_to_unix_slash(char* ss);
 
-void* mymalloc2(int a, int zero, const char* src_function, const char* src_file,
-                int src_line);
+void* mymalloc2(int a, int zero, memsite_t** site, const char* src_function,
+                const char* src_file, int src_line);
 void mydelete2(void* t);
 
 #ifdef NO_SNPRINTF
@@ -540,9 +808,11 @@ const char* strsignal(int sig);
 #endif
 
 /* permanently add/delete items (includes malloc/free) */
-#define irlist_add(x, y) irlist_add2(x, y, __FUNCTION__, __FILE__, __LINE__)
-void* irlist_add2(irlist_t* list, unsigned int size, const char* src_function,
-                  const char* src_file, int src_line);
+#define irlist_add(x, y)                                                       \
+    irlist_add2(x, y, MEMSITE_CACHE, __FUNCTION__, __FILE__, __LINE__)
+void* irlist_add2(irlist_t* list, unsigned int size, memsite_t** site,
+                  const char* src_function, const char* src_file,
+                  int src_line);
 void* irlist_delete(irlist_t* list, void* item);
 void irlist_delete_all(irlist_t* list);
 
@@ -622,12 +892,25 @@ void notifyqueued(void);
 void notifybandwidth(void);
 void notifybandwidthtrans(void);
 void look_for_file_changes(xdcc* xpack);
+xdcc* xdcc_add(void);
+void xdcc_remove(xdcc* xpack);
+void xdcc_move(xdcc* xpack, int packnum);
+xdcc* xdcc_get(int packnum);
+void xdcc_dirty(xdcc* xpack);
+void xdcc_index(xdcc* xpack);
+void xdcc_unindex(xdcc* xpack);
+xdcc* xdcc_find_file(const char* file, const xdcc* after);
+xdcc* xdcc_find_inode(dev_t dev, ino_t ino, const xdcc* after);
+void xdcc_dup_link(xdcc* xpack);
+void xdcc_dup_unlink(xdcc* xpack, int removed);
 void user_changed_nick(const char* oldnick, const char* newnick);
 void reverify_restrictsend(void);
 
 /* statefile.c */
 void write_statefile(void);
 void read_statefile(void);
+void statefile_hold(void);
+void statefile_release(void);
 
 /* dccchat.c */
 int setupdccchatout(const char* nick);
@@ -672,6 +955,82 @@ void t_closeconn(transfer* t, const char* msg, int errno1);
 void t_setresume(transfer* t, const char* amt);
 void t_remind(transfer* t);
 void t_checkminspeed(transfer* t);
+int fdcache_open(xdcc* xpack);
+void fdcache_use(xdcc* xpack);
+void fdcache_update(xdcc* xpack);
+void fdcache_release(xdcc* xpack);
+void fdcache_drop(xdcc* xpack);
+void fdcache_trim(void);
+void fdcache_flush(void);
+
+/* search.c */
+void search_index(xdcc* xpack);
+void search_unindex(xdcc* xpack);
+int search_find(const char* query, xdcc*** found);
+
+/* dirscan.c */
+void dirscan_start(const userinput* u, const char* dir, DIR* d, int addnew);
+void dirscan_tick(void);
+void dirscan_stop(void);
+
+/* filewatch.c */
+void filewatch_tick(void);
+#ifdef HAVE_INOTIFY
+void filewatch_read(void);
+void filewatch_stop(void);
+#endif
+
+/* blockcache.c */
+ssize_t blockcache_read(xdcc* xpack, off_t offset, size_t len,
+                        unsigned char** dataptr);
+void blockcache_drop(const xdcc* xpack);
+void blockcache_trim(void);
+
+/* md5mb.c */
+int md5mb_maxlanes(void);
+void md5mb_init(md5mb_t* ctx);
+void md5mb_blocks(md5mb_t* const ctx[], const unsigned char* const data[],
+                  int n, size_t nblocks);
+void md5mb_final(md5mb_t* ctx, const unsigned char* tail, size_t len,
+                 MD5Digest md5sum);
+
+/* digest.c */
+void crc32_init(void);
+uint32_t crc32_update(uint32_t crc, const unsigned char* data, size_t len);
+void sha256_init(sha256_ctx* ctx);
+void sha256_update(sha256_ctx* ctx, const unsigned char* data, size_t len);
+void sha256_final(sha256_ctx* ctx, SHA256Digest digest);
+int digest_wanted(void);
+int digest_missing(const xdcc* xd);
+int digest_incomplete(const xdcc* xd);
+void digest_init(digest_ctx* ctx, int flags);
+void digest_free(digest_ctx* ctx);
+void piecetable_copy(piecetable_t* to, const piecetable_t* from);
+void digest_prealloc(digest_ctx* ctx, off_t size);
+void digest_set_verify(digest_ctx* ctx, const piecetable_t* old, off_t size);
+void digest_update_nomd5(digest_ctx* ctx, const unsigned char* data,
+                         size_t len);
+int digest_update(digest_ctx* ctx, const unsigned char* data, size_t len);
+int digest_eof(digest_ctx* ctx);
+void digest_final(digest_ctx* ctx, digest_t* d);
+void digest_from_xdcc(digest_t* d, const xdcc* xd);
+void digest_to_xdcc(digest_t* d, xdcc* xd);
+void xdcc_clear_digest(xdcc* xd);
+void sha256_print(char* str, const SHA256Digest digest);
+void digest_print(char* str, size_t len, const digest_t* d);
+
+/* hashpool.c */
+void hashpool_dirty(void);
+void md5build_cancel(xdcc* xpack, const char* why);
+void hashpool_tick(int changesec, int changemin);
+#ifdef HAVE_PTHREAD
+void hashpool_stop(void);
+#endif
+void hashpool_request(xdcc* xpack);
+xdcc* md5build_next(int* packnum);
+int streamhash_active(xdcc* xpack);
+void streamhash_feed(xdcc* xpack, off_t offset, const unsigned char* data,
+                     size_t len);
 
 /* upload.c */
 void l_initvalues(upload* l);
@@ -679,6 +1038,14 @@ void l_establishcon(upload* l);
 void l_transfersome(upload* l);
 void l_istimeout(upload* l);
 void l_closeconn(upload* l, const char* msg, int errno1);
+int l_flush(upload* l);
+void l_writesome(upload* l);
+int l_md5behind(upload* l);
+void l_md5prefix(upload* l);
+void l_writer_start(void);
+void l_writer_stop(void);
+long l_recvbudget(void);
+int l_sendack(upload* l);
 
 /* admin.c */
 void u_fillwith_console(userinput* u, char* line);
@@ -687,5 +1054,7 @@ void u_fillwith_msg(userinput* u, const char* n, const char* line);
 void u_fillwith_clean(userinput* u);
 
 void u_parseit(userinput* u);
+void u_dirscan_done(dirscan_t* ds);
+void u_xdl_json(ir_boutput_t* bout);
 
 #endif // IROFFER_HEADERS_H
@@ -188,7 +188,7 @@ static void mainloop(void) {
     static unsigned long long last250ms;
     static uint64_t xdccsent;
 
-    int overlimit;
+    int overlimit, uploadoverlimit;
     int highests;
     upload* ul;
     transfer* tr;
@@ -265,6 +265,8 @@ static void mainloop(void) {
         overlimit = 0;
     }
 
+    uploadoverlimit = (l_recvbudget() == 0);
+
 
     tr = irlist_get_head(&gdata.trans);
     while (tr) {
@@ -296,19 +298,47 @@ static void mainloop(void) {
             FD_SET(ul->clientsocket, &gdata.writeset);
             highests = max2(highests, ul->clientsocket);
         }
-        if (ul->ul_status == UPLOAD_STATUS_GETTING) {
+        if ((ul->ul_status == UPLOAD_STATUS_GETTING) && !uploadoverlimit &&
+            (ul->buffer_len < UPLOAD_BUFFERSIZE)) {
             FD_SET(ul->clientsocket, &gdata.readset);
             highests = max2(highests, ul->clientsocket);
         }
+        if (((ul->ul_status == UPLOAD_STATUS_GETTING) ||
+             (ul->ul_status == UPLOAD_STATUS_WAITING)) &&
+            ul->ack_len) {
+            FD_SET(ul->clientsocket, &gdata.writeset);
+            highests = max2(highests, ul->clientsocket);
+        }
+        if (((ul->ul_status == UPLOAD_STATUS_GETTING) ||
+             (ul->ul_status == UPLOAD_STATUS_WAITING)) &&
+            l_md5behind(ul)) {
+            /* resumed prefix being hashed, the file is always readable */
+            FD_SET(ul->filedescriptor, &gdata.readset);
+            highests = max2(highests, ul->filedescriptor);
+        }
         ul = irlist_get_next(ul);
     }
 
+#ifdef HAVE_PTHREAD
+    if (gdata.upwriter.running) {
+        FD_SET(gdata.upwriter.wake[0], &gdata.readset);
+        highests = max2(highests, gdata.upwriter.wake[0]);
+    }
+#endif
+
     if (gdata.md5build.file_fd != FD_UNUSED) {
         assert(gdata.md5build.xpack);
         FD_SET(gdata.md5build.file_fd, &gdata.readset);
         highests = max2(highests, gdata.md5build.file_fd);
     }
 
+#ifdef HAVE_INOTIFY
+    if (gdata.filewatch.fd != FD_UNUSED) {
+        FD_SET(gdata.filewatch.fd, &gdata.readset);
+        highests = max2(highests, gdata.filewatch.fd);
+    }
+#endif
+
     updatecontext();
 
     timestruct.tv_sec = 0;
@@ -502,6 +532,7 @@ static void mainloop(void) {
             gdata.sentrecord = ((float)xdccsent) / XDCC_SENT_SIZE / 1024.0;
         }
         gdata.xdccsent[(gdata.curtime + 1) % XDCC_SENT_SIZE] = 0;
+        gdata.xdccrecv[(gdata.curtime + 1) % XDCC_SENT_SIZE] = 0;
     }
 
     if (changequartersec) {
@@ -561,6 +592,7 @@ static void mainloop(void) {
                     }
                     server_input_line[j] = '\0';
                     parseline(removenonprintable(server_input_line));
+                    ir_arena_reset(&gdata.parsearena);
                     j = 0;
                 } else {
                     server_input_line[j] = tempbuffa[i];
@@ -693,14 +725,43 @@ static void mainloop(void) {
 
     updatecontext();
 
+#ifdef HAVE_PTHREAD
+    /* the upload writer finished a buffer */
+    if (gdata.upwriter.running &&
+        FD_ISSET(gdata.upwriter.wake[0], &gdata.readset)) {
+        char wake[64];
+        while (read(gdata.upwriter.wake[0], wake, sizeof(wake)) > 0) {
+            /* drain */
+        }
+    }
+#endif
+
     ul = irlist_get_head(&gdata.uploads);
     while (ul) {
+        if ((ul->ul_status == UPLOAD_STATUS_GETTING) ||
+            (ul->ul_status == UPLOAD_STATUS_WAITING)) {
+            l_writesome(ul);
+        }
+
         /*----- see if uploads are sending anything to us ----- */
         if (ul->ul_status == UPLOAD_STATUS_GETTING &&
             FD_ISSET(ul->clientsocket, &gdata.readset)) {
             l_transfersome(ul);
         }
 
+        if (((ul->ul_status == UPLOAD_STATUS_GETTING) ||
+             (ul->ul_status == UPLOAD_STATUS_WAITING)) &&
+            l_md5behind(ul) && FD_ISSET(ul->filedescriptor, &gdata.readset)) {
+            l_md5prefix(ul);
+        }
+
+        /*----- rest of an ack that did not fit ----- */
+        if (((ul->ul_status == UPLOAD_STATUS_GETTING) ||
+             (ul->ul_status == UPLOAD_STATUS_WAITING)) &&
+            ul->ack_len && FD_ISSET(ul->clientsocket, &gdata.writeset)) {
+            l_sendack(ul);
+        }
+
         if (ul->ul_status == UPLOAD_STATUS_CONNECTING &&
             FD_ISSET(ul->clientsocket, &gdata.writeset)) {
             int callval_i;
@@ -728,12 +789,13 @@ static void mainloop(void) {
                 FD_CLR(ul->clientsocket, &gdata.writeset);
                 notice(ul->nick, "DCC Connection Established");
                 ul->connecttime = gdata.curtime;
-                if (set_socket_nonblocking(ul->clientsocket, 0) < 0) {
-                    outerror(OUTERROR_TYPE_WARN, "Couldn't Set Blocking");
-                }
             }
         }
 
+        if (changequartersec && ul->ul_status == UPLOAD_STATUS_GETTING) {
+            l_sendack(ul);
+        }
+
         if (changesec && ul->ul_status == UPLOAD_STATUS_CONNECTING &&
             ul->lastcontact + CTIMEOUT < gdata.curtime) {
             FD_CLR(ul->clientsocket, &gdata.readset);
@@ -748,6 +810,10 @@ static void mainloop(void) {
             mydelete(ul->nick);
             mydelete(ul->hostname);
             mydelete(ul->file);
+            mydelete(ul->buffer);
+            mydelete(ul->wbuffer);
+            digest_free(&ul->hash);
+            mydelete(ul->digest.pieces.piece);
             ul = irlist_delete(&gdata.uploads, ul);
         } else {
             ul = irlist_get_next(ul);
@@ -937,6 +1003,11 @@ static void mainloop(void) {
         }
     }
 
+    /*----- add the files of finished directory scans ----- */
+    if (changesec && irlist_size(&gdata.dirscans)) {
+        dirscan_tick();
+    }
+
     updatecontext();
     /*----- send server stuff ----- */
     if (changesec) {
@@ -1393,11 +1464,10 @@ static void mainloop(void) {
         updatecontext();
 
         /* look to see if any files changed */
-        xd = irlist_get_head(&gdata.xdccs);
-        while (xd) {
-            look_for_file_changes(xd);
-            xd = irlist_get_next(xd);
-        }
+        filewatch_tick();
+
+        /* apply a changed block cache budget */
+        blockcache_trim();
 
         updatecontext();
 
@@ -1452,6 +1522,15 @@ static void mainloop(void) {
 
     updatecontext();
 
+#ifdef HAVE_INOTIFY
+    if ((gdata.filewatch.fd != FD_UNUSED) &&
+        FD_ISSET(gdata.filewatch.fd, &gdata.readset)) {
+        filewatch_read();
+    }
+#endif
+
+    updatecontext();
+
     if ((gdata.md5build.file_fd != FD_UNUSED) &&
         FD_ISSET(gdata.md5build.file_fd, &gdata.readset)) {
         ssize_t howmuch;
@@ -1475,25 +1554,39 @@ static void mainloop(void) {
                          "[MD5]: Can't read data from file '%s': %s",
                          gdata.md5build.xpack->file, strerror(errno));
 
+                gdata.md5build.xpack->hash_retry = gdata.curtime + HASH_RETRY;
                 FD_CLR(gdata.md5build.file_fd, &gdata.readset);
                 close(gdata.md5build.file_fd);
                 gdata.md5build.file_fd = FD_UNUSED;
                 gdata.md5build.xpack = NULL;
+                digest_free(&gdata.md5build.digest);
                 break;
             } else if (howmuch < 0) {
                 break;
+            } else if ((howmuch == 0) && digest_eof(&gdata.md5build.digest)) {
+                /* ended inside a spot check, hash it all from the start */
+                lseek(gdata.md5build.file_fd, gdata.md5build.digest.pos,
+                      SEEK_SET);
+                continue;
             } else if (howmuch == 0) {
+                digest_t digest;
+                char* tempstr;
+
                 /* EOF */
-                MD5_Final(gdata.md5build.xpack->md5sum, &gdata.md5build.md5sum);
-                gdata.md5build.xpack->has_md5sum = 1;
+                digest_final(&gdata.md5build.digest, &digest);
+                digest_free(&gdata.md5build.digest);
+                digest_to_xdcc(&digest, gdata.md5build.xpack);
+                xdcc_dup_link(gdata.md5build.xpack);
 
                 if (!gdata.attop) {
                     gototop();
                 }
 
+                tempstr = mycalloc(maxtextlength);
+                digest_print(tempstr, maxtextlength, &digest);
                 ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L | OUT_D, COLOR_NO_COLOR,
-                        "[MD5]: is " MD5_PRINT_FMT,
-                        MD5_PRINT_DATA(gdata.md5build.xpack->md5sum));
+                        "[MD5]: %s", tempstr);
+                mydelete(tempstr);
 
                 FD_CLR(gdata.md5build.file_fd, &gdata.readset);
                 close(gdata.md5build.file_fd);
@@ -1502,37 +1595,49 @@ static void mainloop(void) {
                 break;
             }
             /* else got data */
-            MD5_Update(&gdata.md5build.md5sum, gdata.sendbuff, howmuch);
+            if (digest_update(&gdata.md5build.digest, gdata.sendbuff,
+                              howmuch)) {
+                /* on to the next spot checked piece or the new data */
+                lseek(gdata.md5build.file_fd, gdata.md5build.digest.pos,
+                      SEEK_SET);
+            }
         }
     }
 
-    if (!gdata.nomd5sum && changesec && (!gdata.md5build.xpack)) {
-        int packnum = 1;
-        /* see if any pack needs a md5sum calculated */
-        for (xd = irlist_get_head(&gdata.xdccs); xd;
-             xd = irlist_get_next(xd), packnum++) {
-            if (!xd->has_md5sum) {
-                if (!gdata.attop) {
-                    gototop();
-                }
-                ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L | OUT_D, COLOR_NO_COLOR,
-                        "[MD5]: Calculating pack %d", packnum);
-
-                gdata.md5build.file_fd = open(xd->file, O_RDONLY);
-                if (gdata.md5build.file_fd >= 0) {
-                    gdata.md5build.xpack = xd;
-                    MD5_Init(&gdata.md5build.md5sum);
-                    if (set_socket_nonblocking(gdata.md5build.file_fd, 1) < 0) {
-                        outerror(OUTERROR_TYPE_WARN,
-                                 "[MD5]: Couldn't Set Non-Blocking");
-                    }
-                    break;
-                } else {
+#ifdef HAVE_PTHREAD
+    if (gdata.hashthreads || gdata.hashpool.count) {
+        hashpool_tick(changesec, changemin);
+    } else
+#endif
+        if (!gdata.nomd5sum && changesec && (!gdata.md5build.xpack)) {
+        int packnum;
+        /* see if any pack needs a md5sum calculated, most demanded first */
+        if ((xd = md5build_next(&packnum))) {
+            if (!gdata.attop) {
+                gototop();
+            }
+            ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L | OUT_D, COLOR_NO_COLOR,
+                    "[MD5]: Calculating pack %d", packnum);
+
+            gdata.md5build.file_fd = open(xd->file, O_RDONLY);
+            if (gdata.md5build.file_fd >= 0) {
+                gdata.md5build.xpack = xd;
+                digest_init(&gdata.md5build.digest, digest_wanted());
+                digest_set_verify(&gdata.md5build.digest, &xd->pieces,
+                                  xd->st_size);
+                lseek(gdata.md5build.file_fd, gdata.md5build.digest.pos,
+                      SEEK_SET);
+                if (set_socket_nonblocking(gdata.md5build.file_fd, 1) < 0) {
                     outerror(OUTERROR_TYPE_WARN,
-                             "[MD5]: Cant Access Offered File '%s': %s",
-                             xd->file, strerror(errno));
-                    gdata.md5build.file_fd = FD_UNUSED;
+                             "[MD5]: Couldn't Set Non-Blocking");
                 }
+            } else {
+                outerror(OUTERROR_TYPE_WARN,
+                         "[MD5]: Cant Access Offered File '%s': %s", xd->file,
+                         strerror(errno));
+                /* let the next pack have its turn */
+                xd->hash_retry = gdata.curtime + HASH_RETRY;
+                gdata.md5build.file_fd = FD_UNUSED;
             }
         }
     }
@@ -1604,8 +1709,9 @@ static void mainloop(void) {
 }
 
 static void parseline(char* line) {
+    ir_line_t* l;
     char *part2, *part3, *part4, *part5;
-    char* part3a;
+    char *part3a, *cpart3a;
     char* t;
     int i;
     char* tptr;
@@ -1620,25 +1726,28 @@ static void parseline(char* line) {
         ioutput(CALLTYPE_NORMAL, OUT_S, COLOR_CYAN, ">IRC>: %s", line);
     }
 
-    part2 = getpart(line, 2);
+    l = ir_line_parse(&gdata.parsearena, line);
+
+    /* commands are compared in upper case, part3 to part5 as sent */
+    part2 = ir_line_caps(l, 2);
     if (part2 == NULL) {
         return;
     }
-    part3 = getpart(line, 3);
-    part4 = getpart(line, 4);
-    part5 = getpart(line, 5);
-
+    part3 = ir_line_word(l, 3);
+    part4 = ir_line_word(l, 4);
+    part5 = ir_line_word(l, 5);
 
+    part3a = part3;
+    cpart3a = ir_line_caps(l, 3);
     if (part3 && part3[0] == ':') {
-        part3a = part3 + 1;
-    } else {
-        part3a = part3;
+        part3a++;
+        cpart3a++;
     }
 
     /* NOTICE nick */
-    if (part3 && gdata.caps_nick && !strcmp(caps(part2), "NOTICE") &&
-        !strcmp(caps(part3), gdata.caps_nick)) {
-        privmsgparse("NOTICE", line);
+    if (part3 && gdata.caps_nick && !strcmp(part2, "NOTICE") &&
+        !strcmp(ir_line_caps(l, 3), gdata.caps_nick)) {
+        privmsgparse("NOTICE", l);
     }
 
     /* :server 001  xxxx :welcome.... */
@@ -1648,7 +1757,9 @@ static void parseline(char* line) {
 
         /* update server name */
         mydelete(gdata.curserveractualname);
-        gdata.curserveractualname = getpart(line + 1, 1);
+        gdata.curserveractualname = mymalloc(l->prefix.len + 1);
+        memcpy(gdata.curserveractualname, l->prefix.ptr, l->prefix.len);
+        gdata.curserveractualname[l->prefix.len] = '\0';
 
         /* update nick */
         mydelete(gdata.user_nick);
@@ -1684,9 +1795,8 @@ static void parseline(char* line) {
         int ii = 4;
         char* item;
 
-        while ((item = getpart(line, ii++))) {
+        while ((item = ir_line_word(l, ii++))) {
             if (item[0] == ':') {
-                mydelete(item);
                 break;
             }
 
@@ -1730,8 +1840,6 @@ static void parseline(char* line) {
                     }
                 }
             }
-
-            mydelete(item);
         }
     }
 
@@ -1749,7 +1857,7 @@ static void parseline(char* line) {
     /* names list for a channel */
     /* :server 353 our_nick = #channel :nick @nick +nick nick */
     if (!strcmp(part2, "353") && part3 && part4 && part5) {
-        caps(part5);
+        part5 = ir_line_caps(l, 5);
 
         ch = irlist_get_head(&gdata.channels);
         while (ch) {
@@ -1764,9 +1872,8 @@ static void parseline(char* line) {
                     "Got name data for %s which is not a known channel!",
                     part5);
         } else {
-            for (i = 0; (t = getpart(line, 6 + i)); i++) {
+            for (i = 0; (t = ir_line_word(l, 6 + i)); i++) {
                 addtomemberlist(ch, i == 0 ? t + 1 : t);
-                mydelete(t);
             }
         }
     }
@@ -1804,25 +1911,18 @@ static void parseline(char* line) {
     /* JOIN */
     if (!strcmp(part2, "JOIN") && part3a && gdata.caps_nick) {
         char* nick;
-        int j;
-        nick = mycalloc(strlen(line) + 1);
-        j = 1;
+        nick = caps(ir_slice_dup(&gdata.parsearena, l->nick));
         gdata.nocon = 0;
-        while (line[j] != '!' && j < sstrlen(line)) {
-            nick[j - 1] = line[j];
-            j++;
-        }
-        nick[j - 1] = '\0';
-        if (!strcmp(caps(nick), gdata.caps_nick)) {
+        if (!strcmp(nick, gdata.caps_nick)) {
             /* we joined */
             /* clear now, we have successfully logged in */
             gdata.serverconnectbackoff = 0;
             ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L | OUT_D, COLOR_NO_COLOR,
-                    "Joined %s", caps(part3a));
+                    "Joined %s", cpart3a);
 
             ch = irlist_get_head(&gdata.channels);
             while (ch) {
-                if (!strcmp(part3a, ch->name)) {
+                if (!strcmp(cpart3a, ch->name)) {
                     ch->flags |= CHAN_ONCHAN;
                     break;
                 }
@@ -1831,14 +1931,13 @@ static void parseline(char* line) {
 
             if (!ch) {
                 ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L | OUT_D, COLOR_NO_COLOR,
-                        "%s is not a known channel!", part3a);
+                        "%s is not a known channel!", cpart3a);
             }
         } else {
             /* someone else joined */
-            caps(part3a);
             ch = irlist_get_head(&gdata.channels);
             while (ch) {
-                if (!strcmp(part3a, ch->name)) {
+                if (!strcmp(cpart3a, ch->name)) {
                     break;
                 }
                 ch = irlist_get_next(ch);
@@ -1846,36 +1945,26 @@ static void parseline(char* line) {
 
             if (!ch) {
                 ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L | OUT_D, COLOR_NO_COLOR,
-                        "%s is not a known channel!", part3a);
+                        "%s is not a known channel!", cpart3a);
             } else {
                 addtomemberlist(ch, nick);
             }
         }
-
-        mydelete(nick);
     }
 
     /* PART */
     if (!strcmp(part2, "PART") && part3a && gdata.caps_nick) {
         char* nick;
-        int j;
-        nick = mycalloc(strlen(line) + 1);
-        j = 1;
-        while (line[j] != '!' && j < sstrlen(line)) {
-            nick[j - 1] = line[j];
-            j++;
-        }
-        nick[j - 1] = '\0';
+        nick = caps(ir_slice_dup(&gdata.parsearena, l->nick));
 
-        if (!strcmp(caps(nick), gdata.caps_nick)) {
+        if (!strcmp(nick, gdata.caps_nick)) {
             /* we left? */
             ;
         } else {
             /* someone else left */
-            caps(part3a);
             ch = irlist_get_head(&gdata.channels);
             while (ch) {
-                if (!strcmp(part3a, ch->name)) {
+                if (!strcmp(cpart3a, ch->name)) {
                     break;
                 }
                 ch = irlist_get_next(ch);
@@ -1883,29 +1972,20 @@ static void parseline(char* line) {
 
             if (!ch) {
                 ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L | OUT_D, COLOR_NO_COLOR,
-                        "%s is not a known channel!", part3a);
+                        "%s is not a known channel!", cpart3a);
             } else {
                 removefrommemberlist(ch, nick);
             }
             reverify_restrictsend();
         }
-
-        mydelete(nick);
     }
 
     /* QUIT */
     if (!strcmp(part2, "QUIT") && gdata.caps_nick) {
         char* nick;
-        int j;
-        nick = mycalloc(strlen(line) + 1);
-        j = 1;
-        while (line[j] != '!' && j < sstrlen(line)) {
-            nick[j - 1] = line[j];
-            j++;
-        }
-        nick[j - 1] = '\0';
+        nick = caps(ir_slice_dup(&gdata.parsearena, l->nick));
 
-        if (!strcmp(caps(nick), gdata.caps_nick)) {
+        if (!strcmp(nick, gdata.caps_nick)) {
             /* we quit? */
             ;
         } else {
@@ -1917,25 +1997,16 @@ static void parseline(char* line) {
             }
             reverify_restrictsend();
         }
-
-        mydelete(nick);
     }
 
     /* NICK */
     if (!strcmp(part2, "NICK") && part3a) {
         char *oldnick, *newnick;
-        int j;
-        oldnick = mycalloc(strlen(line) + 1);
-        j = 1;
-        while (line[j] != '!' && j < sstrlen(line)) {
-            oldnick[j - 1] = line[j];
-            j++;
-        }
-        oldnick[j - 1] = '\0';
+        oldnick = caps(ir_slice_dup(&gdata.parsearena, l->nick));
 
         newnick = part3a;
 
-        if (gdata.caps_nick && !strcmp(caps(oldnick), gdata.caps_nick)) {
+        if (gdata.caps_nick && !strcmp(oldnick, gdata.caps_nick)) {
             /* nickserv */
             if (gdata.nickserv_pass) {
                 privmsg("nickserv", "IDENTIFY %s", gdata.nickserv_pass);
@@ -1960,16 +2031,14 @@ static void parseline(char* line) {
         }
 
         user_changed_nick(oldnick, newnick);
-
-        mydelete(oldnick);
     }
 
     /* KICK */
     if (!strcmp(part2, "KICK") && part3a && part4 && gdata.caps_nick) {
         ch = irlist_get_head(&gdata.channels);
         while (ch) {
-            if (!strcmp(caps(part3a), ch->name)) {
-                if (!strcmp(caps(part4), gdata.caps_nick)) {
+            if (!strcmp(cpart3a, ch->name)) {
+                if (!strcmp(ir_line_caps(l, 4), gdata.caps_nick)) {
                     /* we were kicked */
                     ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L | OUT_D,
                             COLOR_NO_COLOR, "Kicked, Rejoining: %s", line);
@@ -1977,7 +2046,7 @@ static void parseline(char* line) {
                     ch->flags &= ~CHAN_ONCHAN;
                 } else {
                     /* someone else was kicked */
-                    removefrommemberlist(ch, part4);
+                    removefrommemberlist(ch, ir_line_caps(l, 4));
                 }
             }
             ch = irlist_get_next(ch);
@@ -2010,7 +2079,7 @@ static void parseline(char* line) {
                          ii++) {
                         if (*ptr == gdata.prefixes[ii].p_mode) {
                             /* found a nick mode */
-                            char* nick = getpart(line, part++);
+                            char* nick = ir_line_word(l, part++);
                             if (nick) {
                                 if (nick[strlen(nick) - 1] ==
                                     '\1') { //? why trunc \1 from end of nick?
@@ -2019,7 +2088,6 @@ static void parseline(char* line) {
                                 changeinmemberlist_mode(
                                     ch, nick, gdata.prefixes[ii].p_symbol,
                                     plus);
-                                mydelete(nick);
                             }
                             break;
                         }
@@ -2040,17 +2108,12 @@ static void parseline(char* line) {
     /* PRIVMSG */
     if (!strcmp(part2, "PRIVMSG")) {
         if (gdata.autosend.word && part4 &&
-            !strcmp(caps(part4 + 1), caps(gdata.autosend.word))) {
-            autosendf(line);
+            !strcmp(ir_line_caps(l, 4) + 1, caps(gdata.autosend.word))) {
+            autosendf(l);
         } else {
-            privmsgparse("PRIVMSG", line);
+            privmsgparse("PRIVMSG", l);
         }
     }
-
-    mydelete(part2);
-    mydelete(part3);
-    mydelete(part4);
-    mydelete(part5);
 }
 
 
@@ -2091,7 +2154,8 @@ void sendxdccfile(const char* nick, const char* hostname, const char* hostmask,
         goto done;
     }
 
-    xd = irlist_get_nth(&gdata.xdccs, pack - 1);
+    xd = xdcc_get(pack);
+    hashpool_request(xd);
 
     tr = irlist_get_head(&gdata.trans);
     while (tr) {
@@ -2148,7 +2212,6 @@ void sendxdccfile(const char* nick, const char* hostname, const char* hostmask,
 
         look_for_file_changes(xd);
 
-        xd->file_fd_count++;
         tr = irlist_add(&gdata.trans, sizeof(transfer));
         t_initvalues(tr);
         tr->id = get_next_tr_id();
@@ -2161,6 +2224,8 @@ void sendxdccfile(const char* nick, const char* hostname, const char* hostmask,
         strcpy(tr->hostname, hostname);
 
         tr->xpack = xd;
+        tr->iopack = xd->dupof ? xd->dupof : xd;
+        fdcache_use(tr->iopack);
 
         if (!man) {
             ioutput(CALLTYPE_MULTI_MIDDLE, OUT_S | OUT_L | OUT_D, COLOR_YELLOW,
@@ -2231,7 +2296,8 @@ void sendxdccinfo(const char* nick, const char* hostname, const char* hostmask,
         goto done;
     }
 
-    xd = irlist_get_nth(&gdata.xdccs, pack - 1);
+    xd = xdcc_get(pack);
+    hashpool_request(xd);
 
     ioutput(CALLTYPE_MULTI_MIDDLE, OUT_S | OUT_L | OUT_D, COLOR_YELLOW,
             " requested: ");
@@ -2270,6 +2336,14 @@ void sendxdccinfo(const char* nick, const char* hostname, const char* hostmask,
         notice_slow(nick, " md5sum         " MD5_PRINT_FMT,
                     MD5_PRINT_DATA(xd->md5sum));
     }
+    if (xd->has_crc32) {
+        notice_slow(nick, " crc32          %08X", xd->crc32);
+    }
+    if (xd->has_sha256) {
+        char sha[(sizeof(SHA256Digest) * 2) + 1];
+        sha256_print(sha, xd->sha256);
+        notice_slow(nick, " sha256         %s", sha);
+    }
 
 done:
 
@@ -2286,7 +2360,7 @@ static char* addtoqueue(const char* nick, const char* hostname, int pack) {
 
     updatecontext();
 
-    tempx = irlist_get_nth(&gdata.xdccs, pack - 1);
+    tempx = xdcc_get(pack);
 
     alreadytrans = inq = 0;
     pq = irlist_get_head(&gdata.mainqueue);
@@ -2403,7 +2477,6 @@ void sendaqueue(int type) {
 
         look_for_file_changes(pq->xpack);
 
-        pq->xpack->file_fd_count++;
         tr = irlist_add(&gdata.trans, sizeof(transfer));
         t_initvalues(tr);
         tr->id = get_next_tr_id();
@@ -2416,6 +2489,8 @@ void sendaqueue(int type) {
         strcpy(tr->hostname, pq->hostname);
 
         tr->xpack = pq->xpack;
+        tr->iopack = tr->xpack->dupof ? tr->xpack->dupof : tr->xpack;
+        fdcache_use(tr->iopack);
 
         if (!gdata.quietmode) {
             char* sizestrstr;
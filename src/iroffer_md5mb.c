@@ -0,0 +1,333 @@
+/*
+iroffer - An IRC file server using the DCC protocol
+Copyright (C) see CONTRIBUTORS
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* include the headers */
+#include "iroffer_config.h"
+#include "iroffer_defines.h"
+#include "iroffer_headers.h"
+
+/*
+ * Multi-buffer MD5
+ *
+ * A single MD5 stream is strictly serial, but independent streams can be
+ * computed side by side, one per SIMD lane.  The same kernel is expanded
+ * for a plain 32 bit word (1 lane) and, with GCC vector extensions, for
+ * 4 (SSE2 or whatever the target has), 8 (AVX2) and 16 (AVX-512) lanes.
+ * md5mb_blocks() picks the narrowest kernel that covers the streams it is
+ * given; the wide ones are only used when the CPU supports them.
+ *
+ * Only whole 64 byte blocks go through the kernels, md5mb_final() pads the
+ * tail of a stream.
+ */
+
+#define MD5MB_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MD5MB_G(x, y, z) ((y) ^ ((z) & ((x) ^ (y))))
+#define MD5MB_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5MB_I(x, y, z) ((y) ^ ((x) | ~(z)))
+
+#define MD5MB_STEP(f, a, b, c, d, x, t, s)                                     \
+    (a) += f((b), (c), (d)) + (x) + (uint32_t)(t);                             \
+    (a) = ((a) << (s)) | ((a) >> (32 - (s)));                                  \
+    (a) += (b);
+
+/* copy one 64 byte block into 16 host order words */
+#if defined(__i386__) || defined(__x86_64__)
+#define MD5MB_LOADBLOCK(w, p) memcpy((w), (p), 64)
+#else
+#define MD5MB_LOADBLOCK(w, p)                                                  \
+    {                                                                          \
+        int k;                                                                 \
+        for (k = 0; k < 16; k++) {                                             \
+            (w)[k] = (uint32_t)(p)[k * 4] |                                    \
+                     ((uint32_t)(p)[(k * 4) + 1] << 8) |                       \
+                     ((uint32_t)(p)[(k * 4) + 2] << 16) |                      \
+                     ((uint32_t)(p)[(k * 4) + 3] << 24);                       \
+        }                                                                      \
+    }
+#endif
+
+/*
+ * kernel for W lanes of type V; words are moved between lanes and
+ * vectors through small arrays so the same code serves W == 1
+ */
+#define MD5MB_KERNEL(name, V, W, attr)                                         \
+    attr static void name(md5mb_t* const ctx[],                               \
+                          const unsigned char* const data[], size_t nblocks) { \
+        V a, b, c, d, sa, sb, sc, sd;                                          \
+        V x[16];                                                               \
+        uint32_t t[W];                                                         \
+        uint32_t m[W][16];                                                     \
+        size_t blk;                                                            \
+        int i, j;                                                              \
+                                                                               \
+        for (j = 0; j < W; j++) {                                              \
+            t[j] = ctx[j]->a;                                                  \
+        }                                                                      \
+        memcpy(&a, t, sizeof(a));                                              \
+        for (j = 0; j < W; j++) {                                              \
+            t[j] = ctx[j]->b;                                                  \
+        }                                                                      \
+        memcpy(&b, t, sizeof(b));                                              \
+        for (j = 0; j < W; j++) {                                              \
+            t[j] = ctx[j]->c;                                                  \
+        }                                                                      \
+        memcpy(&c, t, sizeof(c));                                              \
+        for (j = 0; j < W; j++) {                                              \
+            t[j] = ctx[j]->d;                                                  \
+        }                                                                      \
+        memcpy(&d, t, sizeof(d));                                              \
+                                                                               \
+        for (blk = 0; blk < nblocks; blk++) {                                  \
+            for (j = 0; j < W; j++) {                                          \
+                MD5MB_LOADBLOCK(m[j], data[j] + (blk * 64));                   \
+            }                                                                  \
+            for (i = 0; i < 16; i++) {                                         \
+                for (j = 0; j < W; j++) {                                      \
+                    t[j] = m[j][i];                                            \
+                }                                                              \
+                memcpy(&x[i], t, sizeof(x[i]));                                \
+            }                                                                  \
+                                                                               \
+            sa = a;                                                            \
+            sb = b;                                                            \
+            sc = c;                                                            \
+            sd = d;                                                            \
+                                                                               \
+            MD5MB_STEP(MD5MB_F, a, b, c, d, x[0], 0xd76aa478, 7)               \
+            MD5MB_STEP(MD5MB_F, d, a, b, c, x[1], 0xe8c7b756, 12)              \
+            MD5MB_STEP(MD5MB_F, c, d, a, b, x[2], 0x242070db, 17)              \
+            MD5MB_STEP(MD5MB_F, b, c, d, a, x[3], 0xc1bdceee, 22)              \
+            MD5MB_STEP(MD5MB_F, a, b, c, d, x[4], 0xf57c0faf, 7)               \
+            MD5MB_STEP(MD5MB_F, d, a, b, c, x[5], 0x4787c62a, 12)              \
+            MD5MB_STEP(MD5MB_F, c, d, a, b, x[6], 0xa8304613, 17)              \
+            MD5MB_STEP(MD5MB_F, b, c, d, a, x[7], 0xfd469501, 22)              \
+            MD5MB_STEP(MD5MB_F, a, b, c, d, x[8], 0x698098d8, 7)               \
+            MD5MB_STEP(MD5MB_F, d, a, b, c, x[9], 0x8b44f7af, 12)              \
+            MD5MB_STEP(MD5MB_F, c, d, a, b, x[10], 0xffff5bb1, 17)             \
+            MD5MB_STEP(MD5MB_F, b, c, d, a, x[11], 0x895cd7be, 22)             \
+            MD5MB_STEP(MD5MB_F, a, b, c, d, x[12], 0x6b901122, 7)              \
+            MD5MB_STEP(MD5MB_F, d, a, b, c, x[13], 0xfd987193, 12)             \
+            MD5MB_STEP(MD5MB_F, c, d, a, b, x[14], 0xa679438e, 17)             \
+            MD5MB_STEP(MD5MB_F, b, c, d, a, x[15], 0x49b40821, 22)             \
+                                                                               \
+            MD5MB_STEP(MD5MB_G, a, b, c, d, x[1], 0xf61e2562, 5)               \
+            MD5MB_STEP(MD5MB_G, d, a, b, c, x[6], 0xc040b340, 9)               \
+            MD5MB_STEP(MD5MB_G, c, d, a, b, x[11], 0x265e5a51, 14)             \
+            MD5MB_STEP(MD5MB_G, b, c, d, a, x[0], 0xe9b6c7aa, 20)              \
+            MD5MB_STEP(MD5MB_G, a, b, c, d, x[5], 0xd62f105d, 5)               \
+            MD5MB_STEP(MD5MB_G, d, a, b, c, x[10], 0x02441453, 9)              \
+            MD5MB_STEP(MD5MB_G, c, d, a, b, x[15], 0xd8a1e681, 14)             \
+            MD5MB_STEP(MD5MB_G, b, c, d, a, x[4], 0xe7d3fbc8, 20)              \
+            MD5MB_STEP(MD5MB_G, a, b, c, d, x[9], 0x21e1cde6, 5)               \
+            MD5MB_STEP(MD5MB_G, d, a, b, c, x[14], 0xc33707d6, 9)              \
+            MD5MB_STEP(MD5MB_G, c, d, a, b, x[3], 0xf4d50d87, 14)              \
+            MD5MB_STEP(MD5MB_G, b, c, d, a, x[8], 0x455a14ed, 20)              \
+            MD5MB_STEP(MD5MB_G, a, b, c, d, x[13], 0xa9e3e905, 5)              \
+            MD5MB_STEP(MD5MB_G, d, a, b, c, x[2], 0xfcefa3f8, 9)               \
+            MD5MB_STEP(MD5MB_G, c, d, a, b, x[7], 0x676f02d9, 14)              \
+            MD5MB_STEP(MD5MB_G, b, c, d, a, x[12], 0x8d2a4c8a, 20)             \
+                                                                               \
+            MD5MB_STEP(MD5MB_H, a, b, c, d, x[5], 0xfffa3942, 4)               \
+            MD5MB_STEP(MD5MB_H, d, a, b, c, x[8], 0x8771f681, 11)              \
+            MD5MB_STEP(MD5MB_H, c, d, a, b, x[11], 0x6d9d6122, 16)             \
+            MD5MB_STEP(MD5MB_H, b, c, d, a, x[14], 0xfde5380c, 23)             \
+            MD5MB_STEP(MD5MB_H, a, b, c, d, x[1], 0xa4beea44, 4)               \
+            MD5MB_STEP(MD5MB_H, d, a, b, c, x[4], 0x4bdecfa9, 11)              \
+            MD5MB_STEP(MD5MB_H, c, d, a, b, x[7], 0xf6bb4b60, 16)              \
+            MD5MB_STEP(MD5MB_H, b, c, d, a, x[10], 0xbebfbc70, 23)             \
+            MD5MB_STEP(MD5MB_H, a, b, c, d, x[13], 0x289b7ec6, 4)              \
+            MD5MB_STEP(MD5MB_H, d, a, b, c, x[0], 0xeaa127fa, 11)              \
+            MD5MB_STEP(MD5MB_H, c, d, a, b, x[3], 0xd4ef3085, 16)              \
+            MD5MB_STEP(MD5MB_H, b, c, d, a, x[6], 0x04881d05, 23)              \
+            MD5MB_STEP(MD5MB_H, a, b, c, d, x[9], 0xd9d4d039, 4)               \
+            MD5MB_STEP(MD5MB_H, d, a, b, c, x[12], 0xe6db99e5, 11)             \
+            MD5MB_STEP(MD5MB_H, c, d, a, b, x[15], 0x1fa27cf8, 16)             \
+            MD5MB_STEP(MD5MB_H, b, c, d, a, x[2], 0xc4ac5665, 23)              \
+                                                                               \
+            MD5MB_STEP(MD5MB_I, a, b, c, d, x[0], 0xf4292244, 6)               \
+            MD5MB_STEP(MD5MB_I, d, a, b, c, x[7], 0x432aff97, 10)              \
+            MD5MB_STEP(MD5MB_I, c, d, a, b, x[14], 0xab9423a7, 15)             \
+            MD5MB_STEP(MD5MB_I, b, c, d, a, x[5], 0xfc93a039, 21)              \
+            MD5MB_STEP(MD5MB_I, a, b, c, d, x[12], 0x655b59c3, 6)              \
+            MD5MB_STEP(MD5MB_I, d, a, b, c, x[3], 0x8f0ccc92, 10)              \
+            MD5MB_STEP(MD5MB_I, c, d, a, b, x[10], 0xffeff47d, 15)             \
+            MD5MB_STEP(MD5MB_I, b, c, d, a, x[1], 0x85845dd1, 21)              \
+            MD5MB_STEP(MD5MB_I, a, b, c, d, x[8], 0x6fa87e4f, 6)               \
+            MD5MB_STEP(MD5MB_I, d, a, b, c, x[15], 0xfe2ce6e0, 10)             \
+            MD5MB_STEP(MD5MB_I, c, d, a, b, x[6], 0xa3014314, 15)              \
+            MD5MB_STEP(MD5MB_I, b, c, d, a, x[13], 0x4e0811a1, 21)             \
+            MD5MB_STEP(MD5MB_I, a, b, c, d, x[4], 0xf7537e82, 6)               \
+            MD5MB_STEP(MD5MB_I, d, a, b, c, x[11], 0xbd3af235, 10)             \
+            MD5MB_STEP(MD5MB_I, c, d, a, b, x[2], 0x2ad7d2bb, 15)              \
+            MD5MB_STEP(MD5MB_I, b, c, d, a, x[9], 0xeb86d391, 21)              \
+                                                                               \
+            a += sa;                                                           \
+            b += sb;                                                           \
+            c += sc;                                                           \
+            d += sd;                                                           \
+        }                                                                      \
+                                                                               \
+        memcpy(t, &a, sizeof(a));                                              \
+        for (j = 0; j < W; j++) {                                              \
+            ctx[j]->a = t[j];                                                  \
+        }                                                                      \
+        memcpy(t, &b, sizeof(b));                                              \
+        for (j = 0; j < W; j++) {                                              \
+            ctx[j]->b = t[j];                                                  \
+        }                                                                      \
+        memcpy(t, &c, sizeof(c));                                              \
+        for (j = 0; j < W; j++) {                                              \
+            ctx[j]->c = t[j];                                                  \
+        }                                                                      \
+        memcpy(t, &d, sizeof(d));                                              \
+        for (j = 0; j < W; j++) {                                              \
+            ctx[j]->d = t[j];                                                  \
+            ctx[j]->len += nblocks * 64;                                       \
+        }                                                                      \
+    }
+
+MD5MB_KERNEL(md5mb_kernel1, uint32_t, 1, )
+
+#if defined(__GNUC__)
+typedef uint32_t md5mb_v4_t __attribute__((vector_size(16)));
+MD5MB_KERNEL(md5mb_kernel4, md5mb_v4_t, 4, )
+#endif
+
+#if defined(HAVE_MD5MB_X86)
+typedef uint32_t md5mb_v8_t __attribute__((vector_size(32)));
+typedef uint32_t md5mb_v16_t __attribute__((vector_size(64)));
+MD5MB_KERNEL(md5mb_kernel8, md5mb_v8_t, 8, __attribute__((target("avx2"))))
+MD5MB_KERNEL(md5mb_kernel16, md5mb_v16_t, 16,
+             __attribute__((target("avx512f"))))
+#endif
+
+int md5mb_maxlanes(void) {
+#if defined(HAVE_MD5MB_X86)
+    if (__builtin_cpu_supports("avx512f")) {
+        return 16;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        return 8;
+    }
+#endif
+#if defined(__GNUC__)
+    return 4;
+#else
+    return 1;
+#endif
+}
+
+void md5mb_init(md5mb_t* const ctx) {
+    ctx->a = 0x67452301;
+    ctx->b = 0xefcdab89;
+    ctx->c = 0x98badcfe;
+    ctx->d = 0x10325476;
+    ctx->len = 0;
+}
+
+void md5mb_blocks(md5mb_t* const ctx[], const unsigned char* const data[],
+                  int n, size_t nblocks) {
+    md5mb_t* lctx[MD5MB_MAXLANES];
+    const unsigned char* ldata[MD5MB_MAXLANES];
+    md5mb_t scratch[MD5MB_MAXLANES];
+    int i, w;
+
+    if (n == 1) {
+        md5mb_kernel1(ctx, data, nblocks);
+        return;
+    }
+
+    w = md5mb_maxlanes();
+    while ((w > 4) && ((w / 2) >= n)) {
+        w /= 2;
+    }
+
+    if (n > w) {
+        /* more streams than lanes */
+        for (i = 0; i < n; i += w) {
+            md5mb_blocks(ctx + i, data + i, min2(w, n - i), nblocks);
+        }
+        return;
+    }
+
+    /* unused lanes hash a copy of the first stream into scratch state */
+    for (i = 0; i < w; i++) {
+        lctx[i] = (i < n) ? ctx[i] : &scratch[i];
+        ldata[i] = (i < n) ? data[i] : data[0];
+    }
+
+    switch (w) {
+#if defined(HAVE_MD5MB_X86)
+    case 16:
+        md5mb_kernel16(lctx, ldata, nblocks);
+        break;
+    case 8:
+        md5mb_kernel8(lctx, ldata, nblocks);
+        break;
+#endif
+#if defined(__GNUC__)
+    case 4:
+        md5mb_kernel4(lctx, ldata, nblocks);
+        break;
+#endif
+    default:
+        for (i = 0; i < n; i++) {
+            md5mb_kernel1(ctx + i, data + i, nblocks);
+        }
+        break;
+    }
+}
+
+void md5mb_final(md5mb_t* const ctx, const unsigned char* tail, size_t len,
+                 MD5Digest md5sum) {
+    unsigned char block[128];
+    const unsigned char* data[1];
+    md5mb_t* lctx[1];
+    uint64_t bits;
+    size_t nblocks, i;
+
+    lctx[0] = ctx;
+    data[0] = tail;
+
+    nblocks = len / 64;
+    if (nblocks) {
+        md5mb_kernel1(lctx, data, nblocks);
+        tail += nblocks * 64;
+        len -= nblocks * 64;
+    }
+
+    bits = (ctx->len + len) * 8;
+
+    memset(block, 0, sizeof(block));
+    memcpy(block, tail, len);
+    block[len] = 0x80;
+    nblocks = (len < 56) ? 1 : 2;
+    for (i = 0; i < 8; i++) {
+        block[(nblocks * 64) - 8 + i] = (unsigned char)(bits >> (i * 8));
+    }
+
+    data[0] = block;
+    md5mb_kernel1(lctx, data, nblocks);
+
+    for (i = 0; i < 4; i++) {
+        md5sum[i] = (unsigned char)(ctx->a >> (i * 8));
+        md5sum[4 + i] = (unsigned char)(ctx->b >> (i * 8));
+        md5sum[8 + i] = (unsigned char)(ctx->c >> (i * 8));
+        md5sum[12 + i] = (unsigned char)(ctx->d >> (i * 8));
+    }
+}
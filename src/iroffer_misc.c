@@ -95,6 +95,8 @@ typedef struct {
 static const config_parse_bool_t config_parse_bool[] = {
     {"logstats", &gdata.logstats, &gdata.logstats},
     {"hideos", &gdata.hideos, &gdata.hideos},
+    {"uploadsplice", &gdata.uploadsplice, &gdata.uploadsplice},
+    {"uploadautoadd", &gdata.uploadautoadd, &gdata.uploadautoadd},
     {"lognotices", &gdata.lognotices, &gdata.lognotices},
     {"logmessages", &gdata.logmessages, &gdata.logmessages},
     {"timestampconsole", &gdata.timestampconsole, &gdata.timestampconsole},
@@ -107,6 +109,10 @@ static const config_parse_bool_t config_parse_bool[] = {
     {"restrictprivlist", &gdata.restrictprivlist, &gdata.restrictprivlist},
     {"restrictsend", &gdata.restrictsend, &gdata.restrictsend},
     {"nomd5sum", &gdata.nomd5sum, &gdata.nomd5sum},
+    {"nocrc32", &gdata.nocrc32, &gdata.nocrc32},
+    {"nosha256", &gdata.nosha256, &gdata.nosha256},
+    {"nofilewatch", &gdata.nofilewatch, &gdata.nofilewatch},
+    {"memdebug", &gdata.memdebug, &gdata.memdebug},
     {"xdcclistfileraw", &gdata.xdcclistfileraw, &gdata.xdcclistfileraw},
 };
 
@@ -139,6 +145,18 @@ static const config_parse_int_t config_parse_int[] = {
      1000000, 1},
     {"autoignore_threshold", &gdata.autoignore_threshold,
      &gdata.autoignore_threshold, 10, 600, 1},
+    {"fdcache", &gdata.fdcache, &gdata.fdcache, 0, 1000000, 1},
+    {"blockcache", &gdata.blockcache_mb, &gdata.blockcache_mb, 0, 65536, 1},
+    {"uploadmaxspeed", &gdata.uploadmaxspeed, &gdata.uploadmaxspeed, 0,
+     1000000, 4},
+    {"uploadack", &gdata.uploadack, &gdata.uploadack, 0, 1000000, 1024},
+    {"hashthreads", &gdata.hashthreads, &gdata.hashthreads, 0, 64, 1},
+    {"hashlanes", &gdata.hashlanes, &gdata.hashlanes, 0, MD5MB_MAXLANES, 1},
+    {"scanthreads", &gdata.scanthreads, &gdata.scanthreads, 0, 64, 1},
+    {"searchmaxresults", &gdata.searchmaxresults, &gdata.searchmaxresults, 0,
+     1000, 1},
+    {"hashmaxspeed", &gdata.hashmaxspeed, &gdata.hashmaxspeed, 0, 1000000,
+     1024},
 };
 
 typedef struct {
@@ -444,6 +462,16 @@ void getconfig_set(const char* line, int rehash) {
         mydelete(a);
         mydelete(b);
         mydelete(var);
+    } else if (!strcmp(type, "hashcoldtime")) {
+        a = getpart(var, 1);
+        b = getpart(var, 2);
+        if (a && b) {
+            gdata.hashcoldtimestart = between(0, atoi(a), 23);
+            gdata.hashcoldtimeend = between(0, atoi(b), 23);
+        }
+        mydelete(a);
+        mydelete(b);
+        mydelete(var);
     } else if (!strcmp(type, "overallmaxspeeddaydays")) {
         gdata.overallmaxspeeddaydays = 0;
         for (i = 0; (i < sstrlen(var) && i < 8); i++) {
@@ -505,6 +533,15 @@ void getconfig_set(const char* line, int rehash) {
         mydelete(gdata.r_pidfile);
         gdata.r_pidfile = var;
         convert_to_unix_slash(gdata.r_pidfile);
+    } else if (!strcmp(type, "watchdir")) {
+        char* wd;
+        convert_to_unix_slash(var);
+        wd = irlist_add(&gdata.watchdirs, strlen(var) + 2);
+        strcpy(wd, var);
+        if (!wd[0] || (wd[strlen(wd) - 1] != '/')) {
+            strcat(wd, "/");
+        }
+        mydelete(var);
     } else if (!strcmp(type, "filedir")) {
         mydelete(gdata.filedir);
         gdata.filedir = var;
@@ -521,6 +558,10 @@ void getconfig_set(const char* line, int rehash) {
         mydelete(gdata.xdcclistfile);
         gdata.xdcclistfile = var;
         convert_to_unix_slash(gdata.xdcclistfile);
+    } else if (!strcmp(type, "xdcclistjson")) {
+        mydelete(gdata.xdcclistjson);
+        gdata.xdcclistjson = var;
+        convert_to_unix_slash(gdata.xdcclistjson);
     } else if (!strcmp(type, "logfile")) {
         mydelete(gdata.logfile);
         gdata.logfile = var;
@@ -1283,74 +1324,133 @@ void pingserver(void) {
                                           : gdata.curserver.hostname);
 }
 
-void xdccsavetext(void) {
-    char *xdcclistfile_tmp, *xdcclistfile_bkup;
+/*
+ * The list is rendered into memory first and only written out, with as
+ * few writev() as the buffer allows, when it differs from what was saved
+ * last or the file went away.
+ */
+static void xdccsavetext_file(const char* file, ir_boutput_t* bout,
+                              MD5Digest md5, int* saved) {
+    char *file_tmp, *file_bkup;
+    MD5Digest digest = {};
+    struct stat st;
     int fd;
-    userinput* uxdl;
     int callval;
 
-    updatecontext();
+    ir_boutput_get_md5sum(bout, digest);
 
-    if (!gdata.xdcclistfile) {
+    if (*saved && !memcmp(digest, md5, sizeof(MD5Digest)) &&
+        !stat(file, &st)) {
         return;
     }
 
-    xdcclistfile_tmp = mycalloc(strlen(gdata.xdcclistfile) + 5);
-    xdcclistfile_bkup = mycalloc(strlen(gdata.xdcclistfile) + 2);
+    file_tmp = mycalloc(strlen(file) + 5);
+    file_bkup = mycalloc(strlen(file) + 2);
 
-    sprintf(xdcclistfile_tmp, "%s.tmp", gdata.xdcclistfile);
-    sprintf(xdcclistfile_bkup, "%s~", gdata.xdcclistfile);
+    sprintf(file_tmp, "%s.tmp", file);
+    sprintf(file_bkup, "%s~", file);
 
-    fd =
-        open(xdcclistfile_tmp, O_WRONLY | O_CREAT | O_TRUNC, CREAT_PERMISSIONS);
+    fd = open(file_tmp, O_WRONLY | O_CREAT | O_TRUNC, CREAT_PERMISSIONS);
     if (fd < 0) {
         outerror(OUTERROR_TYPE_WARN_LOUD, "Cant Create XDCC List File '%s': %s",
-                 xdcclistfile_tmp, strerror(errno));
+                 file_tmp, strerror(errno));
         goto error_out;
     }
 
-    uxdl = mycalloc(sizeof(userinput));
-
-    u_fillwith_msg(uxdl, NULL, "A A A A A xdl");
-    uxdl->method = method_fd;
-    uxdl->fd = fd;
-
-    u_parseit(uxdl);
-
-    mydelete(uxdl);
+    bout->fd = fd;
+    ir_boutput_set_flags(bout, 0);
 
+    callval = ir_boutput_attempt_flush(bout);
     close(fd);
 
+    if ((callval < 0) || (bout->count_written != bout->count_flushed)) {
+        outerror(OUTERROR_TYPE_WARN_LOUD,
+                 "Cant Write XDCC List File '%s': %s", file_tmp,
+                 strerror(errno));
+        unlink(file_tmp);
+        goto error_out;
+    }
+
     /* remove old bkup */
-    callval = unlink(xdcclistfile_bkup);
+    callval = unlink(file_bkup);
     if ((callval < 0) && (errno != ENOENT)) {
         outerror(OUTERROR_TYPE_WARN_LOUD,
-                 "Cant Remove Old XDCC List File '%s': %s", xdcclistfile_bkup,
+                 "Cant Remove Old XDCC List File '%s': %s", file_bkup,
                  strerror(errno));
         /* ignore, continue */
     }
 
     /* backup old -> bkup */
-    callval = link(gdata.xdcclistfile, xdcclistfile_bkup);
+    callval = link(file, file_bkup);
     if ((callval < 0) && (errno != ENOENT)) {
         outerror(OUTERROR_TYPE_WARN_LOUD,
-                 "Cant Backup Old XDCC List File '%s' -> '%s': %s",
-                 gdata.xdcclistfile, xdcclistfile_bkup, strerror(errno));
+                 "Cant Backup Old XDCC List File '%s' -> '%s': %s", file,
+                 file_bkup, strerror(errno));
         /* ignore, continue */
     }
 
     /* rename new -> current */
-    callval = rename(xdcclistfile_tmp, gdata.xdcclistfile);
+    callval = rename(file_tmp, file);
     if (callval < 0) {
         outerror(OUTERROR_TYPE_WARN_LOUD,
-                 "Cant Save New XDCC List File '%s': %s", gdata.xdcclistfile,
+                 "Cant Save New XDCC List File '%s': %s", file,
                  strerror(errno));
-        /* ignore, continue */
+        goto error_out;
     }
 
+    memcpy(md5, digest, sizeof(MD5Digest));
+    *saved = 1;
+
 error_out:
-    mydelete(xdcclistfile_tmp);
-    mydelete(xdcclistfile_bkup);
+    mydelete(file_tmp);
+    mydelete(file_bkup);
+}
+
+void xdccsavetext(void) {
+    ir_boutput_t bout;
+    userinput* uxdl;
+
+    updatecontext();
+
+    if (!gdata.xdcclistfile && !gdata.xdcclistjson) {
+        return;
+    }
+
+    if (gdata.statefile_hold) {
+        gdata.xdcclist_pending = 1;
+        return;
+    }
+    gdata.xdcclist_pending = 0;
+
+    if (gdata.xdcclistfile) {
+        ir_boutput_init(&bout, -1,
+                        BOUTPUT_NO_FLUSH | BOUTPUT_NO_LIMIT | BOUTPUT_MD5SUM);
+
+        uxdl = mycalloc(sizeof(userinput));
+
+        u_fillwith_msg(uxdl, NULL, "A A A A A xdl");
+        uxdl->method = method_fd;
+        uxdl->bout = &bout;
+
+        u_parseit(uxdl);
+
+        mydelete(uxdl);
+
+        xdccsavetext_file(gdata.xdcclistfile, &bout, gdata.xdcclistfile_md5,
+                          &gdata.xdcclistfile_saved);
+        ir_boutput_delete(&bout);
+    }
+
+    if (gdata.xdcclistjson) {
+        ir_boutput_init(&bout, -1,
+                        BOUTPUT_NO_FLUSH | BOUTPUT_NO_LIMIT | BOUTPUT_MD5SUM);
+
+        u_xdl_json(&bout);
+
+        xdccsavetext_file(gdata.xdcclistjson, &bout, gdata.xdcclistjson_md5,
+                          &gdata.xdcclistjson_saved);
+        ir_boutput_delete(&bout);
+    }
 }
 
 void writepidfile(const char* filename) {
@@ -1761,6 +1861,14 @@ void shutdowniroffer(void) {
         write_statefile();
     }
 
+#ifdef HAVE_PTHREAD
+    hashpool_stop();
+#endif
+    dirscan_stop();
+#ifdef HAVE_INOTIFY
+    filewatch_stop();
+#endif
+
     if (gdata.exiting || gdata.serverstatus != SERVERSTATUS_CONNECTED) {
         if (gdata.exiting) {
             ioutput(CALLTYPE_NORMAL, OUT_S, COLOR_NO_COLOR,
@@ -1815,12 +1923,7 @@ void shutdowniroffer(void) {
             shutdown(tr->clientsocket, SHUT_RDWR);
             close(tr->clientsocket);
         }
-        tr->xpack->file_fd_count--;
-        if (!tr->xpack->file_fd_count && (tr->xpack->file_fd != FD_UNUSED)) {
-            close(tr->xpack->file_fd);
-            tr->xpack->file_fd = FD_UNUSED;
-            tr->xpack->file_fd_location = 0;
-        }
+        fdcache_release(tr->iopack);
         tr->tr_status = TRANSFER_STATUS_DONE;
 
         ioutput(CALLTYPE_NORMAL, OUT_S | OUT_D, COLOR_YELLOW,
@@ -1848,6 +1951,7 @@ void shutdowniroffer(void) {
             close(ul->clientsocket);
         }
         if (ul->filedescriptor != FD_UNUSED) {
+            l_flush(ul);
             close(ul->filedescriptor);
         }
         ul->ul_status = UPLOAD_STATUS_DONE;
@@ -1857,6 +1961,8 @@ void shutdowniroffer(void) {
         ul = irlist_get_next(ul);
     }
 
+    l_writer_stop();
+
     /* quit */
     if (gdata.serverstatus == SERVERSTATUS_CONNECTED) {
         tempstr2 = mycalloc(maxtextlengthshort);
@@ -2122,6 +2228,7 @@ void reinit_config_vars(void) {
     gdata.tcprangestart = 0;
     irlist_delete_all(&gdata.proxyinfo);
     irlist_delete_all(&gdata.server_join_raw);
+    irlist_delete_all(&gdata.watchdirs);
     irlist_delete_all(&gdata.server_connected_raw);
     irlist_delete_all(&gdata.channel_join_raw);
     gdata.usenatip = 0;
@@ -2133,6 +2240,10 @@ void reinit_config_vars(void) {
     gdata.lowbdwth = 0;
     gdata.punishslowusers = 0;
     gdata.nomd5sum = 0;
+    gdata.nocrc32 = 0;
+    gdata.nosha256 = 0;
+    gdata.nofilewatch = 0;
+    gdata.memdebug = 0;
     gdata.transferminspeed = gdata.transfermaxspeed = 0.0;
     gdata.overallmaxspeed = gdata.overallmaxspeeddayspeed = 0;
     gdata.overallmaxspeeddaytimestart = gdata.overallmaxspeeddaytimeend = 0;
@@ -2155,6 +2266,18 @@ void reinit_config_vars(void) {
     gdata.respondtochannelxdcc = 0;
     gdata.respondtochannellist = 0;
     gdata.smallfilebypass = 0;
+    gdata.fdcache = 20;
+    gdata.blockcache_mb = 0;
+    gdata.uploadmaxspeed = 0;
+    gdata.uploadack = 0;
+    gdata.uploadsplice = 0;
+    gdata.uploadautoadd = 0;
+    gdata.hashthreads = 2;
+    gdata.hashlanes = 1;
+    gdata.scanthreads = 4;
+    gdata.searchmaxresults = 20;
+    gdata.hashmaxspeed = 0;
+    gdata.hashcoldtimestart = gdata.hashcoldtimeend = 0;
     mydelete(gdata.creditline);
     mydelete(gdata.headline);
     mydelete(gdata.nickserv_pass);
@@ -2170,6 +2293,8 @@ void reinit_config_vars(void) {
     mydelete(gdata.statefile);
     mydelete(gdata.xdcclistfile);
     gdata.xdcclistfileraw = 0;
+    mydelete(gdata.xdcclistjson);
+    gdata.xdcclistfile_saved = gdata.xdcclistjson_saved = 0;
 }
 
 void initprefixes(void) {
@@ -2193,9 +2318,11 @@ void initvars(void) {
     reinit_config_vars();
     initprefixes();
     initchanmodes();
+    crc32_init();
 
     gdata.serverstatus = SERVERSTATUS_NEED_TO_CONNECT;
     gdata.logfd = FD_UNUSED;
+    gdata.filewatch.fd = FD_UNUSED;
     gdata.termcols = 80;
     gdata.termlines = 24;
 
@@ -2754,6 +2881,7 @@ void look_for_file_changes(xdcc* xpack) {
     if (stat(xpack->file, &st) < 0) {
         outerror(OUTERROR_TYPE_WARN, "File '%s' can no longer be accessed: %s",
                  xpack->file, strerror(errno));
+        fdcache_drop(xpack);
         return;
     }
 
@@ -2769,10 +2897,17 @@ void look_for_file_changes(xdcc* xpack) {
     /*
      * Certain filesystem types dont have constant dev/inode
      * numbers so we can't compare against them.  Only compare
-     * mtime and size.
+     * mtime and size.  A cached descriptor may still point at a
+     * replaced file though, so let it go.
      */
-    xpack->st_dev = st.st_dev;
-    xpack->st_ino = st.st_ino;
+    if ((xpack->st_dev != st.st_dev) || (xpack->st_ino != st.st_ino)) {
+        fdcache_drop(xpack);
+        blockcache_drop(xpack);
+        xdcc_unindex(xpack);
+        xpack->st_dev = st.st_dev;
+        xpack->st_ino = st.st_ino;
+        xdcc_index(xpack);
+    }
 
     if ((xpack->mtime != st.st_mtime) || (xpack->st_size != st.st_size)) {
         if (!gdata.xdcclistfile ||
@@ -2782,6 +2917,7 @@ void look_for_file_changes(xdcc* xpack) {
 
         xpack->mtime = st.st_mtime;
         xpack->st_size = st.st_size;
+        xdcc_dirty(xpack);
 
         tr = irlist_get_head(&gdata.trans);
         while (tr) {
@@ -2792,16 +2928,12 @@ void look_for_file_changes(xdcc* xpack) {
             tr = irlist_get_next(tr);
         }
 
-        if (gdata.md5build.xpack == xpack) {
-            outerror(OUTERROR_TYPE_WARN, "[MD5]: Canceled (file changed)");
+        md5build_cancel(xpack, "file changed");
+        xdcc_clear_digest(xpack);
 
-            FD_CLR(gdata.md5build.file_fd, &gdata.readset);
-            close(gdata.md5build.file_fd);
-            gdata.md5build.file_fd = FD_UNUSED;
-            gdata.md5build.xpack = NULL;
-        }
-        xpack->has_md5sum = 0;
-        memset(xpack->md5sum, 0, sizeof(MD5Digest));
+        xdcc_dup_unlink(xpack, 0);
+        fdcache_drop(xpack);
+        blockcache_drop(xpack);
 
         assert(xpack->file_fd == FD_UNUSED);
         assert(xpack->file_fd_count == 0);
@@ -2811,6 +2943,438 @@ void look_for_file_changes(xdcc* xpack) {
     }
 }
 
+/*
+ * Packs are kept in gdata.xdccs for the code walking them and in the
+ * gdata.packs array for lookups by number.  They are only added, removed
+ * and moved with these functions, which keep both in the same order and
+ * each pack's packnum up to date.
+ */
+static void xdcc_renumber(int first, int last) {
+    int i;
+
+    for (i = first; i <= last; i++) {
+        gdata.packs.pack[i]->packnum = i + 1;
+    }
+}
+
+/* a new empty pack after the last one */
+xdcc* xdcc_add(void) {
+    xdcc** grow;
+    xdcc* xd;
+
+    if (gdata.packs.count == gdata.packs.alloc) {
+        gdata.packs.alloc = gdata.packs.alloc ? gdata.packs.alloc * 2 : 64;
+        grow = mycalloc(sizeof(xdcc*) * gdata.packs.alloc);
+        if (gdata.packs.count) {
+            memcpy(grow, gdata.packs.pack, sizeof(xdcc*) * gdata.packs.count);
+        }
+        mydelete(gdata.packs.pack);
+        gdata.packs.pack = grow;
+    }
+
+    xd = irlist_add(&gdata.xdccs, sizeof(xdcc));
+    gdata.packs.pack[gdata.packs.count++] = xd;
+    xd->packnum = gdata.packs.count;
+    gdata.xdl.width = 0;
+
+    return xd;
+}
+
+/* unlink and free the pack with its strings */
+void xdcc_remove(xdcc* xpack) {
+    int i = xpack->packnum - 1;
+
+    assert(gdata.packs.pack[i] == xpack);
+    assert(!xpack->fdcache_idle);
+
+    xdcc_unindex(xpack);
+    xdcc_dirty(xpack);
+    mydelete(xpack->file);
+    mydelete(xpack->desc);
+    mydelete(xpack->note);
+    mydelete(xpack->pieces.piece);
+
+    memmove(&gdata.packs.pack[i], &gdata.packs.pack[i + 1],
+            sizeof(xdcc*) * (gdata.packs.count - i - 1));
+    gdata.packs.count--;
+    xdcc_renumber(i, gdata.packs.count - 1);
+
+    irlist_delete(&gdata.xdccs, xpack);
+}
+
+void xdcc_move(xdcc* xpack, int packnum) {
+    int from = xpack->packnum - 1;
+    int to = packnum - 1;
+
+    assert(gdata.packs.pack[from] == xpack);
+
+    if (to < from) {
+        memmove(&gdata.packs.pack[to + 1], &gdata.packs.pack[to],
+                sizeof(xdcc*) * (from - to));
+    } else {
+        memmove(&gdata.packs.pack[from], &gdata.packs.pack[from + 1],
+                sizeof(xdcc*) * (to - from));
+    }
+    gdata.packs.pack[to] = xpack;
+    xdcc_renumber(min2(from, to), max2(from, to));
+
+    irlist_remove(&gdata.xdccs, xpack);
+    if (!to) {
+        irlist_insert_head(&gdata.xdccs, xpack);
+    } else {
+        irlist_insert_after(&gdata.xdccs, xpack, gdata.packs.pack[to - 1]);
+    }
+}
+
+/*
+ * drop the rendered list lines of the pack, whoever changes its gets,
+ * size, desc, note or speeds calls this
+ */
+void xdcc_dirty(xdcc* xpack) {
+    int i;
+
+    for (i = 0; i < NUMBER_XDL_STYLES; i++) {
+        mydelete(xpack->xdl[i]);
+    }
+    gdata.xdl.width = 0;
+}
+
+/* NULL when there is no such pack */
+xdcc* xdcc_get(int packnum) {
+    assert(gdata.packs.count == irlist_size(&gdata.xdccs));
+
+    if ((packnum < 1) || (packnum > gdata.packs.count)) {
+        return NULL;
+    }
+    return gdata.packs.pack[packnum - 1];
+}
+
+/*
+ * Packs are found by file name and by device and inode in two chained
+ * hashes, and by the words of their file, description and note in the
+ * search index.  A pack is put in them with xdcc_index() once those are
+ * set, whoever changes one of them takes it out with xdcc_unindex()
+ * first.  The hashes double when they hold more packs than buckets.
+ */
+static unsigned int xdcc_hash_file(const char* file) {
+    unsigned int h = 2166136261U;
+
+    while (*file) {
+        h = (h ^ (unsigned char)*file++) * 16777619U;
+    }
+    return h & (gdata.packs.hashsize - 1);
+}
+
+static unsigned int xdcc_hash_inode(dev_t dev, ino_t ino) {
+    unsigned long h;
+
+    h = (unsigned long)ino * 2654435761UL;
+    h ^= (unsigned long)dev;
+
+    return h & (gdata.packs.hashsize - 1);
+}
+
+static void xdcc_hash_link(xdcc* xpack) {
+    xdcc** pxd;
+
+    pxd = &gdata.packs.byfile[xdcc_hash_file(xpack->file)];
+    xpack->file_next = *pxd;
+    *pxd = xpack;
+
+    /* files that could not be accessed have no inode */
+    if (xpack->st_ino) {
+        pxd = &gdata.packs.byinode[xdcc_hash_inode(xpack->st_dev,
+                                                   xpack->st_ino)];
+        xpack->inode_next = *pxd;
+        *pxd = xpack;
+    }
+}
+
+static void xdcc_hash_resize(unsigned int hashsize) {
+    int i;
+
+    mydelete(gdata.packs.byfile);
+    mydelete(gdata.packs.byinode);
+    gdata.packs.hashsize = hashsize;
+    gdata.packs.byfile = mycalloc(sizeof(xdcc*) * hashsize);
+    gdata.packs.byinode = mycalloc(sizeof(xdcc*) * hashsize);
+
+    for (i = 0; i < gdata.packs.count; i++) {
+        if (gdata.packs.pack[i]->indexed) {
+            xdcc_hash_link(gdata.packs.pack[i]);
+        }
+    }
+}
+
+void xdcc_index(xdcc* xpack) {
+    if (xpack->indexed) {
+        return;
+    }
+
+    if (!gdata.packs.hashsize) {
+        xdcc_hash_resize(XDCC_HASHSIZE);
+    } else if (gdata.packs.count > (int)gdata.packs.hashsize) {
+        xdcc_hash_resize(gdata.packs.hashsize * 2);
+    }
+
+    xdcc_hash_link(xpack);
+    search_index(xpack);
+    xpack->indexed = 1;
+}
+
+void xdcc_unindex(xdcc* xpack) {
+    xdcc** pxd;
+
+    if (!xpack->indexed) {
+        return;
+    }
+
+    search_unindex(xpack);
+
+    pxd = &gdata.packs.byfile[xdcc_hash_file(xpack->file)];
+    while (*pxd != xpack) {
+        pxd = &(*pxd)->file_next;
+    }
+    *pxd = xpack->file_next;
+
+    if (xpack->st_ino) {
+        pxd = &gdata.packs.byinode[xdcc_hash_inode(xpack->st_dev,
+                                                   xpack->st_ino)];
+        while (*pxd != xpack) {
+            pxd = &(*pxd)->inode_next;
+        }
+        *pxd = xpack->inode_next;
+    }
+
+    xpack->file_next = xpack->inode_next = NULL;
+    xpack->indexed = 0;
+}
+
+/* the first pack with this file, or the next one after 'after' */
+xdcc* xdcc_find_file(const char* file, const xdcc* after) {
+    xdcc* xd;
+
+    if (!gdata.packs.hashsize) {
+        return NULL;
+    }
+
+    xd = after ? after->file_next
+               : gdata.packs.byfile[xdcc_hash_file(file)];
+    for (; xd; xd = xd->file_next) {
+        if (!strcmp(xd->file, file)) {
+            return xd;
+        }
+    }
+    return NULL;
+}
+
+xdcc* xdcc_find_inode(dev_t dev, ino_t ino, const xdcc* after) {
+    xdcc* xd;
+
+    if (!gdata.packs.hashsize || !ino) {
+        return NULL;
+    }
+
+    xd = after ? after->inode_next
+               : gdata.packs.byinode[xdcc_hash_inode(dev, ino)];
+    for (; xd; xd = xd->inode_next) {
+        if ((xd->st_dev == dev) && (xd->st_ino == ino)) {
+            return xd;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Packs offering the same content (equal size and md5sum) are linked to
+ * one pack of the group, its head.  Transfers of any pack in the group
+ * read from the head's descriptor, mmap windows and cached blocks.  Heads
+ * are found by size and md5sum in gdata.duphash, the members of a group
+ * are chained on the head's dup_next.
+ */
+static unsigned int xdcc_dup_key(const xdcc* xpack) {
+    unsigned int h;
+
+    memcpy(&h, xpack->md5sum, sizeof(h));
+    return h ^ (unsigned int)xpack->st_size;
+}
+
+static void xdcc_dup_resize(unsigned int size) {
+    xdcc** old = gdata.duphash.head;
+    unsigned int oldsize = gdata.duphash.size;
+    unsigned int i;
+    xdcc* xd;
+
+    gdata.duphash.head = mycalloc(sizeof(xdcc*) * size);
+    gdata.duphash.size = size;
+
+    for (i = 0; i < oldsize; i++) {
+        while ((xd = old[i])) {
+            old[i] = xd->dup_hnext;
+            xd->dup_hnext = gdata.duphash.head[xd->dup_key & (size - 1)];
+            gdata.duphash.head[xd->dup_key & (size - 1)] = xd;
+        }
+    }
+
+    mydelete(old);
+}
+
+static void xdcc_dup_hash(xdcc* xpack) {
+    xdcc** pxd;
+
+    if (!gdata.duphash.size) {
+        xdcc_dup_resize(DUPHASH_SIZE);
+    } else if (gdata.duphash.count >= gdata.duphash.size) {
+        xdcc_dup_resize(gdata.duphash.size * 2);
+    }
+
+    xpack->dup_key = xdcc_dup_key(xpack);
+    pxd = &gdata.duphash.head[xpack->dup_key & (gdata.duphash.size - 1)];
+    xpack->dup_hnext = *pxd;
+    *pxd = xpack;
+    xpack->dup_hashed = 1;
+    gdata.duphash.count++;
+}
+
+/* uses the stored key, the md5sum may already be cleared */
+static void xdcc_dup_unhash(xdcc* xpack) {
+    xdcc** pxd;
+
+    pxd = &gdata.duphash.head[xpack->dup_key & (gdata.duphash.size - 1)];
+    while (*pxd != xpack) {
+        pxd = &(*pxd)->dup_hnext;
+    }
+    *pxd = xpack->dup_hnext;
+    xpack->dup_hnext = NULL;
+    xpack->dup_hashed = 0;
+    gdata.duphash.count--;
+}
+
+static xdcc* xdcc_dup_find(const xdcc* xpack) {
+    unsigned int key;
+    xdcc* xd;
+
+    if (!gdata.duphash.size) {
+        return NULL;
+    }
+
+    key = xdcc_dup_key(xpack);
+    for (xd = gdata.duphash.head[key & (gdata.duphash.size - 1)]; xd;
+         xd = xd->dup_hnext) {
+        if ((xd->dup_key == key) && (xd->st_size == xpack->st_size) &&
+            !memcmp(xd->md5sum, xpack->md5sum, sizeof(MD5Digest))) {
+            return xd;
+        }
+    }
+
+    return NULL;
+}
+
+void xdcc_dup_link(xdcc* xpack) {
+    xdcc* found;
+
+    updatecontext();
+
+    if (!xpack->has_md5sum || xpack->dupof || xpack->dup_hashed) {
+        return;
+    }
+
+    found = xdcc_dup_find(xpack);
+
+    if (!found) {
+        xdcc_dup_hash(xpack);
+        return;
+    }
+
+    if (xpack->file_fd_count) {
+        return; /* linked once fdcache_release() finds it idle */
+    }
+
+    fdcache_drop(xpack);
+    blockcache_drop(xpack);
+    xpack->dupof = found;
+    xpack->dup_next = found->dup_next;
+    found->dup_next = xpack;
+
+    if (gdata.debug > 0) {
+        ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L, COLOR_NO_COLOR,
+                "'%s' has the same content as '%s'", xpack->file,
+                found->file);
+    }
+}
+
+/*
+ * Take a pack out of its content group.  If it heads the group another
+ * member takes over; when the pack is being removed its descriptor and
+ * mmap windows move along with the transfers using them, otherwise those
+ * transfers are closed as the content they read has changed.
+ */
+void xdcc_dup_unlink(xdcc* xpack, int removed) {
+    xdcc** pxd;
+    xdcc* xd;
+    xdcc* head;
+    transfer* tr;
+
+    updatecontext();
+
+    if (xpack->dupof) {
+        pxd = &xpack->dupof->dup_next;
+        while (*pxd != xpack) {
+            pxd = &(*pxd)->dup_next;
+        }
+        *pxd = xpack->dup_next;
+        xpack->dup_next = NULL;
+        xpack->dupof = NULL;
+        return;
+    }
+
+    if (!xpack->dup_hashed) {
+        return;
+    }
+
+    xdcc_dup_unhash(xpack);
+    head = xpack->dup_next;
+    xpack->dup_next = NULL;
+
+    if (!head) {
+        return;
+    }
+
+    head->dupof = NULL;
+    for (xd = head->dup_next; xd; xd = xd->dup_next) {
+        xd->dupof = head;
+    }
+    xdcc_dup_hash(head);
+
+    for (tr = irlist_get_head(&gdata.trans); tr; tr = irlist_get_next(tr)) {
+        if (tr->iopack != xpack) {
+            continue;
+        }
+        if (removed) {
+            tr->iopack = head;
+        } else if ((tr->tr_status != TRANSFER_STATUS_DONE) &&
+                   (tr->xpack != xpack)) {
+            t_closeconn(tr, "Pack file changed", 0);
+        }
+    }
+
+    if (removed) {
+        head->file_fd = xpack->file_fd;
+        head->file_fd_count = xpack->file_fd_count;
+        head->file_fd_location = xpack->file_fd_location;
+        head->file_fd_lastused = xpack->file_fd_lastused;
+#ifdef HAVE_MMAP
+        head->mmaps = xpack->mmaps;
+        memset(&xpack->mmaps, 0, sizeof(irlist_t));
+#endif
+        xpack->file_fd = FD_UNUSED;
+        xpack->file_fd_count = 0;
+        xpack->file_fd_location = 0;
+        fdcache_update(xpack);
+        fdcache_update(head);
+    }
+}
+
 void user_changed_nick(const char* oldnick, const char* newnick) {
     transfer* tr;
     pqueue* pq;
@@ -0,0 +1,303 @@
+/*
+iroffer - An IRC file server using the DCC protocol
+Copyright (C) see CONTRIBUTORS
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/* include the headers */
+#include "iroffer_config.h"
+#include "iroffer_defines.h"
+#include "iroffer_headers.h"
+#include "iroffer_globals.h"
+
+/*
+ * Index for XDCC SEARCH
+ *
+ * Every run of three characters in the file, description and note of a
+ * pack is folded to upper case like caps() does and keeps a list of the
+ * packs that have it.  A search only looks at the packs that are on the
+ * lists of all the trigrams of its text, then checks those for the whole
+ * text with strstrnocase(), so the answer is the same as trying every
+ * pack.  Texts shorter than three characters have no trigram and still
+ * try every pack.
+ */
+
+#define search_fold(c) \
+    ((((c) >= 'a') && ((c) <= 'z')) ? (c) - 32 : (c))
+
+static unsigned int search_hash(unsigned int trigram) {
+    return (trigram * 2654435761U >> 8) & (gdata.search.hashsize - 1);
+}
+
+/* adds the trigrams of str to list, which has room for all of them */
+static int search_trigrams(const char* str, unsigned int* list, int count) {
+    const unsigned char* s = (const unsigned char*)str;
+    unsigned int t;
+
+    if (!s || !s[0] || !s[1]) {
+        return count;
+    }
+
+    t = search_fold(s[0]) << 8 | search_fold(s[1]);
+    for (s += 2; *s; s++) {
+        t = (t << 8 | search_fold(*s)) & 0xFFFFFF;
+        list[count++] = t;
+    }
+
+    return count;
+}
+
+static int search_trigram_cmp(const void* a, const void* b) {
+    unsigned int ta = *(const unsigned int*)a;
+    unsigned int tb = *(const unsigned int*)b;
+
+    return (ta > tb) - (ta < tb);
+}
+
+static int search_pack_cmp(const void* a, const void* b) {
+    uintptr_t pa = (uintptr_t) * (xdcc* const*)a;
+    uintptr_t pb = (uintptr_t) * (xdcc* const*)b;
+
+    return (pa > pb) - (pa < pb);
+}
+
+static int search_packnum_cmp(const void* a, const void* b) {
+    return (*(xdcc* const*)a)->packnum - (*(xdcc* const*)b)->packnum;
+}
+
+/* the sorted and unique trigrams of the pack, to be freed by the caller */
+static int search_pack_trigrams(xdcc* xpack, unsigned int** list) {
+    int count = 0;
+    int i, j;
+
+    *list = mymalloc(sizeof(unsigned int) *
+                     ((xpack->file ? strlen(xpack->file) : 0) +
+                      (xpack->desc ? strlen(xpack->desc) : 0) +
+                      (xpack->note ? strlen(xpack->note) : 0) + 1));
+
+    count = search_trigrams(xpack->file, *list, count);
+    count = search_trigrams(xpack->desc, *list, count);
+    count = search_trigrams(xpack->note, *list, count);
+
+    if (!count) {
+        return 0;
+    }
+
+    qsort(*list, count, sizeof(unsigned int), search_trigram_cmp);
+    for (i = j = 1; i < count; i++) {
+        if ((*list)[i] != (*list)[j - 1]) {
+            (*list)[j++] = (*list)[i];
+        }
+    }
+
+    return j;
+}
+
+static search_trigram_t** search_lookup(unsigned int trigram) {
+    search_trigram_t** pst;
+
+    pst = &gdata.search.hash[search_hash(trigram)];
+    while (*pst && (*pst)->trigram != trigram) {
+        pst = &(*pst)->next;
+    }
+
+    return pst;
+}
+
+static void search_resize(unsigned int hashsize) {
+    search_trigram_t** old = gdata.search.hash;
+    search_trigram_t *st, *next;
+    unsigned int oldsize = gdata.search.hashsize;
+    unsigned int i;
+
+    gdata.search.hashsize = hashsize;
+    gdata.search.hash = mycalloc(sizeof(search_trigram_t*) * hashsize);
+
+    for (i = 0; i < oldsize; i++) {
+        for (st = old[i]; st; st = next) {
+            next = st->next;
+            st->next = gdata.search.hash[search_hash(st->trigram)];
+            gdata.search.hash[search_hash(st->trigram)] = st;
+        }
+    }
+
+    mydelete(old);
+}
+
+/* where xpack is or would go in the address order of st */
+static int search_position(search_trigram_t* st, xdcc* xpack) {
+    int lo = 0;
+    int hi = st->count;
+    int mid;
+
+    while (lo < hi) {
+        mid = (lo + hi) / 2;
+        if ((uintptr_t)st->packs[mid] < (uintptr_t)xpack) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+void search_index(xdcc* xpack) {
+    search_trigram_t** pst;
+    search_trigram_t* st;
+    unsigned int* list;
+    xdcc** grow;
+    int count, i, pos;
+
+    if (!gdata.search.hashsize) {
+        search_resize(SEARCH_HASHSIZE);
+    }
+
+    count = search_pack_trigrams(xpack, &list);
+
+    for (i = 0; i < count; i++) {
+        pst = search_lookup(list[i]);
+        if (!*pst) {
+            st = *pst = mycalloc(sizeof(search_trigram_t));
+            st->trigram = list[i];
+            gdata.search.trigrams++;
+        }
+        st = *pst;
+
+        if (st->count == st->alloc) {
+            st->alloc = st->alloc ? st->alloc * 2 : 4;
+            grow = mycalloc(sizeof(xdcc*) * st->alloc);
+            if (st->count) {
+                memcpy(grow, st->packs, sizeof(xdcc*) * st->count);
+            }
+            mydelete(st->packs);
+            st->packs = grow;
+        }
+
+        pos = search_position(st, xpack);
+        memmove(&st->packs[pos + 1], &st->packs[pos],
+                sizeof(xdcc*) * (st->count - pos));
+        st->packs[pos] = xpack;
+        st->count++;
+    }
+
+    mydelete(list);
+
+    if (gdata.search.trigrams > (int)gdata.search.hashsize) {
+        search_resize(gdata.search.hashsize * 2);
+    }
+}
+
+void search_unindex(xdcc* xpack) {
+    search_trigram_t** pst;
+    search_trigram_t* st;
+    unsigned int* list;
+    int count, i, pos;
+
+    count = search_pack_trigrams(xpack, &list);
+
+    for (i = 0; i < count; i++) {
+        pst = search_lookup(list[i]);
+        st = *pst;
+        assert(st);
+
+        pos = search_position(st, xpack);
+        assert(pos < st->count && st->packs[pos] == xpack);
+        st->count--;
+        memmove(&st->packs[pos], &st->packs[pos + 1],
+                sizeof(xdcc*) * (st->count - pos));
+
+        if (!st->count) {
+            *pst = st->next;
+            mydelete(st->packs);
+            mydelete(st);
+            gdata.search.trigrams--;
+        }
+    }
+
+    mydelete(list);
+}
+
+static int search_match(xdcc* xpack, const char* query) {
+    return (xpack->file && strstrnocase(xpack->file, query)) ||
+           (xpack->desc && strstrnocase(xpack->desc, query)) ||
+           (xpack->note && strstrnocase(xpack->note, query));
+}
+
+/*
+ * the packs that have query in their file, description or note, by pack
+ * number, into a list to be freed by the caller
+ */
+int search_find(const char* query, xdcc*** found) {
+    search_trigram_t** lists;
+    search_trigram_t* st;
+    unsigned int* list;
+    xdcc** packs;
+    int count, i, j, k;
+
+    list = mymalloc(sizeof(unsigned int) * (strlen(query) + 1));
+    count = search_trigrams(query, list, 0);
+
+    if (!count || !gdata.search.hashsize) {
+        /* too short for the index */
+        mydelete(list);
+        packs = mycalloc(sizeof(xdcc*) * (gdata.packs.count + 1));
+        for (i = j = 0; i < gdata.packs.count; i++) {
+            if (search_match(gdata.packs.pack[i], query)) {
+                packs[j++] = gdata.packs.pack[i];
+            }
+        }
+        *found = packs;
+        return j;
+    }
+
+    /* the shortest list goes first, it is the one walked */
+    lists = mymalloc(sizeof(search_trigram_t*) * count);
+    for (i = 0; i < count; i++) {
+        st = lists[i] = *search_lookup(list[i]);
+        if (!st) {
+            mydelete(lists);
+            mydelete(list);
+            *found = mycalloc(sizeof(xdcc*));
+            return 0;
+        }
+        if (st->count < lists[0]->count) {
+            lists[i] = lists[0];
+            lists[0] = st;
+        }
+    }
+    mydelete(list);
+
+    st = lists[0];
+    packs = mycalloc(sizeof(xdcc*) * (st->count + 1));
+    for (i = j = 0; i < st->count; i++) {
+        for (k = 1; k < count; k++) {
+            if ((lists[k] != st) &&
+                !bsearch(&st->packs[i], lists[k]->packs, lists[k]->count,
+                         sizeof(xdcc*), search_pack_cmp)) {
+                break;
+            }
+        }
+        if ((k == count) && search_match(st->packs[i], query)) {
+            packs[j++] = st->packs[i];
+        }
+    }
+
+    mydelete(lists);
+
+    qsort(packs, j, sizeof(xdcc*), search_packnum_cmp);
+    *found = packs;
+    return j;
+}
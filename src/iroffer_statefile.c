@@ -75,6 +75,9 @@ typedef enum {
     STATEFILE_TAG_XDCCS_MINSPEED,
     STATEFILE_TAG_XDCCS_MAXSPEED,
     STATEFILE_TAG_XDCCS_MD5SUM_INFO,
+    STATEFILE_TAG_XDCCS_CRC32,  /* only valid with MD5SUM_INFO */
+    STATEFILE_TAG_XDCCS_SHA256, /* only valid with MD5SUM_INFO */
+    STATEFILE_TAG_XDCCS_PIECES,
 
     STATEFILE_TAG_TLIMIT_DAILY_USED = 13 << 8,
     STATEFILE_TAG_TLIMIT_DAILY_ENDS,
@@ -132,6 +135,24 @@ typedef struct {
     MD5Digest md5sum;
 } statefile_item_md5sum_info_t;
 
+typedef struct {
+    statefile_hdr_t hdr;
+    SHA256Digest sha256;
+} statefile_item_sha256_t;
+
+typedef struct {
+    statefile_hdr_t hdr;
+    uint32_t flags;
+    uint32_t piece_size;
+    statefile_uint64_t size;
+    uint32_t md5[4];
+    uint32_t sha256[8];
+    uint32_t crc32;
+    uint32_t piece_crc32;
+    uint32_t count;
+    /* followed by count piece_t, every word in network order */
+} statefile_item_pieces_t;
+
 
 static int write_statefile_item(ir_boutput_t* bout, void* item) {
     int callval;
@@ -167,6 +188,28 @@ static int write_statefile_item(ir_boutput_t* bout, void* item) {
 }
 
 
+/*
+ * Batches of pack changes write the state file and the xdcc list file
+ * once, when the outermost hold is released.
+ */
+void statefile_hold(void) {
+    gdata.statefile_hold++;
+}
+
+void statefile_release(void) {
+    if (--gdata.statefile_hold > 0) {
+        return;
+    }
+    gdata.statefile_hold = 0;
+
+    if (gdata.statefile_pending) {
+        write_statefile();
+    }
+    if (gdata.xdcclist_pending) {
+        xdccsavetext();
+    }
+}
+
 void write_statefile(void) {
     char *statefile_tmp, *statefile_bkup;
     int fd;
@@ -181,6 +224,12 @@ void write_statefile(void) {
         return;
     }
 
+    if (gdata.statefile_hold) {
+        gdata.statefile_pending = 1;
+        return;
+    }
+    gdata.statefile_pending = 0;
+
     statefile_tmp = mymalloc(strlen(gdata.statefile) + 5);
     statefile_bkup = mymalloc(strlen(gdata.statefile) + 2);
 
@@ -441,6 +490,11 @@ void write_statefile(void) {
         statefile_item_generic_int_t* g_int;
         statefile_item_generic_float_t* g_float;
         statefile_item_md5sum_info_t* md5sum_info;
+        statefile_item_generic_uint_t* g_uint;
+        statefile_item_sha256_t* sha256;
+        statefile_item_pieces_t* pieces;
+        uint32_t* words;
+        int i;
 
         xd = irlist_get_head(&gdata.xdccs);
 
@@ -465,6 +519,17 @@ void write_statefile(void) {
 
             if (xd->has_md5sum) {
                 length += ceiling(sizeof(statefile_item_md5sum_info_t), 4);
+                if (xd->has_crc32) {
+                    length += sizeof(statefile_item_generic_uint_t);
+                }
+                if (xd->has_sha256) {
+                    length += ceiling(sizeof(statefile_item_sha256_t), 4);
+                }
+            }
+
+            if (xd->pieces.flags) {
+                length += sizeof(statefile_item_pieces_t) +
+                          (xd->pieces.count * sizeof(piece_t));
             }
 
             data = mycalloc(length);
@@ -543,6 +608,51 @@ void write_statefile(void) {
                 md5sum_info->mtime = htonl(xd->mtime);
                 memcpy(md5sum_info->md5sum, xd->md5sum, sizeof(MD5Digest));
                 next = (unsigned char*)(&md5sum_info[1]);
+
+                if (xd->has_crc32) {
+                    /* crc32 */
+                    g_uint = (statefile_item_generic_uint_t*)next;
+                    g_uint->hdr.tag = htonl(STATEFILE_TAG_XDCCS_CRC32);
+                    g_uint->hdr.length = htonl(sizeof(*g_uint));
+                    g_uint->g_uint = htonl(xd->crc32);
+                    next = (unsigned char*)(&g_uint[1]);
+                }
+
+                if (xd->has_sha256) {
+                    /* sha256 */
+                    sha256 = (statefile_item_sha256_t*)next;
+                    sha256->hdr.tag = htonl(STATEFILE_TAG_XDCCS_SHA256);
+                    sha256->hdr.length = htonl(sizeof(*sha256));
+                    memcpy(sha256->sha256, xd->sha256, sizeof(SHA256Digest));
+                    next = (unsigned char*)(&sha256[1]);
+                }
+            }
+
+            if (xd->pieces.flags) {
+                /* piece table */
+                pieces = (statefile_item_pieces_t*)next;
+                pieces->hdr.tag = htonl(STATEFILE_TAG_XDCCS_PIECES);
+                pieces->hdr.length =
+                    htonl(sizeof(*pieces) + xd->pieces.count * sizeof(piece_t));
+                pieces->flags = htonl(xd->pieces.flags);
+                pieces->piece_size = htonl(PIECE_SIZE);
+                pieces->size.upper = htonl(((uint64_t)xd->pieces.size) >> 32);
+                pieces->size.lower = htonl(xd->pieces.size & 0xFFFFFFFF);
+                for (i = 0; i < 4; i++) {
+                    pieces->md5[i] = htonl(xd->pieces.md5[i]);
+                }
+                for (i = 0; i < 8; i++) {
+                    pieces->sha256[i] = htonl(xd->pieces.sha256[i]);
+                }
+                pieces->crc32 = htonl(xd->pieces.crc32);
+                pieces->piece_crc32 = htonl(xd->pieces.piece_crc32);
+                pieces->count = htonl(xd->pieces.count);
+                words = (uint32_t*)(&pieces[1]);
+                for (i = 0; i < xd->pieces.count; i++) {
+                    words[i * 2] = htonl(xd->pieces.piece[i].crc32);
+                    words[(i * 2) + 1] = htonl(xd->pieces.piece[i].crc32_run);
+                }
+                next = (unsigned char*)(&words[i * 2]);
             }
 
             write_statefile_item(&bout, data);
@@ -1106,7 +1216,7 @@ void read_statefile(void) {
             xdcc* xd;
             statefile_hdr_t* ihdr;
 
-            xd = irlist_add(&gdata.xdccs, sizeof(xdcc));
+            xd = xdcc_add();
 
             xd->minspeed = gdata.transferminspeed;
             xd->maxspeed = gdata.transfermaxspeed;
@@ -1227,6 +1337,79 @@ void read_statefile(void) {
                     }
                     break;
 
+                case STATEFILE_TAG_XDCCS_CRC32:
+                    if (ihdr->length == sizeof(statefile_item_generic_uint_t)) {
+                        statefile_item_generic_uint_t* g_uint =
+                            (statefile_item_generic_uint_t*)ihdr;
+                        xd->has_crc32 = 1;
+                        xd->crc32 = ntohl(g_uint->g_uint);
+                    } else {
+                        outerror(OUTERROR_TYPE_WARN,
+                                 "Ignoring Bad XDCC crc32 Tag (len = %d)",
+                                 ihdr->length);
+                    }
+                    break;
+
+                case STATEFILE_TAG_XDCCS_SHA256:
+                    if (ihdr->length == sizeof(statefile_item_sha256_t)) {
+                        statefile_item_sha256_t* sha256 =
+                            (statefile_item_sha256_t*)ihdr;
+                        xd->has_sha256 = 1;
+                        memcpy(xd->sha256, sha256->sha256,
+                               sizeof(SHA256Digest));
+                    } else {
+                        outerror(OUTERROR_TYPE_WARN,
+                                 "Ignoring Bad XDCC sha256 Tag (len = %d)",
+                                 ihdr->length);
+                    }
+                    break;
+
+                case STATEFILE_TAG_XDCCS_PIECES:
+                    if ((ihdr->length >= sizeof(statefile_item_pieces_t)) &&
+                        (ntohl(((statefile_item_pieces_t*)ihdr)->piece_size) ==
+                         PIECE_SIZE) &&
+                        !((ihdr->length - sizeof(statefile_item_pieces_t)) %
+                          sizeof(piece_t)) &&
+                        (((ihdr->length - sizeof(statefile_item_pieces_t)) /
+                          sizeof(piece_t)) ==
+                         ntohl(((statefile_item_pieces_t*)ihdr)->count))) {
+                        statefile_item_pieces_t* pieces =
+                            (statefile_item_pieces_t*)ihdr;
+                        uint32_t* words = (uint32_t*)(&pieces[1]);
+                        int i;
+
+                        mydelete(xd->pieces.piece);
+                        xd->pieces.flags = ntohl(pieces->flags);
+                        xd->pieces.size =
+                            (off_t)((((uint64_t)ntohl(pieces->size.upper))
+                                     << 32) |
+                                    ((uint64_t)ntohl(pieces->size.lower)));
+                        for (i = 0; i < 4; i++) {
+                            xd->pieces.md5[i] = ntohl(pieces->md5[i]);
+                        }
+                        for (i = 0; i < 8; i++) {
+                            xd->pieces.sha256[i] = ntohl(pieces->sha256[i]);
+                        }
+                        xd->pieces.crc32 = ntohl(pieces->crc32);
+                        xd->pieces.piece_crc32 = ntohl(pieces->piece_crc32);
+                        xd->pieces.count = ntohl(pieces->count);
+                        xd->pieces.alloc = xd->pieces.count;
+                        if (xd->pieces.count) {
+                            xd->pieces.piece =
+                                mycalloc(xd->pieces.count * sizeof(piece_t));
+                        }
+                        for (i = 0; i < xd->pieces.count; i++) {
+                            xd->pieces.piece[i].crc32 = ntohl(words[i * 2]);
+                            xd->pieces.piece[i].crc32_run =
+                                ntohl(words[(i * 2) + 1]);
+                        }
+                    } else {
+                        outerror(OUTERROR_TYPE_WARN,
+                                 "Ignoring Bad XDCC pieces Tag (len = %d)",
+                                 ihdr->length);
+                    }
+                    break;
+
                 default:
                     outerror(OUTERROR_TYPE_WARN,
                              "Ignoring Unknown XDCC Tag 0x%X (len=%d)",
@@ -1240,10 +1423,7 @@ void read_statefile(void) {
             if ((!xd->file) || (!xd->desc) || (!xd->note)) {
                 outerror(OUTERROR_TYPE_WARN, "Ignoring Incomplete XDCC Tag");
 
-                mydelete(xd->file);
-                mydelete(xd->desc);
-                mydelete(xd->note);
-                irlist_delete(&gdata.xdccs, xd);
+                xdcc_remove(xd);
             } else {
                 int xfd;
                 xfd = open(xd->file, O_RDONLY);
@@ -1266,8 +1446,7 @@ void read_statefile(void) {
                     xd->st_dev = st.st_dev;
                     xd->st_ino = st.st_ino;
                     xd->mtime = st.st_mtime;
-                    xd->has_md5sum = 0;
-                    memset(xd->md5sum, 0, sizeof(MD5Digest));
+                    xdcc_clear_digest(xd);
                 }
 
                 if (xd->st_size == 0) {
@@ -1283,6 +1462,8 @@ void read_statefile(void) {
                 if (xfd >= 0) {
                     close(xfd);
                 }
+
+                xdcc_index(xd);
             }
         }
 
@@ -1470,6 +1651,14 @@ void read_statefile(void) {
                 (irlist_size(&gdata.xdccs) == 1) ? "" : "s");
     }
 
+    {
+        xdcc* xd;
+        for (xd = irlist_get_head(&gdata.xdccs); xd;
+             xd = irlist_get_next(xd)) {
+            xdcc_dup_link(xd);
+        }
+    }
+
     ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L | OUT_D, COLOR_NO_COLOR, "  [Done]");
 
 error_out:
@@ -34,6 +34,27 @@ void t_initvalues(transfer* const t) {
     t->overlimit = 0;
 }
 
+/*
+ * ask the kernel to read the window the first send will come from while
+ * the offer is still waiting for the client to connect
+ */
+static void t_prefetch(transfer* const t, off_t offset) {
+    if (t->iopack->file_fd == FD_UNUSED) {
+        return; /* t_establishcon() reports the error */
+    }
+
+#if defined(HAVE_POSIX_FADVISE)
+    posix_fadvise(t->iopack->file_fd, offset, IR_PREFETCH_SIZE,
+                  POSIX_FADV_WILLNEED);
+#endif
+
+    if (gdata.debug > 4) {
+        ioutput(CALLTYPE_NORMAL, OUT_S, COLOR_BLUE,
+                "prefetch '%s' offset=0x%.8" PRId64 "X", t->xpack->file,
+                (int64_t)offset);
+    }
+}
+
 void t_setuplisten(transfer* const t) {
     int tempc;
 
@@ -71,6 +92,10 @@ void t_setuplisten(transfer* const t) {
     }
 
     t->tr_status = TRANSFER_STATUS_LISTENING;
+
+    if (fdcache_open(t->iopack) >= 0) {
+        t_prefetch(t, 0);
+    }
 }
 
 void t_establishcon(transfer* const t) {
@@ -110,18 +135,12 @@ void t_establishcon(transfer* const t) {
                 t->clientsocket);
     }
 
-    if (t->xpack->file_fd == FD_UNUSED) {
-        t->xpack->file_fd = open(t->xpack->file, O_RDONLY);
-        if (t->xpack->file_fd < 0) {
-            t->xpack->file_fd = FD_UNUSED;
-            outerror(OUTERROR_TYPE_WARN_LOUD,
-                     "Cant Access Offered File '%s': %s", t->xpack->file,
-                     strerror(errno));
-            t_closeconn(t, "File Error, Report the Problem to the Owner",
-                        errno);
-            return;
-        }
-        t->xpack->file_fd_location = 0;
+    /* normally already opened by t_setuplisten() */
+    if ((t->iopack->file_fd == FD_UNUSED) && (fdcache_open(t->iopack) < 0)) {
+        outerror(OUTERROR_TYPE_WARN_LOUD, "Cant Access Offered File '%s': %s",
+                 t->xpack->file, strerror(errno));
+        t_closeconn(t, "File Error, Report the Problem to the Owner", errno);
+        return;
     }
 
     t->bytessent = t->startresume;
@@ -207,6 +226,29 @@ void t_establishcon(transfer* const t) {
             (t->localip >> 8) & 0xFF, t->localip & 0xFF, t->listenport);
 }
 
+#ifdef HAVE_MMAP
+static void t_release_mmap(transfer* const t) {
+    mmap_info_t* mm = t->mmap_info;
+
+    if (!mm) {
+        return;
+    }
+
+    t->mmap_info = NULL;
+    mm->ref_count--;
+
+    /* keep the head of the file mapped while the fd is cached */
+    if (mm->ref_count || (gdata.fdcache && !mm->mmap_offset)) {
+        return;
+    }
+
+    if (munmap(mm->mmap_ptr, mm->mmap_size) < 0) {
+        outerror(OUTERROR_TYPE_WARN, "Couldn't munmap(): %s", strerror(errno));
+    }
+    irlist_delete(&t->iopack->mmaps, mm);
+}
+#endif
+
 void t_transfersome(transfer* const t) {
     int j;
     int ii;
@@ -246,15 +288,18 @@ void t_transfersome(transfer* const t) {
 
     do {
         attempt = min2(t->tx_bucket - (t->tx_bucket % TXSIZE), BUFFERSIZE);
+        dataptr = NULL; /* stays unset when the kernel sends the file */
 
-        switch (gdata.transfermethod) {
+        /* the block cache sits behind the read/write path */
+        switch (gdata.blockcache_mb ? TRANSFERMETHOD_READ_WRITE
+                                    : gdata.transfermethod) {
 #if defined(HAVE_LINUX_SENDFILE)
         case TRANSFERMETHOD_LINUX_SENDFILE:
 
             offset = t->bytessent;
 
             howmuch =
-                sendfile(t->clientsocket, t->xpack->file_fd, &offset, attempt);
+                sendfile(t->clientsocket, t->iopack->file_fd, &offset, attempt);
 
             if (howmuch < 0 && errno == ENOSYS) {
                 /* sendfile doesn't work on this system, fall back */
@@ -280,7 +325,7 @@ void t_transfersome(transfer* const t) {
 
             offset = t->bytessent;
 
-            j = sendfile(t->xpack->file_fd, t->clientsocket, offset, attempt,
+            j = sendfile(t->iopack->file_fd, t->clientsocket, offset, attempt,
                          &sendfile_header, &offset, 0);
 
             if ((j < 0) && (errno != EAGAIN)) {
@@ -303,21 +348,30 @@ void t_transfersome(transfer* const t) {
         case TRANSFERMETHOD_READ_WRITE:
             dataptr = gdata.sendbuff;
 
-            if (t->xpack->file_fd_location != t->bytessent) {
-                offset = lseek(t->xpack->file_fd, t->bytessent, SEEK_SET);
+            if (gdata.blockcache_mb) {
+                howmuch = blockcache_read(t->iopack, t->bytessent, attempt,
+                                          &dataptr);
+            } else {
+                if (t->iopack->file_fd_location != t->bytessent) {
+                    offset = lseek(t->iopack->file_fd, t->bytessent, SEEK_SET);
+
+                    if (offset != t->bytessent) {
+                        outerror(OUTERROR_TYPE_WARN,
+                                 "Can't seek location in file '%s': %s",
+                                 t->xpack->file, strerror(errno));
+                        t_closeconn(t, "Unable to locate data in file", errno);
+                        return;
+                    }
+                    t->iopack->file_fd_location = t->bytessent;
+                }
+
+                howmuch = read(t->iopack->file_fd, dataptr, attempt);
 
-                if (offset != t->bytessent) {
-                    outerror(OUTERROR_TYPE_WARN,
-                             "Can't seek location in file '%s': %s",
-                             t->xpack->file, strerror(errno));
-                    t_closeconn(t, "Unable to locate data in file", errno);
-                    return;
+                if (howmuch > 0) {
+                    t->iopack->file_fd_location += howmuch;
                 }
-                t->xpack->file_fd_location = t->bytessent;
             }
 
-            howmuch = read(t->xpack->file_fd, dataptr, attempt);
-
             if (howmuch < 0 && errno != EAGAIN) {
                 outerror(OUTERROR_TYPE_WARN,
                          "Can't read data from file '%s': %s", t->xpack->file,
@@ -328,8 +382,6 @@ void t_transfersome(transfer* const t) {
                 goto done;
             }
 
-            t->xpack->file_fd_location += howmuch;
-
             howmuch2 = write(t->clientsocket, dataptr, howmuch);
 
             if (howmuch2 < 0 && errno != EAGAIN) {
@@ -348,25 +400,12 @@ void t_transfersome(transfer* const t) {
             }
             if (!t->mmap_info || (t->bytessent >= (t->mmap_info->mmap_offset +
                                                    t->mmap_info->mmap_size))) {
-                int callval_i;
                 mmap_info_t* mm;
 
-                if (t->mmap_info) {
-                    t->mmap_info->ref_count--;
-                    if (!t->mmap_info->ref_count) {
-                        callval_i = munmap(t->mmap_info->mmap_ptr,
-                                           t->mmap_info->mmap_size);
-                        if (callval_i < 0) {
-                            outerror(OUTERROR_TYPE_WARN,
-                                     "Couldn't munmap(): %s", strerror(errno));
-                        }
-                        irlist_delete(&t->xpack->mmaps, t->mmap_info);
-                    }
-                    t->mmap_info = NULL;
-                }
+                t_release_mmap(t);
 
                 /* see if what we want is already mapped */
-                for (mm = irlist_get_head(&t->xpack->mmaps); mm;
+                for (mm = irlist_get_head(&t->iopack->mmaps); mm;
                      mm = irlist_get_next(mm)) {
                     if (mm->mmap_offset ==
                         (t->bytessent & ~(IR_MMAP_SIZE - 1))) {
@@ -378,7 +417,7 @@ void t_transfersome(transfer* const t) {
 
                 if (!t->mmap_info) {
                     /* nope, add one */
-                    mm = irlist_add(&t->xpack->mmaps, sizeof(mmap_info_t));
+                    mm = irlist_add(&t->iopack->mmaps, sizeof(mmap_info_t));
                     t->mmap_info = mm;
 
                     mm->ref_count++;
@@ -390,10 +429,18 @@ void t_transfersome(transfer* const t) {
 
                     mm->mmap_ptr =
                         mmap(NULL, mm->mmap_size, PROT_READ, MAP_SHARED,
-                             t->xpack->file_fd, mm->mmap_offset);
+                             t->iopack->file_fd, mm->mmap_offset);
+                    if ((mm->mmap_ptr == (unsigned char*)MAP_FAILED) &&
+                        (errno == ENOMEM)) {
+                        /* drop idle mappings and try once more */
+                        fdcache_flush();
+                        mm->mmap_ptr =
+                            mmap(NULL, mm->mmap_size, PROT_READ, MAP_SHARED,
+                                 t->iopack->file_fd, mm->mmap_offset);
+                    }
                     if ((mm->mmap_ptr == (unsigned char*)MAP_FAILED) ||
                         (!mm->mmap_ptr)) {
-                        irlist_delete(&t->xpack->mmaps, mm);
+                        irlist_delete(&t->iopack->mmaps, mm);
                         t->mmap_info = NULL;
                         if (errno == ENOMEM) {
                             /* mmap doesn't work on this system, fall back */
@@ -454,6 +501,10 @@ void t_transfersome(transfer* const t) {
             t->lastcontact = gdata.curtime;
         }
 
+        if (dataptr && (howmuch2 > 0)) {
+            streamhash_feed(t->xpack, t->bytessent, dataptr, howmuch2);
+        }
+
         t->bytessent += howmuch2;
         gdata.xdccsent[gdata.curtime % XDCC_SENT_SIZE] += howmuch2;
         t->tx_bucket -= howmuch2;
@@ -480,20 +531,7 @@ done:
 
     if (t->bytessent >= t->xpack->st_size) {
 #ifdef HAVE_MMAP
-        if (t->mmap_info) {
-            t->mmap_info->ref_count--;
-            if (!t->mmap_info->ref_count) {
-                int callval_i;
-                callval_i =
-                    munmap(t->mmap_info->mmap_ptr, t->mmap_info->mmap_size);
-                if (callval_i < 0) {
-                    outerror(OUTERROR_TYPE_WARN, "Couldn't munmap(): %s",
-                             strerror(errno));
-                }
-                irlist_delete(&t->xpack->mmaps, t->mmap_info);
-            }
-            t->mmap_info = NULL;
-        }
+        t_release_mmap(t);
 #endif
 
         t->tr_status = TRANSFER_STATUS_WAITING;
@@ -608,15 +646,20 @@ void t_flushed(transfer* const t) {
                 ((float)timetookms / 1000.0));
 
     if (!gdata.quietmode) {
-        if (t->xpack->has_md5sum) {
+        digest_t digest;
+        digest_from_xdcc(&digest, t->xpack);
+        if (digest.flags) {
+            char* digeststr = mycalloc(maxtextlength);
+            digest_print(digeststr, maxtextlength, &digest);
             notice(t->nick,
                    "** Transfer Completed (%" PRId64
-                   "i KB,%s, %0.1f KB/sec, md5sum: " MD5_PRINT_FMT ")",
+                   "i KB,%s, %0.1f KB/sec, %s)",
                    (int64_t)(t->xpack->st_size - t->startresume) / 1024,
                    tempstr,
                    ((float)(t->xpack->st_size - t->startresume)) / 1024.0 /
                        ((float)timetookms / 1000.0),
-                   MD5_PRINT_DATA(t->xpack->md5sum));
+                   digeststr);
+            mydelete(digeststr);
         } else {
             notice(t->nick,
                    "** Transfer Completed (%" PRIu64 "i KB,%s, %0.1f KB/sec)",
@@ -647,14 +690,10 @@ void t_flushed(transfer* const t) {
      */
     shutdown(t->clientsocket, SHUT_RDWR);
     close(t->clientsocket);
-    t->xpack->file_fd_count--;
-    if (!t->xpack->file_fd_count && (t->xpack->file_fd != FD_UNUSED)) {
-        close(t->xpack->file_fd);
-        t->xpack->file_fd = FD_UNUSED;
-        t->xpack->file_fd_location = 0;
-    }
+    fdcache_release(t->iopack);
     t->tr_status = TRANSFER_STATUS_DONE;
     t->xpack->gets++;
+    xdcc_dirty(t->xpack);
 
     mydelete(tempstr);
 }
@@ -681,19 +720,7 @@ void t_closeconn(transfer* const t, const char* msg, int errno1) {
     }
 
 #ifdef HAVE_MMAP
-    if (t->mmap_info) {
-        t->mmap_info->ref_count--;
-        if (!t->mmap_info->ref_count) {
-            int callval_i;
-            callval_i = munmap(t->mmap_info->mmap_ptr, t->mmap_info->mmap_size);
-            if (callval_i < 0) {
-                outerror(OUTERROR_TYPE_WARN, "Couldn't munmap(): %s",
-                         strerror(errno));
-            }
-            irlist_delete(&t->xpack->mmaps, t->mmap_info);
-        }
-        t->mmap_info = NULL;
-    }
+    t_release_mmap(t);
 #endif
 
     if (t->listensocket != FD_UNUSED && t->listensocket > 2) {
@@ -713,12 +740,7 @@ void t_closeconn(transfer* const t, const char* msg, int errno1) {
         close(t->clientsocket);
         t->clientsocket = FD_UNUSED;
     }
-    t->xpack->file_fd_count--;
-    if (!t->xpack->file_fd_count && (t->xpack->file_fd != FD_UNUSED)) {
-        close(t->xpack->file_fd);
-        t->xpack->file_fd = FD_UNUSED;
-        t->xpack->file_fd_location = 0;
-    }
+    fdcache_release(t->iopack);
 
     t->tr_status = TRANSFER_STATUS_DONE;
 
@@ -731,9 +753,29 @@ void t_closeconn(transfer* const t, const char* msg, int errno1) {
 }
 
 void t_setresume(transfer* const t, const char* amt) {
+    const piecetable_t* pt;
+    off_t offset;
+    int n;
+
     updatecontext();
 
     t->startresume = (off_t)atoull(amt);
+
+    /* the head window was already requested by t_setuplisten() */
+    offset = t->startresume & ~(IR_PREFETCH_SIZE - 1);
+    if (offset > 0) {
+        t_prefetch(t, offset);
+    }
+
+    /* the piece table has the crc32 of the data already received */
+    pt = &t->xpack->pieces;
+    n = min2(t->startresume / PIECE_SIZE, pt->count);
+    if (!gdata.quietmode && (n > 0) && t->xpack->has_md5sum &&
+        (digest_wanted() & DIGEST_CRC32)) {
+        notice(t->nick,
+               "** Resume check: crc32 of the first %" PRId64 "i bytes is %08X",
+               (int64_t)n * PIECE_SIZE, pt->piece[n - 1].crc32_run);
+    }
 }
 
 void t_remind(transfer* const t) {
@@ -832,3 +874,146 @@ void t_checkminspeed(transfer* const t) {
         write_statefile();
     }
 }
+
+
+/*
+ * pack file descriptor cache
+ *
+ * Pack files stay open after their last transfer finishes so that the
+ * next request does not pay for open() and a cold readahead again.  Idle
+ * descriptors are closed least recently used first once there are more
+ * than 'fdcache' of them, or when they would eat into the descriptors
+ * reserved for transfers (MAXTRANS).  Idle packs are kept on
+ * gdata.fdcache_lru in the order they became idle.
+ */
+
+#ifdef HAVE_MMAP
+static void fdcache_unmap_idle(xdcc* const xpack) {
+    mmap_info_t* mm;
+
+    mm = irlist_get_head(&xpack->mmaps);
+    while (mm) {
+        if (mm->ref_count) {
+            mm = irlist_get_next(mm);
+            continue;
+        }
+        if (munmap(mm->mmap_ptr, mm->mmap_size) < 0) {
+            outerror(OUTERROR_TYPE_WARN, "Couldn't munmap(): %s",
+                     strerror(errno));
+        }
+        mm = irlist_delete(&xpack->mmaps, mm);
+    }
+}
+#endif
+
+int fdcache_open(xdcc* const xpack) {
+    updatecontext();
+
+    xpack->file_fd_lastused = gdata.curtimems;
+
+    if (xpack->file_fd != FD_UNUSED) {
+        gdata.fdcache_hits++;
+        return 0;
+    }
+
+    gdata.fdcache_misses++;
+    fdcache_trim();
+
+    xpack->file_fd = open(xpack->file, O_RDONLY);
+    if ((xpack->file_fd < 0) && ((errno == EMFILE) || (errno == ENFILE))) {
+        fdcache_flush();
+        xpack->file_fd = open(xpack->file, O_RDONLY);
+    }
+
+    if (xpack->file_fd < 0) {
+        xpack->file_fd = FD_UNUSED;
+        return -1;
+    }
+
+    xpack->file_fd_location = 0;
+    fdcache_update(xpack);
+    return 0;
+}
+
+/* a transfer starts reading the pack */
+void fdcache_use(xdcc* const xpack) {
+    xpack->file_fd_count++;
+    fdcache_update(xpack);
+}
+
+/* puts the pack on gdata.fdcache_lru while its fd is open but unused */
+void fdcache_update(xdcc* const xpack) {
+    int idle = (xpack->file_fd != FD_UNUSED) && !xpack->file_fd_count;
+
+    if (idle && !xpack->fdcache_idle) {
+        xpack->fdcache_idle = irlist_add(&gdata.fdcache_lru, sizeof(xdcc*));
+        *xpack->fdcache_idle = xpack;
+    } else if (!idle && xpack->fdcache_idle) {
+        irlist_delete(&gdata.fdcache_lru, xpack->fdcache_idle);
+        xpack->fdcache_idle = NULL;
+    }
+}
+
+void fdcache_release(xdcc* const xpack) {
+    updatecontext();
+
+    xpack->file_fd_count--;
+
+    if (!xpack->file_fd_count) {
+        xpack->file_fd_lastused = gdata.curtimems;
+        xdcc_dup_link(xpack);
+        fdcache_update(xpack);
+        fdcache_trim();
+    }
+}
+
+void fdcache_drop(xdcc* const xpack) {
+    updatecontext();
+
+    if (xpack->file_fd_count) {
+        return; /* still in use */
+    }
+
+#ifdef HAVE_MMAP
+    fdcache_unmap_idle(xpack);
+#endif
+
+    if (xpack->file_fd != FD_UNUSED) {
+        if (gdata.debug > 0) {
+            ioutput(CALLTYPE_NORMAL, OUT_S, COLOR_YELLOW,
+                    "fdcache: closing '%s' (fd %d)", xpack->file,
+                    xpack->file_fd);
+        }
+        close(xpack->file_fd);
+        xpack->file_fd = FD_UNUSED;
+        xpack->file_fd_location = 0;
+        fdcache_update(xpack);
+    }
+}
+
+void fdcache_trim(void) {
+    xdcc** oldest;
+    int limit;
+
+    updatecontext();
+
+    limit = max2(0, min2(gdata.fdcache, MAXTRANS - irlist_size(&gdata.trans)));
+
+    while (irlist_size(&gdata.fdcache_lru) > limit) {
+        oldest = irlist_get_head(&gdata.fdcache_lru);
+        fdcache_drop(*oldest);
+    }
+}
+
+void fdcache_flush(void) {
+    xdcc* xd;
+
+    updatecontext();
+
+    for (xd = irlist_get_head(&gdata.xdccs); xd; xd = irlist_get_next(xd)) {
+#ifdef HAVE_MMAP
+        fdcache_unmap_idle(xd);
+#endif
+        fdcache_drop(xd);
+    }
+}
@@ -29,9 +29,39 @@ void l_initvalues(upload* const l) {
     l->ul_status = UPLOAD_STATUS_UNUSED;
     l->clientsocket = FD_UNUSED;
     l->filedescriptor = FD_UNUSED;
+    l->splice_pipe[0] = l->splice_pipe[1] = FD_UNUSED;
+    l->hash_pipe[0] = l->hash_pipe[1] = FD_UNUSED;
     l->lastcontact = gdata.curtime;
 }
 
+static void l_closepipe(upload* const l) {
+    if (l->splice_pipe[0] != FD_UNUSED) {
+        close(l->splice_pipe[0]);
+        close(l->splice_pipe[1]);
+        l->splice_pipe[0] = l->splice_pipe[1] = FD_UNUSED;
+    }
+    if (l->hash_pipe[0] != FD_UNUSED) {
+        close(l->hash_pipe[0]);
+        close(l->hash_pipe[1]);
+        l->hash_pipe[0] = l->hash_pipe[1] = FD_UNUSED;
+    }
+}
+
+#if defined(HAVE_SPLICE)
+static int l_openpipe(int* const p) {
+    if (pipe(p) < 0) {
+        outerror(OUTERROR_TYPE_WARN, "Couldn't create splice pipe: %s",
+                 strerror(errno));
+        p[0] = p[1] = FD_UNUSED;
+        return -1;
+    }
+#if defined(F_SETPIPE_SZ)
+    fcntl(p[1], F_SETPIPE_SZ, UPLOAD_BUFFERSIZE);
+#endif
+    return 0;
+}
+#endif
+
 void l_establishcon(upload* const l) {
     socklen_t addrlen;
     int retval;
@@ -63,7 +93,8 @@ void l_establishcon(upload* const l) {
             mydelete(fullfile);
             return;
         } else {
-            l->filedescriptor = open(fullfile, O_WRONLY | O_APPEND);
+            /* read access for hashing the resumed prefix */
+            l->filedescriptor = open(fullfile, O_RDWR);
 
             if (l->filedescriptor >= 0) {
                 l->resumesize = l->bytesgot = s.st_size;
@@ -90,6 +121,54 @@ void l_establishcon(upload* const l) {
 
     mydelete(fullfile);
 
+    /* no O_APPEND on resume, splice() refuses to write to such files */
+    if (lseek(l->filedescriptor, l->bytesgot, SEEK_SET) < 0) {
+        l_closeconn(l, "File Error, File couldn't be opened for writing",
+                    errno);
+        return;
+    }
+
+    l->flushed = l->writeback = l->synced = l->bytesgot;
+    l->lastack = l->bytesgot;
+    l->lastacktime = gdata.curtime;
+    l->ack_len = 0;
+
+    /* a resumed prefix is read back, everything else hashed as it arrives */
+    memset(&l->digest, 0, sizeof(digest_t));
+    l->completed = 0;
+    if (gdata.nomd5sum) {
+        l->md5_done = -1;
+    } else {
+        l->md5_done = 0;
+        digest_init(&l->hash, digest_wanted());
+    }
+
+#if defined(HAVE_FALLOCATE)
+    /* reserve the space up front, without changing the size for resume */
+    if ((l->totalsize > l->bytesgot) &&
+        (fallocate(l->filedescriptor, FALLOC_FL_KEEP_SIZE, l->bytesgot,
+                   l->totalsize - l->bytesgot) < 0) &&
+        ((errno == ENOSPC) || (errno == EFBIG))) {
+        l_closeconn(l, "File Error, Not enough space for the file", errno);
+        return;
+    }
+#endif
+
+#if defined(HAVE_SPLICE)
+    /* spliced data is hashed from a tee() of the pipe */
+    if (gdata.uploadsplice && (l_openpipe(l->splice_pipe) == 0) &&
+        (l->md5_done >= 0) && (l_openpipe(l->hash_pipe) < 0)) {
+        l_closepipe(l);
+    }
+#endif
+
+    l->buffer_len = 0;
+    l->wlen = 0;
+    if (l->splice_pipe[0] == FD_UNUSED) {
+        l->buffer = mymalloc(UPLOAD_BUFFERSIZE);
+        l_writer_start();
+    }
+
     l->clientsocket = socket(AF_INET, SOCK_STREAM, 0);
     if (l->clientsocket < 0) {
         l_closeconn(l, "Socket Error", errno);
@@ -140,49 +219,635 @@ void l_establishcon(upload* const l) {
 }
 
 
+/*
+ * Full buffers are written out by one writer thread shared by all
+ * uploads.  l_submit() swaps the full buffer with the upload's second one
+ * and queues it, so the main loop keeps reading into the other buffer and
+ * only stops reading an upload while both are full.  The writer starts
+ * writeback of each chunk with sync_file_range() and waits for the
+ * previous one, dirty pages never pile up and nothing big is left for the
+ * kernel to flush when the upload is closed.  Without pthreads the chunk
+ * is written from the main loop.
+ */
+
+/* write a chunk at l->flushed and write it behind, returns an errno */
+static int l_writechunk(upload* const l, const unsigned char* buf,
+                        size_t len) {
+    size_t done;
+    ssize_t howmuch;
+
+    for (done = 0; done < len; done += howmuch) {
+        howmuch = write(l->filedescriptor, buf + done, len - done);
+        if ((howmuch < 0) && (errno == EINTR)) {
+            howmuch = 0;
+        } else if (howmuch < 0) {
+            return errno;
+        }
+    }
+
+#if defined(HAVE_SYNC_FILE_RANGE)
+    sync_file_range(l->filedescriptor, l->flushed, len,
+                    SYNC_FILE_RANGE_WRITE);
+
+    if (l->flushed > l->synced) {
+        sync_file_range(l->filedescriptor, l->synced, l->flushed - l->synced,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER);
+        l->synced = l->flushed;
+    }
+#endif
+
+    return 0;
+}
+
+#ifdef HAVE_PTHREAD
+static void* l_writer(void* arg) {
+    upload* l;
+    sigset_t ss;
+    int error;
+    char c = 0;
+
+    /* signals are for the main thread */
+    sigfillset(&ss);
+    pthread_sigmask(SIG_BLOCK, &ss, NULL);
+
+    pthread_mutex_lock(&gdata.upwriter.lock);
+
+    while (1) {
+        l = gdata.upwriter.head;
+
+        if (!l) {
+            if (gdata.upwriter.exiting) {
+                break;
+            }
+            pthread_cond_wait(&gdata.upwriter.work, &gdata.upwriter.lock);
+            continue;
+        }
+
+        gdata.upwriter.head = l->wnext;
+        if (!gdata.upwriter.head) {
+            gdata.upwriter.tail = NULL;
+        }
+
+        pthread_mutex_unlock(&gdata.upwriter.lock);
+
+        error = l_writechunk(l, l->wbuffer, l->wlen);
+
+        pthread_mutex_lock(&gdata.upwriter.lock);
+        l->werrno = error;
+        l->wdone = 1;
+        pthread_cond_broadcast(&gdata.upwriter.done);
+        write(gdata.upwriter.wake[1], &c, 1);
+    }
+
+    pthread_mutex_unlock(&gdata.upwriter.lock);
+
+    return arg;
+}
+#endif
+
+/* started with the first upload, without pthreads there is none */
+void l_writer_start(void) {
+#ifdef HAVE_PTHREAD
+    int retval;
+
+    updatecontext();
+
+    if (gdata.upwriter.running) {
+        return;
+    }
+
+    if (pipe(gdata.upwriter.wake) < 0) {
+        outerror(OUTERROR_TYPE_WARN, "Couldn't create upload writer pipe: %s",
+                 strerror(errno));
+        return;
+    }
+    set_socket_nonblocking(gdata.upwriter.wake[0], 1);
+    set_socket_nonblocking(gdata.upwriter.wake[1], 1);
+
+    pthread_mutex_init(&gdata.upwriter.lock, NULL);
+    pthread_cond_init(&gdata.upwriter.work, NULL);
+    pthread_cond_init(&gdata.upwriter.done, NULL);
+    gdata.upwriter.head = gdata.upwriter.tail = NULL;
+    gdata.upwriter.exiting = 0;
+
+    retval = pthread_create(&gdata.upwriter.thread, NULL, l_writer, NULL);
+    if (retval) {
+        outerror(OUTERROR_TYPE_WARN, "Couldn't start upload writer: %s",
+                 strerror(retval));
+        pthread_cond_destroy(&gdata.upwriter.done);
+        pthread_cond_destroy(&gdata.upwriter.work);
+        pthread_mutex_destroy(&gdata.upwriter.lock);
+        close(gdata.upwriter.wake[0]);
+        close(gdata.upwriter.wake[1]);
+        return;
+    }
+
+    gdata.upwriter.running = 1;
+#endif
+}
+
+/* all uploads are closed */
+void l_writer_stop(void) {
+#ifdef HAVE_PTHREAD
+    updatecontext();
+
+    if (!gdata.upwriter.running) {
+        return;
+    }
+
+    pthread_mutex_lock(&gdata.upwriter.lock);
+    gdata.upwriter.exiting = 1;
+    pthread_cond_broadcast(&gdata.upwriter.work);
+    pthread_mutex_unlock(&gdata.upwriter.lock);
+
+    pthread_join(gdata.upwriter.thread, NULL);
+
+    pthread_cond_destroy(&gdata.upwriter.done);
+    pthread_cond_destroy(&gdata.upwriter.work);
+    pthread_mutex_destroy(&gdata.upwriter.lock);
+    close(gdata.upwriter.wake[0]);
+    close(gdata.upwriter.wake[1]);
+    gdata.upwriter.running = 0;
+#endif
+}
+
+/* a resumed prefix is still being hashed, received data has to wait */
+int l_md5behind(upload* const l) {
+    return (l->md5_done >= 0) && (l->md5_done < l->resumesize);
+}
+
+/*
+ * hash the next piece of a resumed prefix, read back from the file into
+ * wbuffer, which is idle until the first buffer is handed on.  that is
+ * the only data read back, received data is hashed before it is written
+ */
+void l_md5prefix(upload* const l) {
+    ssize_t howmuch;
+
+    updatecontext();
+
+    if (!l_md5behind(l)) {
+        return;
+    }
+
+    if (!l->wbuffer) {
+        l->wbuffer = mymalloc(UPLOAD_BUFFERSIZE);
+    }
+
+    howmuch = pread(l->filedescriptor, l->wbuffer,
+                    min2(UPLOAD_BUFFERSIZE, l->resumesize - l->md5_done),
+                    l->md5_done);
+    if ((howmuch < 0) && (errno == EINTR)) {
+        return;
+    } else if (howmuch <= 0) {
+        outerror(OUTERROR_TYPE_WARN, "[MD5]: Can't read back upload '%s': %s",
+                 l->file, howmuch ? strerror(errno) : "short file");
+        l->md5_done = -1;
+        return;
+    }
+
+    digest_update(&l->hash, l->wbuffer, howmuch);
+    l->md5_done += howmuch;
+
+    /* the sender waits for us meanwhile */
+    l->lastcontact = gdata.curtime;
+}
+
+/* take back wbuffer once the writer is done, -1 with errno if it failed */
+static int l_writedone(upload* const l) {
+    if (!l->wlen) {
+        return 0;
+    }
+
+#ifdef HAVE_PTHREAD
+    pthread_mutex_lock(&gdata.upwriter.lock);
+    if (!l->wdone) {
+        pthread_mutex_unlock(&gdata.upwriter.lock);
+        return 0;
+    }
+    pthread_mutex_unlock(&gdata.upwriter.lock);
+#endif
+
+    if (l->werrno) {
+        l->wlen = 0;
+        errno = l->werrno;
+        return -1;
+    }
+
+    l->flushed += l->wlen;
+    l->wlen = 0;
+    return 0;
+}
+
+/* hand the buffer on, left in place while the writer has the other one */
+static int l_submit(upload* const l) {
+    unsigned char* full;
+    int error;
+
+    if (l_writedone(l) < 0) {
+        return -1;
+    }
+
+    if (l->wlen || !l->buffer_len || l_md5behind(l)) {
+        return 0;
+    }
+
+    if (l->md5_done >= 0) {
+        digest_update(&l->hash, l->buffer, l->buffer_len);
+        l->md5_done += l->buffer_len;
+    }
+
+#ifdef HAVE_PTHREAD
+    if (gdata.upwriter.running) {
+        if (!l->wbuffer) {
+            l->wbuffer = mymalloc(UPLOAD_BUFFERSIZE);
+        }
+        full = l->buffer;
+        l->buffer = l->wbuffer;
+        l->wbuffer = full;
+        l->wlen = l->buffer_len;
+        l->buffer_len = 0;
+
+        pthread_mutex_lock(&gdata.upwriter.lock);
+        l->wdone = 0;
+        l->werrno = 0;
+        l->wnext = NULL;
+        if (gdata.upwriter.tail) {
+            gdata.upwriter.tail->wnext = l;
+        } else {
+            gdata.upwriter.head = l;
+        }
+        gdata.upwriter.tail = l;
+        pthread_cond_signal(&gdata.upwriter.work);
+        pthread_mutex_unlock(&gdata.upwriter.lock);
+        return 0;
+    }
+#endif
+
+    full = l->buffer;
+    error = l_writechunk(l, full, l->buffer_len);
+    if (error) {
+        l->buffer_len = 0;
+        errno = error;
+        return -1;
+    }
+
+    l->flushed += l->buffer_len;
+    l->buffer_len = 0;
+    return 0;
+}
+
+/* write out everything that was received, waits for the writer */
+int l_flush(upload* const l) {
+    updatecontext();
+
+#ifdef HAVE_PTHREAD
+    if (l->wlen) {
+        pthread_mutex_lock(&gdata.upwriter.lock);
+        while (!l->wdone) {
+            pthread_cond_wait(&gdata.upwriter.done, &gdata.upwriter.lock);
+        }
+        pthread_mutex_unlock(&gdata.upwriter.lock);
+    }
+#endif
+
+    if (l_writedone(l) < 0) {
+        return -1;
+    }
+
+    if (l->buffer_len) {
+        errno = l_writechunk(l, l->buffer, l->buffer_len);
+        if (errno) {
+            l->buffer_len = 0;
+            return -1;
+        }
+        l->flushed += l->buffer_len;
+        l->buffer_len = 0;
+    }
+
+    return 0;
+}
+
+/* add a finished upload as a pack, it already has its digests */
+static void l_autoadd(upload* const l) {
+    userinput* uadd;
+    char* tempstr;
+    struct stat st;
+    xdcc* xd;
+    int packs;
+
+    updatecontext();
+
+    packs = irlist_size(&gdata.xdccs);
+
+    tempstr = mymalloc(strlen(gdata.uploaddir) + strlen(l->file) + 16);
+    sprintf(tempstr, "A A A A A add %s/%s", gdata.uploaddir, l->file);
+
+    uadd = mycalloc(sizeof(userinput));
+    u_fillwith_msg(uadd, NULL, tempstr);
+    uadd->method = method_out_all; /* just OUT_S|OUT_L|OUT_D it */
+    u_parseit(uadd);
+    mydelete(uadd);
+    mydelete(tempstr);
+
+    xd = irlist_get_tail(&gdata.xdccs);
+
+    if (l->digest.flags && (irlist_size(&gdata.xdccs) > packs) &&
+        (fstat(l->filedescriptor, &st) == 0) && (xd->st_dev == st.st_dev) &&
+        (xd->st_ino == st.st_ino) && (xd->st_size == st.st_size)) {
+        digest_to_xdcc(&l->digest, xd);
+        xdcc_dup_link(xd);
+        write_statefile();
+    }
+}
+
+/* all of a completed upload is in the file: final digests, add the pack */
+static void l_complete(upload* const l) {
+    char* tempstr;
+
+    updatecontext();
+
+    if (l->md5_done == l->bytesgot) {
+        digest_final(&l->hash, &l->digest);
+        digest_free(&l->hash);
+        tempstr = mycalloc(maxtextlength);
+        digest_print(tempstr, maxtextlength, &l->digest);
+        ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L | OUT_D, COLOR_NO_COLOR,
+                "[MD5]: Upload %s %s", l->file, tempstr);
+        mydelete(tempstr);
+    }
+
+    l->completed = 1;
+
+    if (gdata.uploadautoadd) {
+        l_autoadd(l);
+    }
+}
+
+/* called every loop: take back written buffers, hand on a ready one */
+void l_writesome(upload* const l) {
+    updatecontext();
+
+    if ((l_writedone(l) < 0) ||
+        (((l->buffer_len == UPLOAD_BUFFERSIZE) ||
+          (l->bytesgot >= l->totalsize)) &&
+         (l_submit(l) < 0))) {
+        l_closeconn(l, "Unable to write data to file", errno);
+        return;
+    }
+
+    if ((l->ul_status == UPLOAD_STATUS_WAITING) && !l->completed &&
+        !l->wlen && !l->buffer_len && !l_md5behind(l)) {
+        l_complete(l);
+    }
+}
+
+#if defined(HAVE_SPLICE)
+/*
+ * spliced data goes from the pipe into the file on the main loop, so only
+ * SYNC_FILE_RANGE_WRITE is used for it: that queues the writeback and
+ * returns, waiting for the disk here would stall every transfer
+ */
+static void l_writebehind(upload* const l) {
+#if defined(HAVE_SYNC_FILE_RANGE)
+    if (((l->flushed - l->writeback) < UPLOAD_BUFFERSIZE) &&
+        (l->flushed < l->totalsize)) {
+        return;
+    }
+
+    sync_file_range(l->filedescriptor, l->writeback,
+                    l->flushed - l->writeback, SYNC_FILE_RANGE_WRITE);
+
+    l->writeback = l->flushed;
+#endif
+}
+
+/*
+ * hash the teed bytes from hash_pipe, returns how many to move on into the
+ * file.  if tee() failed hashing stops and all len bytes move on
+ */
+static size_t l_md5pipe(upload* const l, ssize_t teed, size_t len) {
+    ssize_t howmuch;
+    size_t left;
+
+    if (teed <= 0) {
+        outerror(OUTERROR_TYPE_WARN, "[MD5]: Can't tee upload '%s': %s",
+                 l->file, teed ? strerror(errno) : "empty pipe");
+        l->md5_done = -1;
+        return len;
+    }
+
+    if (!l->wbuffer) {
+        l->wbuffer = mymalloc(UPLOAD_BUFFERSIZE);
+    }
+
+    for (left = teed; left; left -= howmuch) {
+        howmuch = read(l->hash_pipe[0], l->wbuffer,
+                       min2(left, UPLOAD_BUFFERSIZE));
+        if ((howmuch < 0) && (errno == EINTR)) {
+            howmuch = 0;
+        } else if (howmuch <= 0) {
+            outerror(OUTERROR_TYPE_WARN, "[MD5]: Can't tee upload '%s': %s",
+                     l->file, howmuch ? strerror(errno) : "empty pipe");
+            l->md5_done = -1;
+            break;
+        }
+        if (l->md5_done >= 0) {
+            digest_update(&l->hash, l->wbuffer, howmuch);
+            l->md5_done += howmuch;
+        }
+    }
+
+    return teed;
+}
+
+/* move len bytes that were spliced from the socket on into the file */
+static int l_drainpipe(upload* const l, size_t len) {
+    ssize_t howmuch;
+    size_t chunk;
+
+    while (len) {
+        chunk = len;
+        if ((l->md5_done >= 0) && (l->hash_pipe[0] != FD_UNUSED)) {
+            /* a copy of the front of the pipe, nothing is consumed */
+            howmuch = tee(l->splice_pipe[0], l->hash_pipe[1], len,
+                          SPLICE_F_NONBLOCK);
+            if ((howmuch < 0) && (errno == EINTR)) {
+                continue;
+            }
+            chunk = l_md5pipe(l, howmuch, len);
+        }
+
+        while (chunk) {
+            howmuch = splice(l->splice_pipe[0], NULL, l->filedescriptor,
+                             NULL, chunk, SPLICE_F_MOVE);
+            if ((howmuch < 0) && (errno == EINTR)) {
+                continue;
+            } else if (howmuch < 0) {
+                return -1;
+            } else if (howmuch == 0) {
+                errno = EIO;
+                return -1;
+            }
+            chunk -= howmuch;
+            len -= howmuch;
+            l->flushed += howmuch;
+        }
+    }
+
+    l_writebehind(l);
+
+    return 0;
+}
+#endif
+
+/* bytes uploads may still receive in the current window, -1 if unlimited */
+long l_recvbudget(void) {
+    long j;
+
+    if (!gdata.uploadmaxspeed) {
+        return -1;
+    }
+
+    j = gdata.xdccrecv[(gdata.curtime) % XDCC_SENT_SIZE] +
+        gdata.xdccrecv[(gdata.curtime - 1) % XDCC_SENT_SIZE] +
+        gdata.xdccrecv[(gdata.curtime - 2) % XDCC_SENT_SIZE] +
+        gdata.xdccrecv[(gdata.curtime - 3) % XDCC_SENT_SIZE];
+
+    return max2(0, (long)gdata.uploadmaxspeed * 1024 - j);
+}
+
+/*
+ * send the ack for bytesgot, the socket is non-blocking so an ack may go out
+ * in pieces: the unsent rest is kept in ack and retried from the write set,
+ * lastack only moves once all 4 bytes are out.  returns -1 if the
+ * connection was lost
+ */
+int l_sendack(upload* const l) {
+    uint32_t g;
+    ssize_t howmuch;
+
+    while (l->ack_len || (l->lastack != l->bytesgot)) {
+        if (!l->ack_len) {
+            g = htonl((uint32_t)l->bytesgot);
+            memcpy(l->ack, &g, sizeof(l->ack));
+            l->ack_len = sizeof(l->ack);
+            l->ack_pos = l->bytesgot;
+        }
+
+        howmuch = write(l->clientsocket,
+                        l->ack + sizeof(l->ack) - l->ack_len, l->ack_len);
+        if ((howmuch < 0) &&
+            ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) {
+            break; /* rest goes out from the write set */
+        } else if (howmuch < 0) {
+            l_closeconn(l, "Connection Lost", errno);
+            return -1;
+        }
+
+        l->ack_len -= howmuch;
+        if (!l->ack_len) {
+            l->lastack = l->ack_pos;
+            l->lastacktime = gdata.curtime;
+        }
+    }
+
+    return 0;
+}
+
 void l_transfersome(upload* const l) {
-    int i, howmuch, howmuch2;
-    unsigned long g;
+    int i;
+    ssize_t howmuch;
+    size_t attempt;
+    long budget;
     off_t mysize;
 
     updatecontext();
 
-    howmuch = BUFFERSIZE;
-    howmuch2 = 1;
-    for (i = 0; i < MAXTXPERLOOP; i++) {
-        if ((howmuch == BUFFERSIZE && howmuch2 > 0) &&
-            is_fd_readable(l->clientsocket)) {
-            howmuch = read(l->clientsocket, gdata.sendbuff, BUFFERSIZE);
-            if (howmuch < 0) {
-                l_closeconn(l, "Connection Lost", errno);
-                return;
-            } else if (howmuch < 1) {
-                l_closeconn(l, "Connection Lost", 0);
-                return;
+    budget = l_recvbudget();
+
+    for (i = 0; (i < MAXTXPERLOOP) && budget; i++) {
+#if defined(HAVE_SPLICE)
+        if (l->splice_pipe[0] != FD_UNUSED) {
+            if (l_md5behind(l)) {
+                break; /* nowhere to keep it until the prefix is hashed */
+            }
+            attempt = UPLOAD_BUFFERSIZE;
+            if (budget > 0) {
+                attempt = min2(attempt, (size_t)budget);
             }
+            howmuch = splice(l->clientsocket, NULL, l->splice_pipe[1], NULL,
+                             attempt, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else
+#endif
+        {
+            if (l->buffer_len == UPLOAD_BUFFERSIZE) {
+                break; /* full until the writer is done with the other one */
+            }
+            attempt = UPLOAD_BUFFERSIZE - l->buffer_len;
+            if (budget > 0) {
+                attempt = min2(attempt, (size_t)budget);
+            }
+            howmuch = read(l->clientsocket, l->buffer + l->buffer_len, attempt);
+        }
+
+        if ((howmuch < 0) &&
+            ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR))) {
+            break; /* socket drained */
+        } else if (howmuch < 0) {
+            l_closeconn(l, "Connection Lost", errno);
+            return;
+        } else if (howmuch < 1) {
+            l_closeconn(l, "Connection Lost", 0);
+            return;
+        }
 
-            howmuch2 = write(l->filedescriptor, gdata.sendbuff, howmuch);
-            if (howmuch2 != howmuch) {
+        l->lastcontact = gdata.curtime;
+        l->bytesgot += howmuch;
+        gdata.xdccrecv[gdata.curtime % XDCC_SENT_SIZE] += howmuch;
+        if (budget > 0) {
+            budget -= howmuch;
+        }
+
+#if defined(HAVE_SPLICE)
+        if (l->splice_pipe[0] != FD_UNUSED) {
+            if (l_drainpipe(l, howmuch) < 0) {
                 l_closeconn(l, "Unable to write data to file", errno);
                 return;
             }
-
-            if (howmuch > 0) {
-                l->lastcontact = gdata.curtime;
+        } else
+#endif
+        {
+            l->buffer_len += howmuch;
+
+            if ((l->buffer_len == UPLOAD_BUFFERSIZE) ||
+                (l->bytesgot >= l->totalsize)) {
+                if (l_submit(l) < 0) {
+                    l_closeconn(l, "Unable to write data to file", errno);
+                    return;
+                }
             }
+        }
 
-            l->bytesgot += howmuch2;
-            gdata.xdccsent[gdata.curtime % XDCC_SENT_SIZE] += howmuch2;
+        if (gdata.debug > 4) {
+            ioutput(CALLTYPE_NORMAL, OUT_S, COLOR_BLUE,
+                    "Read %zd Buffered %zu Flushed %" PRId64 "d", howmuch,
+                    l->buffer_len, (int64_t)l->flushed);
+        }
 
-            if (gdata.debug > 4) {
-                ioutput(CALLTYPE_NORMAL, OUT_S, COLOR_BLUE, "Read %d File %d",
-                        howmuch, howmuch2);
-            }
+        if ((size_t)howmuch < attempt) {
+            break; /* socket drained */
         }
     }
 
-    g = htonl((unsigned long)l->bytesgot);
-    write(l->clientsocket, (unsigned char*)&g, 4);
+    /* coalesce acks, the rest go out from the main loop */
+    if (!gdata.uploadack || ((l->bytesgot - l->lastack) >= gdata.uploadack) ||
+        (l->bytesgot >= l->totalsize)) {
+        if (l_sendack(l) < 0) {
+            return;
+        }
+    }
 
     if (l->bytesgot >= l->totalsize) {
         long timetook;
@@ -239,8 +904,9 @@ void l_transfersome(upload* const l) {
 void l_istimeout(upload* const l) {
     updatecontext();
 
-    if ((l->ul_status == UPLOAD_STATUS_WAITING) &&
-        (gdata.curtime - l->lastcontact > 1)) {
+    /* not before it is all written and the sender has its final ack */
+    if ((l->ul_status == UPLOAD_STATUS_WAITING) && l->completed &&
+        !l->ack_len && (gdata.curtime - l->lastcontact > 1)) {
         if (gdata.debug > 0) {
             ioutput(CALLTYPE_MULTI_FIRST, OUT_S, COLOR_YELLOW,
                     "clientsock = %d", l->clientsocket);
@@ -254,6 +920,7 @@ void l_istimeout(upload* const l) {
         shutdown(l->clientsocket, SHUT_RDWR);
         close(l->clientsocket);
         close(l->filedescriptor);
+        l_closepipe(l);
         l->ul_status = UPLOAD_STATUS_DONE;
     }
 
@@ -295,9 +962,16 @@ void l_closeconn(upload* const l, const char* msg, int errno1) {
     }
 
     if (l->filedescriptor != FD_UNUSED && l->filedescriptor > 2) {
+        /* keep what was received so the upload can be resumed */
+        if (l_flush(l) < 0) {
+            outerror(OUTERROR_TYPE_WARN, "Unable to write data to file: %s",
+                     strerror(errno));
+        }
         close(l->filedescriptor);
     }
 
+    l_closepipe(l);
+
     l->ul_status = UPLOAD_STATUS_DONE;
 
     if (errno1) {
@@ -23,35 +23,26 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include "iroffer_globals.h"
 
 
-const char* strstrnocase(const char* str1, const char* match1) {
-    char *str, *match;
-    const char* retval;
-
-    str = mymalloc(strlen(str1) + 1);
-    match = mymalloc(strlen(match1) + 1);
-
-    strcpy(str, str1);
-    caps(str);
-    strcpy(match, match1);
-    caps(match);
+/* case folded the way caps() does it */
+#define nocase(c) ((((c) >= 'a') && ((c) <= 'z')) ? (c) - 32 : (c))
 
-    retval = strstr(str, match);
+const char* strstrnocase(const char* str1, const char* match1) {
+    int i;
 
-    if (retval) {
-        retval = str1 + (retval - str);
+    for (; *str1; str1++) {
+        for (i = 0; match1[i] && (nocase(str1[i]) == nocase(match1[i])); i++)
+            ;
+        if (!match1[i]) {
+            return str1;
+        }
     }
 
-    mydelete(str);
-    mydelete(match);
-
-    return retval;
+    return *match1 ? NULL : str1;
 }
 
-char* getpart2(const char* line, int howmany, const char* src_function,
-               const char* src_file, int src_line) {
-    char* part;
+/* where word howmany of line starts and how long it is */
+static const char* getpart_find(const char* line, int howmany, int* plen) {
     int li;
-    int plen;
     int hi;
 
     li = 0;
@@ -71,20 +62,95 @@ char* getpart2(const char* line, int howmany, const char* src_function,
         return NULL;
     }
 
-    for (plen = 0; (line[li] != ' ') && (line[li] != '\0'); plen++, li++) {
+    for (*plen = 0; (line[li + *plen] != ' ') && (line[li + *plen] != '\0');
+         (*plen)++) {
         ;
     }
 
-    li -= plen;
+    return line + li;
+}
+
+char* getpart2(const char* line, int howmany, memsite_t** site,
+               const char* src_function, const char* src_file, int src_line) {
+    const char* start;
+    char* part;
+    int plen;
+
+    start = getpart_find(line, howmany, &plen);
+    if (!start) {
+        return NULL;
+    }
+
+    part = mymalloc2(plen + 1, 0, site, src_function, src_file, src_line);
+
+    memcpy(part, start, plen);
+    part[plen] = '\0';
+
+    return part;
+}
+
+/*
+ * Allocations from an arena are not freed on their own, they all go away
+ * with the next ir_arena_reset().  The memory is not cleared.
+ */
+void* ir_arena_alloc(ir_arena_t* arena, int len) {
+    ir_arena_chunk_t* chunk;
+    int size;
+    void* t;
+
+    len = (len + IR_ARENA_ALIGN - 1) & ~(IR_ARENA_ALIGN - 1);
+
+    chunk = irlist_get_tail(&arena->chunks);
+    if (!chunk || (chunk->used + len > chunk->size)) {
+        size = max2(len, IR_ARENA_CHUNK);
+        chunk = irlist_add(&arena->chunks, sizeof(ir_arena_chunk_t) + size);
+        chunk->size = size;
+        arena->size += size;
+    }
+
+    t = chunk->buffer + chunk->used;
+    chunk->used += len;
+
+    return t;
+}
+
+/* like getpart(), but allocated from arena */
+char* ir_arena_getpart(ir_arena_t* arena, const char* line, int howmany) {
+    const char* start;
+    char* part;
+    int plen;
+
+    start = getpart_find(line, howmany, &plen);
+    if (!start) {
+        return NULL;
+    }
 
-    part = mymalloc2(plen + 1, 0, src_function, src_file, src_line);
+    part = ir_arena_alloc(arena, plen + 1);
 
-    memcpy(part, line + li, plen);
+    memcpy(part, start, plen);
     part[plen] = '\0';
 
     return part;
 }
 
+/* frees everything, keeping one chunk big enough for all of it */
+void ir_arena_reset(ir_arena_t* arena) {
+    ir_arena_chunk_t* chunk;
+    int size;
+
+    if (irlist_size(&arena->chunks) > 1) {
+        size = arena->size;
+        irlist_delete_all(&arena->chunks);
+        chunk = irlist_add(&arena->chunks, sizeof(ir_arena_chunk_t) + size);
+        chunk->size = size;
+    }
+
+    chunk = irlist_get_head(&arena->chunks);
+    if (chunk) {
+        chunk->used = 0;
+    }
+}
+
 char* caps(char* text) {
     int i;
     if (text) {
@@ -819,20 +885,41 @@ static void meminfo_grow(int grow) {
     }
 }
 
-void* mymalloc2(int len, int zero, const char* src_function,
-                const char* src_file, int src_line) {
-    void* t = NULL;
-    int i;
-    unsigned long start;
+/* the counters of a call site, kept until exit */
+static memsite_t* memsite_find(const char* src_function, const char* src_file,
+                               int src_line) {
+    memsite_t* site;
+    unsigned long i;
 
-    updatecontext();
+    i = ((unsigned long)src_file >> 3) * 31 + src_line;
 
-    t = zero ? calloc(len, 1) : malloc(len);
+    for (;; i++) {
+        site = &gdata.memsites[i & (MEMSITES - 1)];
+        if (!site->src_file) {
+            break;
+        }
+        if ((site->src_line == src_line) && (site->src_file == src_file)) {
+            return site;
+        }
+    }
 
-    if (t == NULL) {
-        outerror(OUTERROR_TYPE_CRASH, "Couldn't Allocate Memory!!");
+    if (gdata.memsites_used >= ((MEMSITES / 4) * 3)) {
+        return &gdata.memsite_other;
     }
 
+    gdata.memsites_used++;
+    site->src_func = src_function;
+    site->src_file = src_file;
+    site->src_line = src_line;
+
+    return site;
+}
+
+static void meminfo_add(void* t, int len, const char* src_function,
+                        const char* src_file, int src_line) {
+    int i;
+    unsigned long start;
+
     if (gdata.meminfo_count >= ((MEMINFOHASHSIZE * gdata.meminfo_depth) / 2)) {
         meminfo_grow(gdata.meminfo_depth / 3 + 1);
     }
@@ -856,20 +943,39 @@ void* mymalloc2(int len, int zero, const char* src_function,
     gdata.meminfo[i].src_line = src_line;
 
     gdata.meminfo_count++;
-
-    return t;
 }
 
-void mydelete2(void* t) {
+static void mydelete_bad(void* t) {
     unsigned char* ut = (unsigned char*)t;
     int i;
-    unsigned long start;
-
-    updatecontext();
 
-    if (t == NULL) {
-        return;
-    }
+    outerror(OUTERROR_TYPE_WARN_LOUD,
+             "Pointer 0x%8.8lX not found in meminfo database while trying "
+             "to free!!",
+             (long)t);
+    outerror(OUTERROR_TYPE_WARN_LOUD, "Please report this error to PMG");
+    for (i = 0; i < (12 * 12); i += 12) {
+        outerror(OUTERROR_TYPE_WARN_LOUD,
+                 " : %2.2X %2.2X %2.2X %2.2X %2.2X %2.2X %2.2X %2.2X %2.2X "
+                 "%2.2X %2.2X %2.2X = \"%c%c%c%c%c%c%c%c%c%c%c%c\"",
+                 ut[i + 0], ut[i + 1], ut[i + 2], ut[i + 3], ut[i + 4],
+                 ut[i + 5], ut[i + 6], ut[i + 7], ut[i + 8], ut[i + 9],
+                 ut[i + 10], ut[i + 11], onlyprintable(ut[i + 0]),
+                 onlyprintable(ut[i + 1]), onlyprintable(ut[i + 2]),
+                 onlyprintable(ut[i + 3]), onlyprintable(ut[i + 4]),
+                 onlyprintable(ut[i + 5]), onlyprintable(ut[i + 6]),
+                 onlyprintable(ut[i + 7]), onlyprintable(ut[i + 8]),
+                 onlyprintable(ut[i + 9]), onlyprintable(ut[i + 10]),
+                 onlyprintable(ut[i + 11]));
+    }
+    outerror(OUTERROR_TYPE_WARN_LOUD,
+             "Aborting Program! (core file should be generated)");
+    abort(); /* getting a core file will help greatly */
+}
+
+static void meminfo_remove(void* t) {
+    int i;
+    unsigned long start;
 
     start = alloc_hash(t) * gdata.meminfo_depth;
 
@@ -882,42 +988,19 @@ void mydelete2(void* t) {
     }
 
     if (i == (MEMINFOHASHSIZE * gdata.meminfo_depth)) {
-        outerror(OUTERROR_TYPE_WARN_LOUD,
-                 "Pointer 0x%8.8lX not found in meminfo database while trying "
-                 "to free!!",
-                 (long)t);
-        outerror(OUTERROR_TYPE_WARN_LOUD, "Please report this error to PMG");
-        for (i = 0; i < (12 * 12); i += 12) {
-            outerror(OUTERROR_TYPE_WARN_LOUD,
-                     " : %2.2X %2.2X %2.2X %2.2X %2.2X %2.2X %2.2X %2.2X %2.2X "
-                     "%2.2X %2.2X %2.2X = \"%c%c%c%c%c%c%c%c%c%c%c%c\"",
-                     ut[i + 0], ut[i + 1], ut[i + 2], ut[i + 3], ut[i + 4],
-                     ut[i + 5], ut[i + 6], ut[i + 7], ut[i + 8], ut[i + 9],
-                     ut[i + 10], ut[i + 11], onlyprintable(ut[i + 0]),
-                     onlyprintable(ut[i + 1]), onlyprintable(ut[i + 2]),
-                     onlyprintable(ut[i + 3]), onlyprintable(ut[i + 4]),
-                     onlyprintable(ut[i + 5]), onlyprintable(ut[i + 6]),
-                     onlyprintable(ut[i + 7]), onlyprintable(ut[i + 8]),
-                     onlyprintable(ut[i + 9]), onlyprintable(ut[i + 10]),
-                     onlyprintable(ut[i + 11]));
-        }
-        outerror(OUTERROR_TYPE_WARN_LOUD,
-                 "Aborting Program! (core file should be generated)");
-        abort(); /* getting a core file will help greatly */
-    } else {
-        free(t);
+        mydelete_bad(t);
+    }
 
-        i = (i + start) % (MEMINFOHASHSIZE * gdata.meminfo_depth);
+    i = (i + start) % (MEMINFOHASHSIZE * gdata.meminfo_depth);
 
-        gdata.meminfo[i].ptr = NULL;
-        gdata.meminfo[i].alloctime = 0;
-        gdata.meminfo[i].size = 0;
-        gdata.meminfo[i].src_func = NULL;
-        gdata.meminfo[i].src_file = NULL;
-        gdata.meminfo[i].src_line = 0;
+    gdata.meminfo[i].ptr = NULL;
+    gdata.meminfo[i].alloctime = 0;
+    gdata.meminfo[i].size = 0;
+    gdata.meminfo[i].src_func = NULL;
+    gdata.meminfo[i].src_file = NULL;
+    gdata.meminfo[i].src_line = 0;
 
-        gdata.meminfo_count--;
-    }
+    gdata.meminfo_count--;
 
     if ((gdata.meminfo_depth > 1) &&
         (gdata.meminfo_count < ((MEMINFOHASHSIZE * gdata.meminfo_depth) / 8))) {
@@ -925,6 +1008,76 @@ void mydelete2(void* t) {
     }
 }
 
+/*
+ * Every allocation is counted against its call site through a memhdr_t in
+ * front of it.  Only with memdebug is it also put in the meminfo table, for
+ * "memstat list" and to catch frees of pointers never allocated.  The site
+ * is looked up on its first call and then kept in *site.
+ */
+void* mymalloc2(int len, int zero, memsite_t** site, const char* src_function,
+                const char* src_file, int src_line) {
+    memhdr_t* hdr;
+    void* t;
+
+    hdr = zero ? calloc(MEMHDR_SIZE + len, 1) : malloc(MEMHDR_SIZE + len);
+
+    if (hdr == NULL) {
+        outerror(OUTERROR_TYPE_CRASH, "Couldn't Allocate Memory!!");
+    }
+
+    t = (char*)hdr + MEMHDR_SIZE;
+
+    if (site && *site) {
+        hdr->site = *site;
+    } else {
+        hdr->site = memsite_find(src_function, src_file, src_line);
+        if (site) {
+            *site = hdr->site;
+        }
+    }
+    hdr->size = len;
+    hdr->magic = MEMHDR_MAGIC;
+
+    hdr->site->count++;
+    hdr->site->size += len;
+    hdr->site->total++;
+    gdata.mem_count++;
+    gdata.mem_size += len;
+
+    if (gdata.memdebug) {
+        updatecontext();
+        meminfo_add(t, len, src_function, src_file, src_line);
+        hdr->magic = MEMHDR_MAGIC_DEBUG;
+    }
+
+    return t;
+}
+
+void mydelete2(void* t) {
+    memhdr_t* hdr;
+
+    if (t == NULL) {
+        return;
+    }
+
+    hdr = (memhdr_t*)((char*)t - MEMHDR_SIZE);
+
+    if (hdr->magic == MEMHDR_MAGIC_DEBUG) {
+        updatecontext();
+        meminfo_remove(t);
+    } else if (hdr->magic != MEMHDR_MAGIC) {
+        mydelete_bad(t);
+    }
+
+    hdr->site->count--;
+    hdr->site->size -= hdr->size;
+    gdata.mem_count--;
+    gdata.mem_size -= hdr->size;
+
+    hdr->magic = 0;
+    free(hdr);
+}
+
 char* removenonprintable(char* str1) {
     int i;
     unsigned char* str = (unsigned char*)str1;
@@ -1285,6 +1438,10 @@ void dumpgdata(void) {
     gdata_print_int(maxqueueditemsperperson);
     gdata_print_int(punishslowusers);
     gdata_print_int(nomd5sum);
+    gdata_print_int(nocrc32);
+    gdata_print_int(nosha256);
+    gdata_print_int(nofilewatch);
+    gdata_print_int(memdebug);
 
     /* downloadhost */
 
@@ -1296,6 +1453,7 @@ void dumpgdata(void) {
     gdata_print_string(statefile);
     gdata_print_string(xdcclistfile);
     gdata_print_int(xdcclistfileraw);
+    gdata_print_string(xdcclistjson);
     gdata_print_string(periodicmsg_nick);
     gdata_print_string(periodicmsg_msg);
     gdata_print_int(periodicmsg_time);
@@ -1320,6 +1478,23 @@ void dumpgdata(void) {
     gdata_print_int(respondtochannelxdcc);
     gdata_print_int(respondtochannellist);
     gdata_print_int(smallfilebypass);
+    gdata_print_int(fdcache);
+    gdata_print_int(blockcache_mb);
+    gdata_print_int(uploadmaxspeed);
+    gdata_print_int(uploadack);
+    gdata_print_int(uploadsplice);
+    gdata_print_int(uploadautoadd);
+    gdata_print_int(hashthreads);
+    gdata_print_int(scanthreads);
+    gdata_print_int(searchmaxresults);
+    gdata_print_int(hashlanes);
+    gdata_print_int(hashmaxspeed);
+    gdata_print_int(hashcoldtimestart);
+    gdata_print_int(hashcoldtimeend);
+
+    gdata_irlist_iter_start(watchdirs, char);
+    gdata_iter_as_print_string;
+    gdata_irlist_iter_end;
 
     gdata_irlist_iter_start(server_join_raw, char);
     gdata_iter_as_print_string;
@@ -1438,6 +1613,9 @@ void dumpgdata(void) {
     for (ii = 0; ii < XDCC_SENT_SIZE; ii++) {
         gdata_print_ulong_array(xdccsent)
     }
+    for (ii = 0; ii < XDCC_SENT_SIZE; ii++) {
+        gdata_print_ulong_array(xdccrecv)
+    }
     for (ii = 0; ii < INAMNT_SIZE; ii++) {
         gdata_print_int_array(inamnt)
     }
@@ -1484,10 +1662,29 @@ void dumpgdata(void) {
             (unsigned long)iter, iter->gets, iter->minspeed, iter->maxspeed,
             (long long)iter->st_size);
     /* st_dev st_ino */
-    ioutput(gdata_common, "  : fd=%d fd_count=%d fd_loc=%lld", iter->file_fd,
-            iter->file_fd_count, (long long)iter->file_fd_location);
+    ioutput(gdata_common,
+            "  : fd=%d fd_count=%d fd_loc=%lld fd_lastused=%llu dupof=%p",
+            iter->file_fd, iter->file_fd_count,
+            (long long)iter->file_fd_location, iter->file_fd_lastused,
+            (void*)iter->dupof);
     ioutput(gdata_common, "  : has_md5=%d md5sum=" MD5_PRINT_FMT,
             iter->has_md5sum, MD5_PRINT_DATA(iter->md5sum));
+    ioutput(gdata_common, "  : streamhash=%p done=%" PRId64 "d time=%ld",
+            (void*)iter->streamhash, (int64_t)iter->streamhash_done,
+            (long)iter->streamhash_time);
+    {
+        char sha[(sizeof(SHA256Digest) * 2) + 1];
+        sha256_print(sha, iter->sha256);
+        ioutput(gdata_common,
+                "  : has_crc32=%d crc32=%08X has_sha256=%d sha256=%s",
+                iter->has_crc32, iter->crc32, iter->has_sha256, sha);
+    }
+    ioutput(gdata_common, "  : pieces=%d/%d flags=%d size=%" PRId64 "d",
+            iter->pieces.count, iter->pieces.alloc, iter->pieces.flags,
+            (int64_t)iter->pieces.size);
+    ioutput(gdata_common, "  : requests=%d time=%ld hash_retry=%ld",
+            iter->requests, (long)iter->requests_time,
+            (long)iter->hash_retry);
 #ifdef HAVE_MMAP
     {
         mmap_info_t* iter2;
@@ -1545,6 +1742,22 @@ void dumpgdata(void) {
     gdata_irlist_iter_start(uploads, upload);
     ioutput(gdata_common, "  : client=%d file=%d ul_status=%d",
             iter->clientsocket, iter->filedescriptor, iter->ul_status);
+    ioutput(gdata_common,
+            "  : buffered=%zu writing=%zu flushed=%" PRId64
+            "d writeback=%" PRId64 "d",
+            iter->buffer_len, iter->wlen, (int64_t)iter->flushed,
+            (int64_t)iter->writeback);
+    ioutput(gdata_common,
+            "  : lastack=%" PRId64 "d lastacktime=%ld ack_len=%zu "
+            "pipe=%d,%d",
+            (int64_t)iter->lastack, (long)iter->lastacktime, iter->ack_len,
+            iter->splice_pipe[0], iter->splice_pipe[1]);
+    ioutput(gdata_common,
+            "  : md5_done=%" PRId64 "d completed=%d digests=%d " MD5_PRINT_FMT
+            " %08X hashpipe=%d,%d",
+            (int64_t)iter->md5_done, iter->completed, iter->digest.flags,
+            MD5_PRINT_DATA(iter->digest.md5sum), iter->digest.crc32,
+            iter->hash_pipe[0], iter->hash_pipe[1]);
     ioutput(gdata_common,
             "  : got=%" PRId64 "d totalsize=%" PRId64 "d resume=%" PRId64
             "d speedamt=%" PRId64 "d",
@@ -1567,6 +1780,46 @@ void dumpgdata(void) {
 
     gdata_print_number("%p", md5build.xpack);
     gdata_print_int(md5build.file_fd);
+#ifdef HAVE_PTHREAD
+    gdata_print_int(hashpool.count);
+    gdata_print_number("%ld", hashpool.budget);
+    gdata_print_number("%ld", hashpool.budget_used);
+    gdata_irlist_iter_start(hashpool.queue, xdcc*);
+    ioutput(gdata_common, "  : xpack=%p", *iter);
+    gdata_irlist_iter_end;
+#endif
+    gdata_print_ulong(fdcache_hits);
+    gdata_print_ulong(fdcache_misses);
+    gdata_print_int(blockcache.p);
+    gdata_print_ulong(blockcache.hits);
+    gdata_print_ulong(blockcache.misses);
+    gdata_print_ulong(blockcache.evictions);
+    gdata_print_int(packs.count);
+    gdata_print_int(packs.alloc);
+    gdata_print_uint(packs.hashsize);
+    gdata_print_int(irlist_slab.chunks);
+    gdata_print_int(irlist_slab.chunk_left);
+    gdata_print_int(xdl.width);
+    gdata_print_uint(search.hashsize);
+    gdata_print_int(search.trigrams);
+
+    gdata_irlist_iter_start(dirscans, dirscan_t);
+    gdata_iter_print_string(dir);
+    ioutput(gdata_common, "  : method=%d addnew=%d count=%d", iter->u.method,
+            iter->addnew, iter->count);
+    gdata_irlist_iter_end;
+
+    gdata_print_int(statefile_hold);
+    gdata_print_int(statefile_pending);
+    gdata_print_int(xdcclist_pending);
+    gdata_print_int(xdcclistfile_saved);
+    gdata_print_int(xdcclistjson_saved);
+    gdata_print_int(filewatch.fd);
+    gdata_print_int(filewatch.count);
+    gdata_print_int(filewatch.cursor);
+    gdata_print_int(filewatch.sweep);
+    gdata_print_int(filewatch.incomplete);
+    gdata_print_int(filewatch.failed);
 
     /* meminfo */
 
@@ -1917,14 +2170,45 @@ char* convert_to_unix_slash(char* ss) {
 #define IRLIST_EXT_TO_INT(p) ((irlist_item_t*)(p)-1)
 #define IRLIST_EXT_TO_INT_CONST(p) ((const irlist_item_t*)(p)-1)
 
-void* irlist_add2(irlist_t* list, unsigned int size, const char* src_function,
-                  const char* src_file, int src_line) {
+/*
+ * Small items are carved from large chunks and kept on a free list per
+ * size class when deleted, instead of a malloc() and meminfo entry each.
+ * The classes are shared by all lists since items move between them.
+ * The chunks are never given back.
+ */
+void* irlist_add2(irlist_t* list, unsigned int size, memsite_t** site,
+                  const char* src_function, const char* src_file,
+                  int src_line) {
     irlist_item_t* iitem;
+    int slab, len;
 
     updatecontext();
 
-    iitem = mymalloc2(sizeof(irlist_item_t) + size, 1, src_function, src_file,
-                      src_line);
+    len = sizeof(irlist_item_t) + size;
+
+    if (len > IRLIST_SLAB_MAXITEM) {
+        iitem = mymalloc2(len, 1, site, src_function, src_file, src_line);
+    } else {
+        slab = (len - 1) / IRLIST_SLAB_ROUND;
+        len = (slab + 1) * IRLIST_SLAB_ROUND;
+
+        if (gdata.irlist_slab.free[slab]) {
+            iitem = gdata.irlist_slab.free[slab];
+            gdata.irlist_slab.free[slab] = iitem->next;
+        } else {
+            if (gdata.irlist_slab.chunk_left < len) {
+                gdata.irlist_slab.chunk = mymalloc(IRLIST_SLAB_CHUNK);
+                gdata.irlist_slab.chunk_left = IRLIST_SLAB_CHUNK;
+                gdata.irlist_slab.chunks++;
+            }
+            iitem = (irlist_item_t*)gdata.irlist_slab.chunk;
+            gdata.irlist_slab.chunk += len;
+            gdata.irlist_slab.chunk_left -= len;
+        }
+
+        memset(iitem, 0, len);
+        iitem->slab = slab + 1;
+    }
 
     irlist_insert_tail(list, IRLIST_INT_TO_EXT(iitem));
 
@@ -1957,6 +2241,7 @@ void irlist_insert_head(irlist_t* list, void* item) {
     iitem->prev = NULL;
     list->head = iitem;
 
+    list->nth_item = NULL;
     list->size++;
 }
 
@@ -1986,6 +2271,7 @@ void irlist_insert_tail(irlist_t* list, void* item) {
     iitem->prev = list->tail;
     list->tail = iitem;
 
+    list->nth_item = NULL;
     list->size++;
 }
 
@@ -2010,6 +2296,7 @@ void irlist_insert_before(irlist_t* list, void* item, void* before_this) {
     ibefore->prev = iitem;
     iitem->next = ibefore;
 
+    list->nth_item = NULL;
     list->size++;
 }
 
@@ -2034,6 +2321,7 @@ void irlist_insert_after(irlist_t* list, void* item, void* after_this) {
     iafter->next = iitem;
     iitem->prev = iafter;
 
+    list->nth_item = NULL;
     list->size++;
 }
 
@@ -2045,7 +2333,12 @@ void* irlist_delete(irlist_t* list, void* item) {
 
     retval = irlist_remove(list, item);
 
-    mydelete(iitem);
+    if (iitem->slab) {
+        iitem->next = gdata.irlist_slab.free[iitem->slab - 1];
+        gdata.irlist_slab.free[iitem->slab - 1] = iitem;
+    } else {
+        mydelete(iitem);
+    }
 
     return retval;
 }
@@ -2085,6 +2378,7 @@ void* irlist_remove(irlist_t* list, void* item) {
     iitem->next = NULL;
     iitem->prev = NULL;
 
+    list->nth_item = NULL;
     list->size--;
     assert(list->size >= 0);
 
@@ -2158,22 +2452,41 @@ int irlist_size(const irlist_t* list) {
     return list->size;
 }
 
+/* walks from the head, the tail or the last item found, whichever is closer */
 void* irlist_get_nth(irlist_t* list, int nth) {
     irlist_item_t* iitem;
+    int cur;
 
     updatecontext();
 
     assert(nth >= 0);
 
-    for (iitem = list->head; (iitem && nth--); iitem = iitem->next) {
-        ;
+    if (nth >= list->size) {
+        return NULL;
     }
 
-    if (iitem) {
-        return IRLIST_INT_TO_EXT(iitem);
-    } else {
-        return NULL;
+    iitem = list->head;
+    cur = 0;
+    if (list->size - 1 - nth < nth) {
+        iitem = list->tail;
+        cur = list->size - 1;
+    }
+    if (list->nth_item && (abs(list->nth - nth) < abs(cur - nth))) {
+        iitem = list->nth_item;
+        cur = list->nth;
     }
+
+    for (; cur < nth; cur++) {
+        iitem = iitem->next;
+    }
+    for (; cur > nth; cur--) {
+        iitem = iitem->prev;
+    }
+
+    list->nth_item = iitem;
+    list->nth = nth;
+
+    return IRLIST_INT_TO_EXT(iitem);
 }
 
 int irlist_sort_cmpfunc_string(void* userdata, const void* a, const void* b) {
@@ -2191,41 +2504,73 @@ int irlist_sort_cmpfunc_off_t(void* userdata, const void* a, const void* b) {
     off_t ai, bi;
     ai = *(const off_t*)a;
     bi = *(const off_t*)b;
-    return ai - bi;
+    return (ai > bi) - (ai < bi);
 }
 
+/* stable merge sort, merging runs of 1, 2, 4... items */
 void irlist_sort(irlist_t* list,
                  int (*cmpfunc)(void* userdata, const void* a, const void* b),
                  void* userdata) {
-    irlist_t newlist = {};
-    void *cur, *try
-        ;
+    irlist_item_t *head, *tail, *p, *q, *e;
+    int run, merges, psize, qsize;
 
-    while ((cur = irlist_get_head(list))) {
-        irlist_remove(list, cur);
+    updatecontext();
 
-        try
-            = irlist_get_head(&newlist);
-        if (!try) {
-            irlist_insert_head(&newlist, cur);
-            continue;
-        }
+    if (list->size < 2) {
+        return;
+    }
 
-        while (try) {
-            if (cmpfunc(userdata, cur, try) < 0) {
-                irlist_insert_before(&newlist, cur, try);
-                break;
+    head = list->head;
+    for (run = 1;; run *= 2) {
+        p = head;
+        head = tail = NULL;
+        merges = 0;
+
+        while (p) {
+            merges++;
+            q = p;
+            for (psize = 0; q && (psize < run); psize++) {
+                q = q->next;
             }
-            try
-                = irlist_get_next(try);
+            qsize = run;
+
+            while (psize || (qsize && q)) {
+                if (!psize) {
+                    e = q;
+                    q = q->next;
+                    qsize--;
+                } else if (!qsize || !q ||
+                           (cmpfunc(userdata, IRLIST_INT_TO_EXT(q),
+                                    IRLIST_INT_TO_EXT(p)) >= 0)) {
+                    e = p;
+                    p = p->next;
+                    psize--;
+                } else {
+                    e = q;
+                    q = q->next;
+                    qsize--;
+                }
+
+                if (tail) {
+                    tail->next = e;
+                } else {
+                    head = e;
+                }
+                e->prev = tail;
+                tail = e;
+            }
+            p = q;
         }
+        tail->next = NULL;
 
-        if (!try) {
-            irlist_insert_tail(&newlist, cur);
+        if (merges <= 1) {
+            break;
         }
     }
 
-    *list = newlist;
+    list->head = head;
+    list->tail = tail;
+    list->nth_item = NULL;
 }
 
 transfer* does_tr_id_exist(int tr_id) {
@@ -2411,22 +2756,28 @@ begin_again:
 }
 
 int ir_boutput_attempt_flush(ir_boutput_t* bout) {
+    struct iovec iov[IR_BOUTPUT_IOVECS];
     ir_boutput_segment_t* segment;
     int count = 0;
+    int iovcnt;
+    ssize_t retval;
 
     if (bout->flags & BOUTPUT_NO_FLUSH) {
         return 0;
     }
 
     while ((segment = irlist_get_head(&bout->segments))) {
-        int retval;
-
-        assert(segment->begin <= segment->end);
-        assert(segment->begin <= IR_BOUTPUT_SEGMENT_SIZE);
-        assert(segment->end <= IR_BOUTPUT_SEGMENT_SIZE);
+        for (iovcnt = 0; segment && (iovcnt < IR_BOUTPUT_IOVECS);
+             iovcnt++, segment = irlist_get_next(segment)) {
+            assert(segment->begin <= segment->end);
+            assert(segment->begin <= IR_BOUTPUT_SEGMENT_SIZE);
+            assert(segment->end <= IR_BOUTPUT_SEGMENT_SIZE);
+
+            iov[iovcnt].iov_base = segment->buffer + segment->begin;
+            iov[iovcnt].iov_len = segment->end - segment->begin;
+        }
 
-        retval = write(bout->fd, segment->buffer + segment->begin,
-                       segment->end - segment->begin);
+        retval = writev(bout->fd, iov, iovcnt);
 
         if ((retval < 0) && (errno != EAGAIN)) {
             /* write failure */
@@ -2435,16 +2786,19 @@ int ir_boutput_attempt_flush(ir_boutput_t* bout) {
         } else if (retval < 0) {
             /* EAGAIN, that's all for now */
             break;
-        } else {
-            segment->begin += retval;
-            count += retval;
-            bout->count_flushed += retval;
         }
 
-        assert(segment->begin <= segment->end);
-        if (segment->begin == segment->end) {
+        count += retval;
+        bout->count_flushed += retval;
+
+        while ((segment = irlist_get_head(&bout->segments)) &&
+               (retval >= (ssize_t)(segment->end - segment->begin))) {
+            retval -= segment->end - segment->begin;
             irlist_delete(&bout->segments, segment);
         }
+        if (segment) {
+            segment->begin += retval;
+        }
     }
 
     return count;
@@ -13,63 +13,150 @@
 #include "conversions.h"
 #include "parsing.h"
 
-void privmsgparse(const char* type, char* line) {
-    int j;
-    igninfo* ignore = NULL;
+#define ir_line_fold(c) ((((c) >= 'a') && ((c) <= 'z')) ? (c) - 32 : (c))
 
-    updatecontext();
+/*
+ * Splits line in one pass.  The words are numbered like getpart() does, so
+ * an empty word is kept between two spaces but not at the end of the line.
+ * Everything is allocated from arena, line itself is left as it is.
+ */
+ir_line_t* ir_line_parse(ir_arena_t* arena, char* line) {
+    ir_line_t* l;
+    int len, count, i, w;
+    const char* bang;
+    const char* at;
+
+    for (len = 0, count = 1; line[len]; len++) {
+        if (line[len] == ' ') {
+            count++;
+        }
+    }
 
-    floodchk();
+    l = ir_arena_alloc(arena, sizeof(ir_line_t));
+    l->line = line;
+    l->word = ir_arena_alloc(arena, sizeof(ir_slice_t) * count);
+    l->split = ir_arena_alloc(arena, len + 1);
+    l->folded = ir_arena_alloc(arena, len + 1);
+
+    l->word[0].ptr = line;
+    for (i = w = 0; i < len; i++) {
+        if (line[i] == ' ') {
+            l->word[w].len = line + i - l->word[w].ptr;
+            l->word[++w].ptr = line + i + 1;
+            l->split[i] = l->folded[i] = '\0';
+        } else {
+            l->split[i] = line[i];
+            l->folded[i] = ir_line_fold(line[i]);
+        }
+    }
+    l->word[w].len = line + len - l->word[w].ptr;
+    l->split[len] = l->folded[len] = '\0';
+
+    l->count = l->word[w].len ? count : count - 1;
+
+    memset(&l->prefix, 0, sizeof(ir_slice_t));
+    memset(&l->nick, 0, sizeof(ir_slice_t));
+    memset(&l->host, 0, sizeof(ir_slice_t));
+    l->trailing = NULL;
+
+    if (l->count && (line[0] == ':')) {
+        l->prefix.ptr = line + 1;
+        l->prefix.len = l->word[0].len - 1;
+
+        l->nick = l->prefix;
+        bang = memchr(l->prefix.ptr, '!', l->prefix.len);
+        if (bang) {
+            l->nick.len = bang - l->prefix.ptr;
+            at = memchr(bang, '@', l->prefix.ptr + l->prefix.len - bang);
+            l->host.ptr = at ? at + 1 : l->prefix.ptr + l->prefix.len;
+            l->host.len = l->prefix.ptr + l->prefix.len - l->host.ptr;
+        }
+        l->command = 1;
+    } else {
+        l->command = 0;
+    }
 
-    char* hostmask = caps(getpart(line, 1));
-    for (int i = 1; i <= sstrlen(hostmask); i++) {
-        hostmask[i - 1] = hostmask[i];
+    if (l->command >= l->count) {
+        l->command = -1;
     }
+    l->params = l->command + 1;
 
-    char* dest = caps(getpart(line, 3));
-    char* msg1 = getpart(line, 4);
-    char* msg2 = getpart(line, 5);
-    char* msg3 = getpart(line, 6);
-    char* msg4 = getpart(line, 7);
-    char* msg5 = getpart(line, 8);
-    char* msg6 = getpart(line, 9);
+    for (i = l->params; l->command >= 0 && i < l->count; i++) {
+        if (l->word[i].ptr[0] == ':') {
+            l->trailing = l->word[i].ptr + 1;
+            break;
+        }
+    }
 
-    if (msg1) {
-        msg1++; /* point past the ":" */
+    return l;
+}
+
+/* word n counted from 1 like getpart(), NULL if there are fewer words */
+char* ir_line_word(const ir_line_t* l, int n) {
+    if ((n < 1) || (n > l->count)) {
+        return NULL;
     }
+    return l->split + (l->word[n - 1].ptr - l->line);
+}
+
+/* the same, folded to upper case */
+char* ir_line_caps(const ir_line_t* l, int n) {
+    if ((n < 1) || (n > l->count)) {
+        return NULL;
+    }
+    return l->folded + (l->word[n - 1].ptr - l->line);
+}
 
-    int line_len = sstrlen(line);
-    char* nick = mycalloc(line_len + 1);
-    char* hostname = mycalloc(line_len + 1);
-    char* wildhost = mycalloc(line_len + 2);
+char* ir_slice_dup(ir_arena_t* arena, ir_slice_t slice) {
+    char* str;
 
-    int i = 1;
-    j = 0;
-    while (line[i] != '!' && i < line_len) {
-        nick[i - 1] = line[i];
-        i++;
+    str = ir_arena_alloc(arena, slice.len + 1);
+    if (slice.len) {
+        memcpy(str, slice.ptr, slice.len);
     }
-    nick[i - 1] = '\0';
+    str[slice.len] = '\0';
 
+    return str;
+}
+
+void privmsgparse(const char* type, const ir_line_t* l) {
+    int j;
+    igninfo* ignore = NULL;
+
+    updatecontext();
+
+    floodchk();
 
     /* see if it came from a user or server, ignore if from server */
-    if (i == line_len) {
-        goto privmsgparse_cleanup;
+    if (!l->host.ptr) {
+        return;
     }
 
-    while (line[i] != '@' && i < line_len) {
-        i++;
-    }
-    i++;
+    char* line = l->line;
+    int line_len = strlen(line);
+    char* hostmask = ir_line_caps(l, 1) + 1;
+    char* dest = ir_line_caps(l, 3);
+    char* msg1 = ir_line_word(l, 4);
+    char* msg2 = ir_line_word(l, 5);
+    char* msg3 = ir_line_word(l, 6);
+    char* msg4 = ir_line_word(l, 7);
+    char* msg5 = ir_line_word(l, 8);
+    char* msg6 = ir_line_word(l, 9);
+    char* cmsg1 = ir_line_caps(l, 4);
+    char* cmsg2 = ir_line_caps(l, 5);
 
-    while (line[i] != ' ' && i < line_len) {
-        hostname[j] = line[i];
-        i++;
-        j++;
+    if (msg1) {
+        msg1++; /* point past the ":" */
+        cmsg1++;
     }
-    hostname[j] = '\0';
 
-    snprintf(wildhost, line_len + 2, "*!%s", hostmask + strlen(nick) + 1);
+    char* nick = ir_slice_dup(&gdata.parsearena, l->nick);
+    char* hostname = ir_slice_dup(&gdata.parsearena, l->host);
+    char* wildhost = ir_arena_alloc(&gdata.parsearena, line_len + 2);
+
+    snprintf(wildhost, line_len + 2, "*!%s", hostmask + l->nick.len + 1);
+
+    j = 0;
 
     if (isthisforme(dest, msg1)) {
         if (verifyhost(&gdata.autoignore_exclude, hostmask)) {
@@ -117,7 +204,7 @@ void privmsgparse(const char* type, char* line) {
                 }
 
                 if (ignore->flags & IGN_IGNORING) {
-                    goto privmsgparse_cleanup;
+                    return;
                 }
                 break;
             }
@@ -157,21 +244,21 @@ noignore:
                    "\1CLIENTINFO DCC PING VERSION XDCC UPTIME "
                    ":Use CTCP CLIENTINFO <COMMAND> to get more specific "
                    "information\1");
-        } else if (strncmp(caps(msg2), "PING", 4) == 0) {
+        } else if (strncmp(cmsg2, "PING", 4) == 0) {
             notice(nick,
                    "\1CLIENTINFO PING returns the arguments it receives\1");
-        } else if (strncmp(caps(msg2), "DCC", 3) == 0) {
+        } else if (strncmp(cmsg2, "DCC", 3) == 0) {
             notice(nick,
                    "\1CLIENTINFO DCC requests a DCC for chatting or file "
                    "transfer\1");
-        } else if (strncmp(caps(msg2), "VERSION", 7) == 0) {
+        } else if (strncmp(cmsg2, "VERSION", 7) == 0) {
             notice(nick,
                    "\1CLIENTINFO VERSION shows information about this client's "
                    "version\1");
-        } else if (strncmp(caps(msg2), "XDCC", 4) == 0) {
+        } else if (strncmp(cmsg2, "XDCC", 4) == 0) {
             notice(nick,
                    "\1CLIENTINFO XDCC LIST|SEND list and DCC file(s) to you\1");
-        } else if (strncmp(caps(msg2), "UPTIME", 6) == 0) {
+        } else if (strncmp(cmsg2, "UPTIME", 6) == 0) {
             notice(nick,
                    "\1CLIENTINFO UPTIME shows how long this client has been "
                    "running\1");
@@ -234,7 +321,7 @@ noignore:
 
     /*----- DCC SEND/CHAT/RESUME ----- */
     else if (!gdata.ignore && gdata.caps_nick &&
-             !strcmp(gdata.caps_nick, dest) && !strcmp(caps(msg1), "\1DCC") &&
+             !strcmp(gdata.caps_nick, dest) && !strcmp(cmsg1, "\1DCC") &&
              msg2) {
         if (!gdata.attop) {
             gototop();
@@ -242,7 +329,7 @@ noignore:
 
         upload* ul;
 
-        if (!strcmp(caps(msg2), "RESUME") && msg3 && msg4 && msg5) {
+        if (!strcmp(cmsg2, "RESUME") && msg3 && msg4 && msg5) {
             gdata.inamnt[gdata.curtime % INAMNT_SIZE]++;
 
             caps(nick);
@@ -298,7 +385,7 @@ noignore:
                     tr = irlist_get_next(tr);
                 }
             }
-        } else if (!strcmp(caps(msg2), "CHAT")) {
+        } else if (!strcmp(cmsg2, "CHAT")) {
             if (verifyhost(&gdata.adminhost, hostmask)) {
                 ioutput(CALLTYPE_NORMAL, OUT_S | OUT_L | OUT_D, COLOR_MAGENTA,
                         "DCC CHAT attempt authorized from %s", hostmask);
@@ -310,7 +397,7 @@ noignore:
             }
         }
 
-        else if (!strcmp(caps(msg2), "SEND") && msg3 && msg4 && msg5 && msg6) {
+        else if (!strcmp(cmsg2, "SEND") && msg3 && msg4 && msg5 && msg6) {
             if (msg6[strlen(msg6) - 1] == '\1') {
                 msg6[strlen(msg6) - 1] = '\0';
             }
@@ -356,7 +443,7 @@ noignore:
             }
         }
 
-        else if (!strcmp(caps(msg2), "ACCEPT") && msg3 && msg4 && msg5) {
+        else if (!strcmp(cmsg2, "ACCEPT") && msg3 && msg4 && msg5) {
             if (msg5[strlen(msg5) - 1] == '\1') {
                 msg5[strlen(msg5) - 1] = '\0';
             }
@@ -406,7 +493,7 @@ noignore:
 
     /*----- ADMIN ----- */
     else if (!gdata.ignore && gdata.caps_nick &&
-             !strcmp(gdata.caps_nick, dest) && !strcmp(caps(msg1), "ADMIN")) {
+             !strcmp(gdata.caps_nick, dest) && !strcmp(cmsg1, "ADMIN")) {
         /*      msg2 = getpart(line,5); */
         if (!gdata.attop) {
             gototop();
@@ -443,11 +530,11 @@ noignore:
     /*----- XDCC ----- */
     else if (!gdata.ignore && gdata.caps_nick &&
              (!strcmp(gdata.caps_nick, dest) || gdata.respondtochannelxdcc) &&
-             (!strcmp(caps(msg1), "XDCC") || !strcmp(msg1, "\1XDCC") ||
-              !strcmp(caps(msg1), "CDCC") || !strcmp(msg1, "\1CDCC"))) {
+             (!strcmp(cmsg1, "XDCC") || !strcmp(cmsg1, "\1XDCC") ||
+              !strcmp(cmsg1, "CDCC") || !strcmp(cmsg1, "\1CDCC"))) {
         gdata.inamnt[gdata.curtime % INAMNT_SIZE]++;
 
-        caps(msg2);
+        msg2 = cmsg2;
 
         if (msg3 && msg3[strlen(msg3) - 1] == '\1') {
             msg3[strlen(msg3) - 1] = '\0';
@@ -557,20 +644,23 @@ noignore:
 
                 notice_slow(nick, "Searching for \"%s\"...", msg3);
 
-                int n = 1;
-                int k = 0;
-                xdcc* xd = irlist_get_head(&gdata.xdccs);
-                while (xd) {
-                    if (strstrnocase(xd->file, msg3) ||
-                        strstrnocase(xd->desc, msg3) ||
-                        strstrnocase(xd->note, msg3)) {
-                        notice_slow(nick, " - Pack #%i matches, \"%s\"", n,
-                                    xd->desc);
-                        k++;
+                xdcc** found;
+                int n;
+                int k = search_find(msg3, &found);
+
+                for (n = 0; n < k; n++) {
+                    if (gdata.searchmaxresults &&
+                        (n == gdata.searchmaxresults)) {
+                        notice_slow(nick,
+                                    " - %i more packs match, try a longer "
+                                    "search",
+                                    k - n);
+                        break;
                     }
-                    n++;
-                    xd = irlist_get_next(xd);
+                    notice_slow(nick, " - Pack #%i matches, \"%s\"",
+                                found[n]->packnum, found[n]->desc);
                 }
+                mydelete(found);
 
                 if (!k) {
                     notice_slow(nick,
@@ -584,8 +674,8 @@ noignore:
 
     /*----- !LIST ----- */
     else if (!gdata.ignore && gdata.caps_nick && gdata.respondtochannellist &&
-             msg1 && !strcasecmp(caps(msg1), "!LIST") &&
-             (!msg2 || !strcmp(caps(msg2), gdata.caps_nick))) {
+             msg1 && !strcasecmp(cmsg1, "!LIST") &&
+             (!msg2 || !strcmp(cmsg2, gdata.caps_nick))) {
         gdata.inamnt[gdata.curtime % INAMNT_SIZE]++;
 
         /* generate !list styled message */
@@ -611,7 +701,7 @@ noignore:
             if ((gdata.lognotices && !strcmp(type, "NOTICE")) ||
                 (gdata.logmessages && !strcmp(type, "PRIVMSG"))) {
                 msglog_t* ml;
-                char* begin;
+                const char* begin;
 
                 ioutput(CALLTYPE_NORMAL, OUT_S | OUT_D, COLOR_GREEN,
                         "%s from %s logged, use MSGREAD to display it.", type,
@@ -619,8 +709,10 @@ noignore:
 
                 ml = irlist_add(&gdata.msglog, sizeof(msglog_t));
 
-                begin =
-                    line + 5 + strlen(hostmask) + strlen(type) + strlen(dest);
+                begin = l->trailing;
+                if (!begin) {
+                    begin = msg1 ? l->word[3].ptr : "";
+                }
 
                 ml->when = gdata.curtime;
                 ml->hostmask = mymalloc(strlen(hostmask) + 1);
@@ -635,22 +727,4 @@ noignore:
             }
         }
     }
-
-privmsgparse_cleanup:
-
-    if (msg1) {
-        msg1--;
-    }
-
-    mydelete(dest);
-    mydelete(nick);
-    mydelete(hostname);
-    mydelete(hostmask);
-    mydelete(wildhost);
-    mydelete(msg1);
-    mydelete(msg2);
-    mydelete(msg3);
-    mydelete(msg4);
-    mydelete(msg5);
-    mydelete(msg6);
 }
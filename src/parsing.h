@@ -9,6 +9,10 @@
 #ifndef IROFFER_PARSING_H
 #define IROFFER_PARSING_H
 
-void privmsgparse(const char* type, char* line);
+ir_line_t* ir_line_parse(ir_arena_t* arena, char* line);
+char* ir_line_word(const ir_line_t* l, int n);
+char* ir_line_caps(const ir_line_t* l, int n);
+char* ir_slice_dup(ir_arena_t* arena, ir_slice_t slice);
+void privmsgparse(const char* type, const ir_line_t* l);
 
 #endif // IROFFER_PARSING_H
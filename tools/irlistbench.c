@@ -0,0 +1,162 @@
+/*
+iroffer - An IRC file server using the DCC protocol
+Copyright (C) see CONTRIBUTORS
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * irlistbench - compare the irlist functions with the way they used to
+ * work: a malloc() per item, insertion sort and irlist_get_nth() from the
+ * head
+ *
+ * build with "make irlistbench", run as "./irlistbench [items]"
+ */
+
+#include "iroffer_config.h"
+#include "iroffer_defines.h"
+#include "iroffer_headers.h"
+#include "iroffer_globals.h"
+
+#define IRLISTBENCH_SIZE 48
+#define IRLISTBENCH_ROUNDS 10
+
+static double irlistbench_now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+static void irlistbench_result(const char* what, double before, double after) {
+    printf("%-22s: %9.2f ms before, %9.2f ms after, %6.1fx\n", what,
+           before * 1000, after * 1000, before / after);
+}
+
+/* irlist_sort() as it was */
+static void irlistbench_insertion_sort(irlist_t* list) {
+    irlist_t newlist = {};
+    void *cur, *at;
+
+    while ((cur = irlist_get_head(list))) {
+        irlist_remove(list, cur);
+
+        for (at = irlist_get_head(&newlist); at; at = irlist_get_next(at)) {
+            if (irlist_sort_cmpfunc_int(NULL, cur, at) < 0) {
+                irlist_insert_before(&newlist, cur, at);
+                break;
+            }
+        }
+
+        if (!at) {
+            irlist_insert_tail(&newlist, cur);
+        }
+    }
+
+    *list = newlist;
+}
+
+static void irlistbench_fill(irlist_t* list, int items) {
+    int i;
+
+    srand(1);
+    for (i = 0; i < items; i++) {
+        *(int*)irlist_add(list, sizeof(int)) = rand() % items;
+    }
+}
+
+int main(int argc, char** argv) {
+    irlist_t list = {};
+    irlist_t list2 = {};
+    irlist_item_t* iitem;
+    double start, before, after;
+    int items, i, r, bad;
+    int *a, *b;
+    long sum;
+
+    items = (argc > 1) ? atoi(argv[1]) : 20000;
+
+    printf("irlist: %d items\n", items);
+
+    /* add and delete */
+    start = irlistbench_now();
+    for (r = 0; r < IRLISTBENCH_ROUNDS; r++) {
+        for (i = 0; i < items; i++) {
+            iitem = mycalloc(sizeof(irlist_item_t) + IRLISTBENCH_SIZE);
+            irlist_insert_tail(&list, iitem + 1);
+        }
+        while ((a = irlist_get_head(&list))) {
+            irlist_remove(&list, a);
+            iitem = (irlist_item_t*)a - 1;
+            mydelete(iitem);
+        }
+    }
+    before = irlistbench_now() - start;
+
+    start = irlistbench_now();
+    for (r = 0; r < IRLISTBENCH_ROUNDS; r++) {
+        for (i = 0; i < items; i++) {
+            irlist_add(&list, IRLISTBENCH_SIZE);
+        }
+        irlist_delete_all(&list);
+    }
+    after = irlistbench_now() - start;
+    irlistbench_result("add + delete", before, after);
+
+    /* sort */
+    irlistbench_fill(&list, items);
+    irlistbench_fill(&list2, items);
+
+    start = irlistbench_now();
+    irlistbench_insertion_sort(&list);
+    before = irlistbench_now() - start;
+
+    start = irlistbench_now();
+    irlist_sort(&list2, irlist_sort_cmpfunc_int, NULL);
+    after = irlistbench_now() - start;
+    irlistbench_result("sort", before, after);
+
+    bad = 0;
+    for (a = irlist_get_head(&list), b = irlist_get_head(&list2); a && b;
+         a = irlist_get_next(a), b = irlist_get_next(b)) {
+        bad += (*a != *b);
+    }
+
+    /* every item by number */
+    sum = 0;
+    start = irlistbench_now();
+    for (i = 0; i < items; i++) {
+        for (a = irlist_get_head(&list), r = i; r--; a = irlist_get_next(a)) {
+            ;
+        }
+        sum += *a;
+    }
+    before = irlistbench_now() - start;
+
+    start = irlistbench_now();
+    for (i = 0; i < items; i++) {
+        sum -= *(int*)irlist_get_nth(&list2, i);
+    }
+    after = irlistbench_now() - start;
+    irlistbench_result("get_nth 0..n-1", before, after);
+
+    if (bad || sum) {
+        printf("MISMATCH\n");
+        return 1;
+    }
+
+    irlist_delete_all(&list);
+    irlist_delete_all(&list2);
+
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+iroffer - An IRC file server using the DCC protocol
+Copyright (C) see CONTRIBUTORS
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * md5bench - compare MD5_Update with the multi-buffer md5 kernels
+ *
+ * build with "make md5bench", run as "./md5bench [MB per stream]"
+ */
+
+#include "iroffer_config.h"
+#include "iroffer_defines.h"
+#include "iroffer_headers.h"
+
+static double md5bench_now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+int main(int argc, char** argv) {
+    unsigned char* data[MD5MB_MAXLANES];
+    MD5Digest expect[MD5MB_MAXLANES];
+    MD5Digest got[MD5MB_MAXLANES];
+    md5mb_t mb[MD5MB_MAXLANES];
+    md5mb_t* ctx[MD5MB_MAXLANES];
+    MD5_CTX md5;
+    size_t size, i;
+    double start, secs;
+    int lanes, n, j, bad;
+
+    size = ((argc > 1) ? atoi(argv[1]) : 64) * 1024 * 1024 + 13;
+    lanes = md5mb_maxlanes();
+
+    for (j = 0; j < MD5MB_MAXLANES; j++) {
+        data[j] = malloc(size);
+        if (!data[j]) {
+            fprintf(stderr, "out of memory\n");
+            return 1;
+        }
+        for (i = 0; i < size; i++) {
+            data[j][i] = (unsigned char)((i * 31) ^ (i >> 9) ^ (j * 7));
+        }
+    }
+
+    printf("multi-buffer md5: %d lanes available, %zu bytes per stream\n",
+           lanes, size);
+
+    start = md5bench_now();
+    for (j = 0; j < MD5MB_MAXLANES; j++) {
+        MD5_Init(&md5);
+        MD5_Update(&md5, data[j], size);
+        MD5_Final(expect[j], &md5);
+    }
+    secs = md5bench_now() - start;
+    printf("MD5_Update   1 stream : %8.1f MB/s\n",
+           (MD5MB_MAXLANES * (double)size) / secs / 1024 / 1024);
+
+    for (n = 1; n <= MD5MB_MAXLANES; n *= 2) {
+        if ((n > 1) && (n > lanes)) {
+            break;
+        }
+
+        start = md5bench_now();
+        for (j = 0; j < MD5MB_MAXLANES; j += n) {
+            int k;
+            for (k = 0; k < n; k++) {
+                md5mb_init(&mb[j + k]);
+                ctx[k] = &mb[j + k];
+            }
+            md5mb_blocks(ctx, (const unsigned char* const*)&data[j], n,
+                         size / 64);
+        }
+        for (j = 0; j < MD5MB_MAXLANES; j++) {
+            md5mb_final(&mb[j], data[j] + (size / 64) * 64, size % 64, got[j]);
+        }
+        secs = md5bench_now() - start;
+
+        for (j = 0, bad = 0; j < MD5MB_MAXLANES; j++) {
+            bad += memcmp(got[j], expect[j], sizeof(MD5Digest)) ? 1 : 0;
+        }
+
+        printf("md5mb      %2d streams: %8.1f MB/s%s\n", n,
+               (MD5MB_MAXLANES * (double)size) / secs / 1024 / 1024,
+               bad ? " MISMATCH" : "");
+    }
+
+    return 0;
+}
@@ -0,0 +1,183 @@
+/*
+iroffer - An IRC file server using the DCC protocol
+Copyright (C) see CONTRIBUTORS
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * parsebench - compare splitting server lines with getpart() and caps() for
+ * every word, as parseline() and privmsgparse() used to, with
+ * ir_line_parse()
+ *
+ * build with "make parsebench", run as "./parsebench [file [rounds]]"
+ *
+ * file has one server line per line, e.g. the ">IRC>: " lines of a log
+ * written with debug on.  Without it a built-in sample is used.
+ */
+
+#include "iroffer_config.h"
+#include "iroffer_defines.h"
+#include "iroffer_headers.h"
+#include "iroffer_globals.h"
+#include "parsing.h"
+
+#define PARSEBENCH_ROUNDS 20000
+
+static const char* parsebench_sample[] = {
+    ":joe!~joe@host-1.example.net PRIVMSG MyBot :xdcc send #12",
+    ":ann!ann@10.0.0.7 PRIVMSG MyBot :\1XDCC LIST\1",
+    ":bob!b@users.example.org PRIVMSG #files :!list",
+    ":bob!b@users.example.org PRIVMSG #files :anyone have the new release?",
+    ":sue!sue@cable.example.com PRIVMSG MyBot :\1DCC RESUME file.zip 4000 "
+    "104857600\1",
+    ":sue!sue@cable.example.com PRIVMSG MyBot :xdcc search release 2",
+    ":kim!kim@dsl.example.net PRIVMSG MyBot :\1VERSION\1",
+    ":kim!kim@dsl.example.net NOTICE MyBot :\1VERSION irssi v1.4.5\1",
+    ":tom!tom@host.example JOIN :#files",
+    ":tom!tom@host.example PART #files :Leaving",
+    ":lea!lea@host.example QUIT :Quit: Connection reset by peer",
+    ":lea!lea@host.example NICK :lea_away",
+    ":op!op@services.example MODE #files +ov tom joe",
+    ":irc.example.net 353 MyBot = #files :@op +joe ann bob sue kim tom lea "
+    "max ida eve ray",
+    ":irc.example.net 366 MyBot #files :End of /NAMES list.",
+    "PING :irc.example.net",
+    ":irc.example.net 005 MyBot PREFIX=(ov)@+ CHANMODES=b,k,l,imnpst "
+    "NICKLEN=30 :are supported by this server",
+};
+
+static double parsebench_now(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + (tv.tv_usec / 1000000.0);
+}
+
+static int parsebench_load(const char* file, irlist_t* lines) {
+    char buf[maxtextlength];
+    char *line, *p;
+    FILE* fp;
+    int i;
+
+    if (!file) {
+        for (i = 0; i < sizeof(parsebench_sample) / sizeof(char*); i++) {
+            line = irlist_add(lines, strlen(parsebench_sample[i]) + 1);
+            strcpy(line, parsebench_sample[i]);
+        }
+        return 0;
+    }
+
+    fp = fopen(file, "r");
+    if (!fp) {
+        perror(file);
+        return 1;
+    }
+
+    while (fgets(buf, sizeof(buf), fp)) {
+        p = strstr(buf, ">IRC>: ");
+        p = p ? p + 7 : buf;
+        p[strcspn(p, "\r\n")] = '\0';
+        if (*p) {
+            line = irlist_add(lines, strlen(p) + 1);
+            strcpy(line, p);
+        }
+    }
+
+    fclose(fp);
+    return 0;
+}
+
+/* the same words from both, and nothing more */
+static int parsebench_check(char* line) {
+    ir_line_t* l;
+    char* part;
+    int n, bad;
+
+    l = ir_line_parse(&gdata.parsearena, line);
+    bad = 0;
+
+    for (n = 1; (part = getpart(line, n)); n++) {
+        bad += !ir_line_word(l, n) || strcmp(part, ir_line_word(l, n)) ||
+               strcmp(caps(part), ir_line_caps(l, n));
+        mydelete(part);
+    }
+    bad += (n - 1 != l->count);
+
+    ir_arena_reset(&gdata.parsearena);
+    return bad;
+}
+
+int main(int argc, char** argv) {
+    irlist_t lines = {};
+    ir_line_t* l;
+    char *line, *part;
+    double start, before, after;
+    int rounds, r, n, count, bad;
+    long sum;
+
+    rounds = (argc > 2) ? atoi(argv[2]) : PARSEBENCH_ROUNDS;
+
+    if (parsebench_load(argc > 1 ? argv[1] : NULL, &lines)) {
+        return 1;
+    }
+
+    count = irlist_size(&lines);
+    printf("parse: %d lines, %d rounds\n", count, rounds);
+
+    bad = 0;
+    for (line = irlist_get_head(&lines); line; line = irlist_get_next(line)) {
+        bad += parsebench_check(line);
+    }
+
+    sum = 0;
+    start = parsebench_now();
+    for (r = 0; r < rounds; r++) {
+        for (line = irlist_get_head(&lines); line;
+             line = irlist_get_next(line)) {
+            for (n = 1; (part = getpart(line, n)); n++) {
+                sum += caps(part)[0];
+                mydelete(part);
+            }
+        }
+    }
+    before = parsebench_now() - start;
+
+    start = parsebench_now();
+    for (r = 0; r < rounds; r++) {
+        for (line = irlist_get_head(&lines); line;
+             line = irlist_get_next(line)) {
+            l = ir_line_parse(&gdata.parsearena, line);
+            for (n = 1; n <= l->count; n++) {
+                sum -= ir_line_caps(l, n)[0];
+            }
+            ir_arena_reset(&gdata.parsearena);
+        }
+    }
+    after = parsebench_now() - start;
+
+    printf("%-22s: %9.2f ms before, %9.2f ms after, %6.1fx\n",
+           "split + fold", before * 1000, after * 1000, before / after);
+    printf("%-22s: %9.1f ns before, %9.1f ns after\n", "per line",
+           before * 1e9 / ((double)rounds * count),
+           after * 1e9 / ((double)rounds * count));
+
+    if (bad || sum) {
+        printf("MISMATCH\n");
+        return 1;
+    }
+
+    irlist_delete_all(&lines);
+
+    return 0;
+}